@@ -27,6 +27,8 @@
 #include <src/mem.h>
 
 #define malloc  mem_alloc
+#define calloc  mem_calloc
+#define realloc mem_realloc
 #define free    mem_free
 
 #endif /* _STDLIB_H */
@@ -28,6 +28,7 @@
 
 void * memmove(void *dest, const void *src, size_t n);
 void * memcpy(void * restrict dest, const void * restrict src, size_t n);
+void * memset(void *s, int c, size_t n);
 char * strcpy(char *dest, const char *src);
 size_t strlen(const char *s);
 int strcmp(const char *s1, const char *s2);
@@ -1221,6 +1221,7 @@ shell_setup(void)
     int error;
 
     mutex_init(&shell_lock);
+    mutex_set_name(&shell_lock, "shell");
 
     for (i = 0; i < ARRAY_SIZE(shell_default_cmds); i++) {
         error = shell_cmd_register(&shell_default_cmds[i]);
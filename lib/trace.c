@@ -0,0 +1,411 @@
+/*
+ * Copyright (c) 2017 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <lib/macros.h>
+#include <lib/trace.h>
+
+#include <src/error.h>
+
+static bool
+trace_isblank(char c)
+{
+    return (c == ' ') || (c == '\t') || (c == '\r');
+}
+
+static bool
+trace_isdigit(char c)
+{
+    return (c >= '0') && (c <= '9');
+}
+
+/*
+ * Parse a decimal number, preceded by at least one blank character.
+ */
+static int
+trace_parse_number(const char **strp, const char *end, uint32_t *valuep)
+{
+    const char *str;
+    uint32_t value;
+
+    str = *strp;
+
+    if ((str == end) || !trace_isblank(*str)) {
+        return ERROR_INVAL;
+    }
+
+    while ((str < end) && trace_isblank(*str)) {
+        str++;
+    }
+
+    if ((str == end) || !trace_isdigit(*str)) {
+        return ERROR_INVAL;
+    }
+
+    value = 0;
+
+    while ((str < end) && trace_isdigit(*str)) {
+        if (value > ((UINT32_MAX - 9) / 10)) {
+            return ERROR_INVAL;
+        }
+
+        value = (value * 10) + (*str - '0');
+        str++;
+    }
+
+    *strp = str;
+    *valuep = value;
+    return 0;
+}
+
+static int
+trace_parse_line(const char *str, const char *end, struct trace_op *op)
+{
+    int error;
+
+    switch (*str) {
+    case 'a':
+        op->type = TRACE_OP_ALLOC;
+        break;
+    case 'r':
+        op->type = TRACE_OP_REALLOC;
+        break;
+    case 'f':
+        op->type = TRACE_OP_FREE;
+        break;
+    default:
+        return ERROR_INVAL;
+    }
+
+    str++;
+    error = trace_parse_number(&str, end, &op->id);
+
+    if (error) {
+        return error;
+    }
+
+    if (op->type == TRACE_OP_FREE) {
+        op->size = 0;
+    } else {
+        error = trace_parse_number(&str, end, &op->size);
+
+        if (error) {
+            return error;
+        }
+    }
+
+    while ((str < end) && trace_isblank(*str)) {
+        str++;
+    }
+
+    return (str == end) ? 0 : ERROR_INVAL;
+}
+
+int
+trace_parse(const char *text, size_t size, struct trace_op *ops,
+            struct trace_info *info)
+{
+    const char *str, *end, *line_end;
+    struct trace_op op;
+    int error;
+
+    info->nr_ops = 0;
+    info->nr_blocks = 0;
+    info->line = 0;
+
+    str = text;
+    end = text + size;
+
+    while (str < end) {
+        info->line++;
+        line_end = str;
+
+        while ((line_end < end) && (*line_end != '\n')) {
+            line_end++;
+        }
+
+        while ((str < line_end) && trace_isblank(*str)) {
+            str++;
+        }
+
+        if ((str < line_end) && (*str != '#')) {
+            error = trace_parse_line(str, line_end, &op);
+
+            if (error) {
+                return error;
+            }
+
+            if (op.id >= info->nr_blocks) {
+                info->nr_blocks = (size_t)op.id + 1;
+            }
+
+            if (ops) {
+                ops[info->nr_ops] = op;
+            }
+
+            info->nr_ops++;
+        }
+
+        str = line_end + 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Return the index of the most significant bit set in a non-zero value.
+ */
+static unsigned int
+trace_fls(uint64_t value)
+{
+    uint32_t high;
+
+    assert(value != 0);
+
+    high = value >> 32;
+
+    if (high != 0) {
+        return 63 - __builtin_clz(high);
+    }
+
+    return 31 - __builtin_clz((uint32_t)value);
+}
+
+static size_t
+trace_hist_index(uint64_t time)
+{
+    unsigned int msb, shift;
+
+    if (time < TRACE_HIST_SUB_COUNT) {
+        return time;
+    }
+
+    msb = trace_fls(time);
+    shift = msb - TRACE_HIST_SUB_SHIFT;
+    return ((size_t)(shift + 1) * TRACE_HIST_SUB_COUNT)
+           + ((time >> shift) & (TRACE_HIST_SUB_COUNT - 1));
+}
+
+static uint64_t
+trace_hist_value(size_t index)
+{
+    unsigned int shift;
+
+    if (index < TRACE_HIST_SUB_COUNT) {
+        return index;
+    }
+
+    shift = (index / TRACE_HIST_SUB_COUNT) - 1;
+    return (uint64_t)(TRACE_HIST_SUB_COUNT + (index % TRACE_HIST_SUB_COUNT))
+           << shift;
+}
+
+static void
+trace_stats_init(struct trace_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+}
+
+static void
+trace_stats_add(struct trace_stats *stats, uint64_t time)
+{
+    stats->nr_ops++;
+    stats->total_time += time;
+
+    if (time > stats->max_time) {
+        stats->max_time = time;
+    }
+
+    stats->hist[trace_hist_index(time)]++;
+}
+
+static void
+trace_stats_set_live_size(struct trace_stats *stats, size_t size)
+{
+    stats->live_size = size;
+
+    if (size > stats->peak_live_size) {
+        stats->peak_live_size = size;
+    }
+}
+
+void
+trace_replay(const struct trace_op *ops, size_t nr_ops,
+             struct trace_block *blocks, size_t nr_blocks,
+             const struct trace_allocator *allocator,
+             struct trace_stats *stats)
+{
+    const struct trace_op *op;
+    struct trace_block *block;
+    uint64_t start, end;
+    void *ptr;
+
+    trace_stats_init(stats);
+
+    for (size_t i = 0; i < nr_blocks; i++) {
+        blocks[i].ptr = NULL;
+        blocks[i].size = 0;
+    }
+
+    for (size_t i = 0; i < nr_ops; i++) {
+        op = &ops[i];
+        assert(op->id < nr_blocks);
+        block = &blocks[op->id];
+
+        switch (op->type) {
+        case TRACE_OP_ALLOC:
+            if (block->ptr) {
+                stats->nr_invalid++;
+                continue;
+            }
+
+            start = allocator->clock();
+            ptr = allocator->alloc(op->size);
+            end = allocator->clock();
+
+            if (!ptr) {
+                stats->nr_failures++;
+                break;
+            }
+
+            block->ptr = ptr;
+            block->size = op->size;
+            trace_stats_set_live_size(stats, stats->live_size + op->size);
+            break;
+        case TRACE_OP_REALLOC:
+            start = allocator->clock();
+            ptr = allocator->realloc(block->ptr, op->size);
+            end = allocator->clock();
+
+            /*
+             * Resizing to 0 frees the block, as with realloc().
+             */
+            if (!ptr && (op->size != 0)) {
+                stats->nr_failures++;
+                break;
+            }
+
+            trace_stats_set_live_size(stats, stats->live_size - block->size
+                                             + op->size);
+            block->ptr = ptr;
+            block->size = op->size;
+            break;
+        default:
+            assert(op->type == TRACE_OP_FREE);
+
+            if (!block->ptr) {
+                stats->nr_invalid++;
+                continue;
+            }
+
+            start = allocator->clock();
+            allocator->free(block->ptr);
+            end = allocator->clock();
+
+            trace_stats_set_live_size(stats, stats->live_size - block->size);
+            block->ptr = NULL;
+            block->size = 0;
+            break;
+        }
+
+        trace_stats_add(stats, end - start);
+    }
+}
+
+void
+trace_release(struct trace_block *blocks, size_t nr_blocks,
+              const struct trace_allocator *allocator)
+{
+    for (size_t i = 0; i < nr_blocks; i++) {
+        if (blocks[i].ptr) {
+            allocator->free(blocks[i].ptr);
+            blocks[i].ptr = NULL;
+            blocks[i].size = 0;
+        }
+    }
+}
+
+uint64_t
+trace_stats_percentile(const struct trace_stats *stats, unsigned int percent)
+{
+    uint64_t target, count;
+
+    assert(percent <= 100);
+
+    if (stats->nr_ops == 0) {
+        return 0;
+    }
+
+    target = (((uint64_t)stats->nr_ops * percent) + 99) / 100;
+
+    if (target == 0) {
+        target = 1;
+    }
+
+    count = 0;
+
+    for (size_t i = 0; i < ARRAY_SIZE(stats->hist); i++) {
+        count += stats->hist[i];
+
+        if (count >= target) {
+            return trace_hist_value(i);
+        }
+    }
+
+    return stats->max_time;
+}
+
+void
+trace_stats_print(const struct trace_stats *stats, const char *prefix)
+{
+    unsigned long long time_per_op, ops_per_mcycle;
+
+    if (stats->nr_ops == 0) {
+        time_per_op = 0;
+    } else {
+        time_per_op = stats->total_time / stats->nr_ops;
+    }
+
+    if (stats->total_time == 0) {
+        ops_per_mcycle = 0;
+    } else {
+        ops_per_mcycle = ((uint64_t)stats->nr_ops * 1000000)
+                         / stats->total_time;
+    }
+
+    printf("%s: operations: %lu, failures: %lu, invalid: %lu\n", prefix,
+           stats->nr_ops, stats->nr_failures, stats->nr_invalid);
+    printf("%s: throughput: %llu cycles per operation, "
+           "%llu operations per million cycles\n",
+           prefix, time_per_op, ops_per_mcycle);
+    printf("%s: latency: p50: %llu, p99: %llu, max: %llu cycles\n", prefix,
+           (unsigned long long)trace_stats_percentile(stats, 50),
+           (unsigned long long)trace_stats_percentile(stats, 99),
+           (unsigned long long)stats->max_time);
+    printf("%s: peak live size: %zu bytes\n", prefix, stats->peak_live_size);
+}
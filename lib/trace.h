@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2017 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ *
+ * Allocation trace replay.
+ *
+ * A trace records the allocation requests of a program, so that they can
+ * be replayed later through different allocators, or different versions
+ * of the same allocator, and the results compared. Traces are text, one
+ * request per line :
+ *
+ * a <id> <size>    allocate size bytes, the block being named id
+ * r <id> <size>    resize block id to size bytes
+ * f <id>           free block id
+ *
+ * Block ids are decimal integers, which may be reused once their block is
+ * freed. They index a table of blocks, so recorders should keep them
+ * small, e.g. by reusing the lowest free id. Empty lines and lines
+ * starting with '#' are ignored.
+ *
+ * Traces are parsed into an array of operations first, so that parsing
+ * doesn't disturb the replay. Each allocator call is then timed, and
+ * latencies accounted in a histogram with a resolution of about 6%, which
+ * is enough for percentiles without storing one sample per operation.
+ *
+ * This module doesn't depend on the kernel, so that the same replay can
+ * be built for the host, and run against the host C library.
+ */
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Latency histogram parameters.
+ *
+ * Each power-of-two range of latencies is divided in TRACE_HIST_SUB_COUNT
+ * linear buckets.
+ */
+#define TRACE_HIST_SUB_SHIFT    4
+#define TRACE_HIST_SUB_COUNT    (1 << TRACE_HIST_SUB_SHIFT)
+#define TRACE_HIST_SIZE         ((64 - TRACE_HIST_SUB_SHIFT + 1) \
+                                 * TRACE_HIST_SUB_COUNT)
+
+enum trace_op_type {
+    TRACE_OP_ALLOC,
+    TRACE_OP_REALLOC,
+    TRACE_OP_FREE,
+};
+
+struct trace_op {
+    uint32_t type;
+    uint32_t id;
+    uint32_t size;
+};
+
+/*
+ * Block table entry.
+ */
+struct trace_block {
+    void *ptr;
+    size_t size;
+};
+
+/*
+ * Result of parsing a trace.
+ *
+ * On error, line is the number of the offending line.
+ */
+struct trace_info {
+    size_t nr_ops;
+    size_t nr_blocks;
+    unsigned long line;
+};
+
+/*
+ * Allocator interface.
+ *
+ * The clock function returns the current time in arbitrary units, which
+ * are also the units of the reported latencies.
+ */
+struct trace_allocator {
+    void * (*alloc)(size_t size);
+    void * (*realloc)(void *ptr, size_t size);
+    void (*free)(void *ptr);
+    uint64_t (*clock)(void);
+};
+
+/*
+ * Replay statistics.
+ *
+ * Operations include failed allocations, but not invalid operations,
+ * such as allocating a block id which is already in use, or freeing one
+ * which isn't. The live size is the total size requested for blocks
+ * currently allocated, without any allocator overhead.
+ */
+struct trace_stats {
+    unsigned long nr_ops;
+    unsigned long nr_failures;
+    unsigned long nr_invalid;
+    uint64_t total_time;
+    uint64_t max_time;
+    size_t live_size;
+    size_t peak_live_size;
+    uint32_t hist[TRACE_HIST_SIZE];
+};
+
+/*
+ * Parse a trace.
+ *
+ * If ops is NULL, operations are only counted, so that the caller may
+ * allocate the arrays of operations and blocks. Return ERROR_INVAL if
+ * the trace is malformed.
+ */
+int trace_parse(const char *text, size_t size, struct trace_op *ops,
+                struct trace_info *info);
+
+/*
+ * Replay a parsed trace.
+ *
+ * The block table must contain the number of blocks reported by
+ * trace_parse(), and is initialized by this function. Blocks still
+ * allocated at the end of the trace are left allocated, so that the
+ * state of the allocator can be inspected, and must then be released
+ * with trace_release().
+ */
+void trace_replay(const struct trace_op *ops, size_t nr_ops,
+                  struct trace_block *blocks, size_t nr_blocks,
+                  const struct trace_allocator *allocator,
+                  struct trace_stats *stats);
+
+/*
+ * Release the blocks left allocated by trace_replay().
+ */
+void trace_release(struct trace_block *blocks, size_t nr_blocks,
+                   const struct trace_allocator *allocator);
+
+/*
+ * Return the given percentile of operation latencies.
+ *
+ * The returned value is the lower bound of the histogram bucket the
+ * percentile falls in.
+ */
+uint64_t trace_stats_percentile(const struct trace_stats *stats,
+                                unsigned int percent);
+
+/*
+ * Print replay statistics, each line starting with the given prefix.
+ *
+ * Times are reported in clock units, normally TSC cycles, both in the
+ * kernel and on the host.
+ */
+void trace_stats_print(const struct trace_stats *stats, const char *prefix);
+
+#endif /* _TRACE_H */
@@ -12,6 +12,10 @@
 #       -D int_debug.log \
 #
 # Note that these debugging options do not work when KVM is enabled.
+#
+# In order to replay an allocation trace with the bench_trace command, it
+# may be loaded as a boot module with the following option :
+#       -initrd trace.txt \
 qemu-system-i386 \
         -gdb tcp::1234 \
         -m 64 \
@@ -0,0 +1,209 @@
+/*
+ * Copyright (c) 2017 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <lib/list.h>
+#include <lib/macros.h>
+
+#include "arena.h"
+#include "mem.h"
+
+/*
+ * Chunk of memory objects are allocated from.
+ *
+ * The header is stored at the beginning of the chunk, and objects are
+ * allocated from the first aligned address following it, up to the end
+ * of the chunk.
+ *
+ * Chunks are kept in the order they're used. Chunks following the current
+ * chunk only contain released objects, and are reused when the current
+ * chunk is full.
+ */
+struct arena_chunk {
+    struct list node;
+    char *ptr;
+    char *end;
+};
+
+static char *
+arena_chunk_start(struct arena_chunk *chunk)
+{
+    return (char *)P2ROUND((uintptr_t)(chunk + 1), ARENA_ALIGN);
+}
+
+static size_t
+arena_chunk_avail(const struct arena_chunk *chunk)
+{
+    return chunk->end - chunk->ptr;
+}
+
+static void
+arena_chunk_clear(struct arena_chunk *chunk)
+{
+    chunk->ptr = arena_chunk_start(chunk);
+}
+
+static void *
+arena_chunk_alloc(struct arena_chunk *chunk, size_t size)
+{
+    void *ptr;
+
+    assert(size <= arena_chunk_avail(chunk));
+
+    ptr = chunk->ptr;
+    chunk->ptr += size;
+    return ptr;
+}
+
+static struct arena_chunk *
+arena_chunk_create(size_t chunk_size, size_t size)
+{
+    struct arena_chunk *chunk;
+    size_t header_size;
+
+    /* Account for the worst case alignment of the chunk start */
+    header_size = sizeof(*chunk) + ARENA_ALIGN - 1;
+
+    if (size > (SIZE_MAX - header_size)) {
+        return NULL;
+    }
+
+    chunk_size = MAX(chunk_size, header_size + size);
+    chunk = mem_alloc(chunk_size);
+
+    if (!chunk) {
+        return NULL;
+    }
+
+    chunk->end = (char *)chunk + chunk_size;
+    arena_chunk_clear(chunk);
+    return chunk;
+}
+
+void
+arena_init(struct arena *arena, size_t chunk_size)
+{
+    list_init(&arena->chunks);
+    arena->current = NULL;
+    arena->chunk_size = (chunk_size == 0) ? ARENA_CHUNK_SIZE : chunk_size;
+}
+
+void
+arena_destroy(struct arena *arena)
+{
+    struct arena_chunk *chunk, *tmp;
+
+    list_for_each_entry_safe(&arena->chunks, chunk, tmp, node) {
+        mem_free(chunk);
+    }
+
+    list_init(&arena->chunks);
+    arena->current = NULL;
+}
+
+/*
+ * Slow path of arena_alloc(), taken when the current chunk is full.
+ *
+ * Chunks following the current one are reused first, and a new chunk is
+ * inserted after the current one if none of them is large enough.
+ */
+static void *
+arena_alloc_slow(struct arena *arena, size_t size)
+{
+    struct arena_chunk *chunk;
+    struct list *node;
+
+    node = arena->current
+           ? list_next(&arena->current->node)
+           : list_first(&arena->chunks);
+
+    while (!list_end(&arena->chunks, node)) {
+        chunk = list_entry(node, struct arena_chunk, node);
+        arena_chunk_clear(chunk);
+
+        if (size <= arena_chunk_avail(chunk)) {
+            arena->current = chunk;
+            return arena_chunk_alloc(chunk, size);
+        }
+
+        node = list_next(node);
+    }
+
+    chunk = arena_chunk_create(arena->chunk_size, size);
+
+    if (!chunk) {
+        return NULL;
+    }
+
+    if (arena->current) {
+        list_insert_after(&arena->current->node, &chunk->node);
+    } else {
+        list_insert_head(&arena->chunks, &chunk->node);
+    }
+
+    arena->current = chunk;
+    return arena_chunk_alloc(chunk, size);
+}
+
+void *
+arena_alloc(struct arena *arena, size_t size)
+{
+    struct arena_chunk *chunk;
+
+    if ((size == 0) || (size > (SIZE_MAX - ARENA_ALIGN + 1))) {
+        return NULL;
+    }
+
+    size = P2ROUND(size, ARENA_ALIGN);
+    chunk = arena->current;
+
+    if (likely(chunk && (size <= arena_chunk_avail(chunk)))) {
+        return arena_chunk_alloc(chunk, size);
+    }
+
+    return arena_alloc_slow(arena, size);
+}
+
+void
+arena_mark(const struct arena *arena, struct arena_mark *mark)
+{
+    mark->chunk = arena->current;
+    mark->ptr = arena->current ? arena->current->ptr : NULL;
+}
+
+void
+arena_reset(struct arena *arena, const struct arena_mark *mark)
+{
+    if (!mark || !mark->chunk) {
+        arena->current = NULL;
+        return;
+    }
+
+    assert(mark->ptr >= arena_chunk_start(mark->chunk));
+    assert(mark->ptr <= mark->chunk->ptr);
+
+    arena->current = mark->chunk;
+    arena->current->ptr = mark->ptr;
+}
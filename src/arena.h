@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2017 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ *
+ * Region-based allocator.
+ *
+ * An arena, also called a region or zone [1], serves allocations by
+ * bumping a pointer in large chunks obtained from the mem module. Objects
+ * can't be freed individually. Instead, the state of an arena may be
+ * recorded in a mark, and resetting the arena to that mark releases all
+ * objects allocated since, at once. Allocating is then only a pointer
+ * comparison and an addition in the common case, freeing costs nothing,
+ * and objects allocated together end up next to each other in memory.
+ *
+ * This suits request-scoped work, e.g. a command that builds many small,
+ * short-lived objects, all of which may be discarded when it completes.
+ * Chunks aren't returned to the heap on reset, so that an arena used
+ * repeatedly doesn't keep allocating and freeing them. They're released
+ * when the arena is destroyed, in time proportional to their number.
+ *
+ * Arenas aren't thread-safe. They're meant to be owned by a single thread,
+ * usually on its stack, and users must provide their own synchronization
+ * otherwise.
+ *
+ * [1] D. R. Hanson. Fast allocation and deallocation of memory based on
+ * object lifetimes. Software: Practice and Experience, 20(1), 1990.
+ */
+
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+
+#include <lib/list.h>
+
+/*
+ * Alignment of objects allocated from an arena.
+ *
+ * This is stricter than the alignment of mem_alloc(), so that 64-bits
+ * integers don't straddle cache lines.
+ */
+#define ARENA_ALIGN 8
+
+/*
+ * Default size of arena chunks, including their header.
+ */
+#define ARENA_CHUNK_SIZE 4096
+
+struct arena_chunk;
+
+/*
+ * Arena.
+ *
+ * All members are private.
+ */
+struct arena {
+    struct list chunks;
+    struct arena_chunk *current;
+    size_t chunk_size;
+};
+
+/*
+ * Arena mark.
+ *
+ * A mark records the allocation state of an arena, which may be restored
+ * later with arena_reset().
+ *
+ * All members are private.
+ */
+struct arena_mark {
+    struct arena_chunk *chunk;
+    char *ptr;
+};
+
+/*
+ * Initialize an arena.
+ *
+ * The chunk size is the size of memory obtained from the mem module each
+ * time the current chunk is full. If 0, ARENA_CHUNK_SIZE is used. Larger
+ * chunks waste more memory but make refills less frequent. No memory is
+ * allocated until the first allocation.
+ */
+void arena_init(struct arena *arena, size_t chunk_size);
+
+/*
+ * Destroy an arena.
+ *
+ * All chunks are returned to the mem module, which releases all objects
+ * allocated from the arena.
+ */
+void arena_destroy(struct arena *arena);
+
+/*
+ * Allocate memory from an arena.
+ *
+ * The returned memory is uninitialized, and aligned to ARENA_ALIGN. Requests
+ * larger than the chunk size are served from dedicated chunks.
+ *
+ * Return NULL if size is 0 or if memory is exhausted.
+ */
+void * arena_alloc(struct arena *arena, size_t size);
+
+/*
+ * Record the allocation state of an arena.
+ */
+void arena_mark(const struct arena *arena, struct arena_mark *mark);
+
+/*
+ * Restore the allocation state of an arena.
+ *
+ * All objects allocated since the given mark was recorded are released.
+ * If mark is NULL, all objects are released. The mark must have been
+ * recorded on the same arena, and not be older than a mark the arena
+ * was reset to since, or the behavior is undefined.
+ *
+ * Chunks are kept, and reused by later allocations.
+ */
+void arena_reset(struct arena *arena, const struct arena_mark *mark);
+
+#endif /* _ARENA_H */
@@ -0,0 +1,943 @@
+/*
+ * Copyright (c) 2017 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lib/macros.h>
+#include <lib/shell.h>
+#include <lib/trace.h>
+
+#include "arena.h"
+#include "bench.h"
+#include "boot.h"
+#include "condvar.h"
+#include "cpu.h"
+#include "mem.h"
+#include "mutex.h"
+#include "page.h"
+#include "panic.h"
+#include "port.h"
+#include "thread.h"
+#include "timer.h"
+
+#define BENCH_STACK_SIZE 4096
+
+/*
+ * Default number of iterations.
+ */
+#define BENCH_DEFAULT_ITERATIONS 10000
+
+/*
+ * Request used to stop benchmark servers.
+ */
+#define BENCH_IPC_STOP ((uint32_t)-1)
+
+/*
+ * Offset, in ticks, of timers used in the timer benchmark.
+ *
+ * Timers are scheduled far enough in the future that they never expire
+ * while the benchmark runs, and spread over all the levels of the
+ * timing wheel.
+ */
+#define BENCH_TIMER_MIN_OFFSET  1000
+#define BENCH_TIMER_MAX_OFFSET  (1UL << 30)
+
+/*
+ * Parameters of the memory allocator benchmark.
+ *
+ * The heap is fragmented with free holes of random sizes between the
+ * minimum and maximum hole sizes, each followed by a small allocated
+ * block preventing coalescing. Probe allocations are larger than all
+ * holes, which is the worst case for allocators that walk free blocks.
+ */
+#define BENCH_MEM_MIN_HOLE_SIZE 16
+#define BENCH_MEM_MAX_HOLE_SIZE 256
+#define BENCH_MEM_PIN_SIZE      16
+#define BENCH_MEM_PROBE_SIZE    1024
+
+/*
+ * Parameters of the allocator throughput benchmark.
+ *
+ * Each thread repeatedly allocates or frees a random slot of its own
+ * working set, with random sizes up to the maximum size.
+ */
+#define BENCH_MALLOC_MAX_THREADS    8
+#define BENCH_MALLOC_NR_SLOTS       32
+#define BENCH_MALLOC_MAX_SIZE       256
+
+/*
+ * Parameters of the arena benchmark.
+ *
+ * Each iteration simulates a request allocating a number of small objects
+ * of random sizes, all of which are released when it completes.
+ */
+#define BENCH_ARENA_NR_OBJS     64
+#define BENCH_ARENA_MAX_SIZE    128
+
+/*
+ * Parameters of the buffer growth benchmark.
+ *
+ * Buffers grow by small steps up to the maximum size, as when appending to
+ * a string. Optionally, a small pin is allocated before each step, which
+ * usually prevents growing in place.
+ */
+#define BENCH_GROW_STEP         64
+#define BENCH_GROW_MAX_SIZE     4096
+#define BENCH_GROW_NR_STEPS     ((BENCH_GROW_MAX_SIZE / BENCH_GROW_STEP) - 1)
+#define BENCH_GROW_PIN_SIZE     16
+
+/*
+ * Mailbox built out of a mutex and condition variables.
+ *
+ * This is what threads had to do before ports were available, and is
+ * used as a reference point.
+ */
+struct bench_mailbox {
+    struct mutex mutex;
+    struct condvar request_cv;
+    struct condvar reply_cv;
+    bool has_request;
+    bool has_reply;
+    uint32_t request;
+    uint32_t reply;
+};
+
+/*
+ * Allocator throughput benchmark thread.
+ */
+struct bench_malloc_worker {
+    struct thread *thread;
+    unsigned long iterations;
+    unsigned long seed;
+    bool failed;
+    void *slots[BENCH_MALLOC_NR_SLOTS];
+};
+
+/*
+ * Built-in allocation trace, see bench_asm.S.
+ */
+extern const char bench_trace_start[];
+extern const char bench_trace_end[];
+
+static struct port bench_port;
+static struct bench_mailbox bench_mailbox;
+
+static struct trace_stats bench_trace_stats;
+
+static const struct trace_allocator bench_trace_allocator = {
+    .alloc = mem_alloc,
+    .realloc = mem_realloc,
+    .free = mem_free,
+    .clock = cpu_get_tsc,
+};
+
+static int
+bench_parse_iterations(int argc, char **argv, unsigned long *iterationsp)
+{
+    int ret;
+
+    if (argc < 2) {
+        *iterationsp = BENCH_DEFAULT_ITERATIONS;
+        return 0;
+    }
+
+    ret = sscanf(argv[1], "%lu", iterationsp);
+
+    if ((ret != 1) || (*iterationsp == 0)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+bench_report(const char *name, const char *label,
+             uint64_t cycles, unsigned long iterations)
+{
+    printf("%s: %s: %llu cycles per iteration\n", name, label,
+           (unsigned long long)(cycles / iterations));
+}
+
+static void
+bench_ipc_port_server(void *arg)
+{
+    struct port_call *call;
+    uint32_t request;
+
+    (void)arg;
+
+    call = port_accept(&bench_port, &request);
+
+    while (request != BENCH_IPC_STOP) {
+        request++;
+        call = port_reply_accept(&bench_port, call, &request, &request);
+    }
+
+    port_reply(&bench_port, call, &request);
+}
+
+static void
+bench_ipc_mailbox_server(void *arg)
+{
+    struct bench_mailbox *mailbox;
+    uint32_t request;
+
+    mailbox = arg;
+
+    mutex_lock(&mailbox->mutex);
+
+    do {
+        while (!mailbox->has_request) {
+            condvar_wait(&mailbox->request_cv, &mailbox->mutex);
+        }
+
+        mailbox->has_request = false;
+        request = mailbox->request;
+        mailbox->reply = request + 1;
+        mailbox->has_reply = true;
+        condvar_signal(&mailbox->reply_cv);
+    } while (request != BENCH_IPC_STOP);
+
+    mutex_unlock(&mailbox->mutex);
+}
+
+static uint32_t
+bench_ipc_mailbox_call(struct bench_mailbox *mailbox, uint32_t request)
+{
+    uint32_t reply;
+
+    mutex_lock(&mailbox->mutex);
+
+    mailbox->request = request;
+    mailbox->has_request = true;
+    condvar_signal(&mailbox->request_cv);
+
+    while (!mailbox->has_reply) {
+        condvar_wait(&mailbox->reply_cv, &mailbox->mutex);
+    }
+
+    mailbox->has_reply = false;
+    reply = mailbox->reply;
+
+    mutex_unlock(&mailbox->mutex);
+
+    return reply;
+}
+
+static void
+bench_ipc_mailbox_init(struct bench_mailbox *mailbox)
+{
+    mutex_init(&mailbox->mutex);
+    condvar_init(&mailbox->request_cv);
+    condvar_init(&mailbox->reply_cv);
+    mailbox->has_request = false;
+    mailbox->has_reply = false;
+}
+
+static void
+bench_shell_ipc(int argc, char **argv)
+{
+    unsigned long iterations;
+    struct thread *server;
+    uint32_t request, reply;
+    uint64_t start, end;
+    int error;
+
+    if (bench_parse_iterations(argc, argv, &iterations) != 0) {
+        printf("bench_ipc: error: invalid arguments\n");
+        return;
+    }
+
+    /*
+     * The server threads have the same priority as the shell, so that
+     * scheduling decisions are only driven by the communication itself.
+     */
+
+    port_init(&bench_port, NULL, sizeof(uint32_t), 0);
+    error = thread_create(&server, bench_ipc_port_server, NULL, "bench_ipc",
+                          BENCH_STACK_SIZE, THREAD_MIN_PRIORITY);
+
+    if (error) {
+        printf("bench_ipc: error: unable to create thread\n");
+        return;
+    }
+
+    start = cpu_get_tsc();
+
+    for (request = 0; request < iterations; request++) {
+        port_call(&bench_port, &request, &reply);
+    }
+
+    end = cpu_get_tsc();
+
+    request = BENCH_IPC_STOP;
+    port_call(&bench_port, &request, &reply);
+    thread_join(server);
+
+    bench_report("bench_ipc", "port", end - start, iterations);
+
+    bench_ipc_mailbox_init(&bench_mailbox);
+    error = thread_create(&server, bench_ipc_mailbox_server, &bench_mailbox,
+                          "bench_ipc", BENCH_STACK_SIZE, THREAD_MIN_PRIORITY);
+
+    if (error) {
+        printf("bench_ipc: error: unable to create thread\n");
+        return;
+    }
+
+    start = cpu_get_tsc();
+
+    for (request = 0; request < iterations; request++) {
+        bench_ipc_mailbox_call(&bench_mailbox, request);
+    }
+
+    end = cpu_get_tsc();
+
+    bench_ipc_mailbox_call(&bench_mailbox, BENCH_IPC_STOP);
+    thread_join(server);
+
+    bench_report("bench_ipc", "mailbox", end - start, iterations);
+}
+
+static void
+bench_timer_fn(void *arg)
+{
+    (void)arg;
+    panic("bench_timer: error: timer expired");
+}
+
+/*
+ * Return a pseudo-random offset, using a linear congruential generator.
+ */
+static unsigned long
+bench_timer_offset(unsigned long *seedp)
+{
+    *seedp = (*seedp * 1103515245) + 12345;
+    return BENCH_TIMER_MIN_OFFSET
+           + (*seedp % (BENCH_TIMER_MAX_OFFSET - BENCH_TIMER_MIN_OFFSET));
+}
+
+static void
+bench_timer_run(unsigned long nr_timers, unsigned long iterations)
+{
+    uint64_t start, schedule_cycles, cancel_cycles;
+    struct timer *timers, probe;
+    unsigned long now, seed;
+    char label[32];
+
+    timers = malloc(nr_timers * sizeof(*timers));
+
+    if (!timers) {
+        printf("bench_timer: error: unable to allocate timers\n");
+        return;
+    }
+
+    seed = nr_timers;
+    now = timer_now();
+
+    for (unsigned long i = 0; i < nr_timers; i++) {
+        timer_init(&timers[i], bench_timer_fn, NULL, 0);
+        timer_schedule(&timers[i], now + bench_timer_offset(&seed));
+    }
+
+    timer_init(&probe, bench_timer_fn, NULL, 0);
+    schedule_cycles = 0;
+    cancel_cycles = 0;
+
+    for (unsigned long i = 0; i < iterations; i++) {
+        start = cpu_get_tsc();
+        timer_schedule(&probe, now + bench_timer_offset(&seed));
+        schedule_cycles += cpu_get_tsc() - start;
+
+        start = cpu_get_tsc();
+        timer_cancel(&probe);
+        cancel_cycles += cpu_get_tsc() - start;
+    }
+
+    for (unsigned long i = 0; i < nr_timers; i++) {
+        timer_cancel(&timers[i]);
+    }
+
+    free(timers);
+
+    snprintf(label, sizeof(label), "schedule with %lu timers", nr_timers);
+    bench_report("bench_timer", label, schedule_cycles, iterations);
+    snprintf(label, sizeof(label), "cancel with %lu timers", nr_timers);
+    bench_report("bench_timer", label, cancel_cycles, iterations);
+}
+
+static void
+bench_shell_timer(int argc, char **argv)
+{
+    static const unsigned long nr_timers[] = { 10, 1000, 100000 };
+    unsigned long iterations;
+
+    if (bench_parse_iterations(argc, argv, &iterations) != 0) {
+        printf("bench_timer: error: invalid arguments\n");
+        return;
+    }
+
+    for (size_t i = 0; i < ARRAY_SIZE(nr_timers); i++) {
+        bench_timer_run(nr_timers[i], iterations);
+    }
+}
+
+/*
+ * Return a pseudo-random hole size, using a linear congruential generator.
+ */
+static size_t
+bench_mem_hole_size(unsigned long *seedp)
+{
+    *seedp = (*seedp * 1103515245) + 12345;
+    return BENCH_MEM_MIN_HOLE_SIZE
+           + (*seedp % (BENCH_MEM_MAX_HOLE_SIZE - BENCH_MEM_MIN_HOLE_SIZE));
+}
+
+static void
+bench_mem_probe(unsigned long nr_holes, unsigned long iterations)
+{
+    uint64_t start, cycles, total, max;
+    char label[32];
+    void *ptr;
+
+    total = 0;
+    max = 0;
+
+    for (unsigned long i = 0; i < iterations; i++) {
+        start = cpu_get_tsc();
+        ptr = malloc(BENCH_MEM_PROBE_SIZE);
+        cycles = cpu_get_tsc() - start;
+
+        if (!ptr) {
+            printf("bench_mem: error: unable to allocate probe\n");
+            return;
+        }
+
+        free(ptr);
+        total += cycles;
+
+        if (cycles > max) {
+            max = cycles;
+        }
+    }
+
+    snprintf(label, sizeof(label), "alloc with %lu holes", nr_holes);
+    bench_report("bench_mem", label, total, iterations);
+    printf("bench_mem: %s: %llu cycles worst case\n", label,
+           (unsigned long long)max);
+}
+
+static void
+bench_shell_mem(int argc, char **argv)
+{
+    static const unsigned long nr_holes[] = { 0, 100, 1000, 10000, 50000 };
+    unsigned long iterations, nr_blocks, seed;
+    void **holes, **pins;
+
+    if (bench_parse_iterations(argc, argv, &iterations) != 0) {
+        printf("bench_mem: error: invalid arguments\n");
+        return;
+    }
+
+    nr_blocks = nr_holes[ARRAY_SIZE(nr_holes) - 1];
+    holes = malloc(nr_blocks * sizeof(*holes));
+    pins = malloc(nr_blocks * sizeof(*pins));
+
+    if (!holes || !pins) {
+        printf("bench_mem: error: unable to allocate block tables\n");
+        goto out;
+    }
+
+    nr_blocks = 0;
+    seed = 1;
+
+    for (size_t i = 0; i < ARRAY_SIZE(nr_holes); i++) {
+        while (nr_blocks < nr_holes[i]) {
+            holes[nr_blocks] = malloc(bench_mem_hole_size(&seed));
+            pins[nr_blocks] = malloc(BENCH_MEM_PIN_SIZE);
+
+            if (!holes[nr_blocks] || !pins[nr_blocks]) {
+                printf("bench_mem: error: heap exhausted\n");
+                free(holes[nr_blocks]);
+                free(pins[nr_blocks]);
+                goto out_free;
+            }
+
+            nr_blocks++;
+        }
+
+        for (unsigned long j = 0; j < nr_blocks; j++) {
+            if (holes[j]) {
+                free(holes[j]);
+                holes[j] = NULL;
+            }
+        }
+
+        bench_mem_probe(nr_blocks, iterations);
+    }
+
+out_free:
+    for (unsigned long i = 0; i < nr_blocks; i++) {
+        free(holes[i]);
+        free(pins[i]);
+    }
+
+out:
+    free(pins);
+    free(holes);
+}
+
+static unsigned long
+bench_malloc_rand(unsigned long *seedp)
+{
+    *seedp = (*seedp * 1103515245) + 12345;
+    return *seedp >> 8;
+}
+
+static void
+bench_malloc_run_worker(void *arg)
+{
+    struct bench_malloc_worker *worker;
+    unsigned long value;
+    void **slot;
+
+    worker = arg;
+
+    for (unsigned long i = 0; i < worker->iterations; i++) {
+        value = bench_malloc_rand(&worker->seed);
+        slot = &worker->slots[value % ARRAY_SIZE(worker->slots)];
+
+        if (*slot) {
+            free(*slot);
+            *slot = NULL;
+        } else {
+            *slot = malloc(1 + ((value >> 8) % BENCH_MALLOC_MAX_SIZE));
+
+            if (!*slot) {
+                worker->failed = true;
+                break;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < ARRAY_SIZE(worker->slots); i++) {
+        free(worker->slots[i]);
+    }
+}
+
+static void
+bench_malloc_run(struct bench_malloc_worker *workers,
+                 unsigned long nr_threads, unsigned long iterations)
+{
+    unsigned long nr_created;
+    uint64_t start, end;
+    bool failed;
+    char label[32];
+    int error;
+
+    start = cpu_get_tsc();
+
+    for (nr_created = 0; nr_created < nr_threads; nr_created++) {
+        workers[nr_created].iterations = iterations;
+        workers[nr_created].seed = nr_created + 1;
+        workers[nr_created].failed = false;
+
+        for (size_t i = 0; i < ARRAY_SIZE(workers[nr_created].slots); i++) {
+            workers[nr_created].slots[i] = NULL;
+        }
+
+        error = thread_create(&workers[nr_created].thread,
+                              bench_malloc_run_worker, &workers[nr_created],
+                              "bench_malloc", BENCH_STACK_SIZE,
+                              THREAD_MIN_PRIORITY);
+
+        if (error) {
+            printf("bench_malloc: error: unable to create thread\n");
+            break;
+        }
+    }
+
+    failed = (nr_created != nr_threads);
+
+    for (unsigned long i = 0; i < nr_created; i++) {
+        thread_join(workers[i].thread);
+        failed |= workers[i].failed;
+    }
+
+    end = cpu_get_tsc();
+
+    if (failed) {
+        printf("bench_malloc: error: benchmark failed\n");
+        return;
+    }
+
+    snprintf(label, sizeof(label), "%lu threads", nr_threads);
+    bench_report("bench_malloc", label, end - start, nr_threads * iterations);
+}
+
+static void
+bench_shell_malloc(int argc, char **argv)
+{
+    struct bench_malloc_worker *workers;
+    unsigned long iterations;
+
+    if (bench_parse_iterations(argc, argv, &iterations) != 0) {
+        printf("bench_malloc: error: invalid arguments\n");
+        return;
+    }
+
+    workers = malloc(BENCH_MALLOC_MAX_THREADS * sizeof(*workers));
+
+    if (!workers) {
+        printf("bench_malloc: error: unable to allocate workers\n");
+        return;
+    }
+
+    for (unsigned long i = 1; i <= BENCH_MALLOC_MAX_THREADS; i *= 2) {
+        bench_malloc_run(workers, i, iterations);
+    }
+
+    free(workers);
+}
+
+static bool
+bench_arena_run_malloc(unsigned long iterations)
+{
+    void *objs[BENCH_ARENA_NR_OBJS];
+    unsigned long seed;
+    bool failed;
+
+    seed = 1;
+    failed = false;
+
+    for (unsigned long i = 0; i < iterations; i++) {
+        for (size_t j = 0; j < ARRAY_SIZE(objs); j++) {
+            objs[j] = malloc(1 + (bench_malloc_rand(&seed)
+                                  % BENCH_ARENA_MAX_SIZE));
+            failed |= !objs[j];
+        }
+
+        for (size_t j = 0; j < ARRAY_SIZE(objs); j++) {
+            free(objs[j]);
+        }
+    }
+
+    return failed;
+}
+
+static bool
+bench_arena_run_arena(unsigned long iterations)
+{
+    struct arena_mark mark;
+    struct arena arena;
+    unsigned long seed;
+    bool failed;
+    void *obj;
+
+    arena_init(&arena, 0);
+    arena_mark(&arena, &mark);
+    seed = 1;
+    failed = false;
+
+    for (unsigned long i = 0; i < iterations; i++) {
+        for (size_t j = 0; j < BENCH_ARENA_NR_OBJS; j++) {
+            obj = arena_alloc(&arena, 1 + (bench_malloc_rand(&seed)
+                                           % BENCH_ARENA_MAX_SIZE));
+            failed |= !obj;
+        }
+
+        arena_reset(&arena, &mark);
+    }
+
+    arena_destroy(&arena);
+    return failed;
+}
+
+static void
+bench_shell_arena(int argc, char **argv)
+{
+    unsigned long iterations;
+    uint64_t start, end;
+    bool failed;
+
+    if (bench_parse_iterations(argc, argv, &iterations) != 0) {
+        printf("bench_arena: error: invalid arguments\n");
+        return;
+    }
+
+    start = cpu_get_tsc();
+    failed = bench_arena_run_malloc(iterations);
+    end = cpu_get_tsc();
+
+    if (failed) {
+        printf("bench_arena: error: unable to allocate objects\n");
+        return;
+    }
+
+    bench_report("bench_arena", "malloc/free", end - start, iterations);
+
+    start = cpu_get_tsc();
+    failed = bench_arena_run_arena(iterations);
+    end = cpu_get_tsc();
+
+    if (failed) {
+        printf("bench_arena: error: unable to allocate objects\n");
+        return;
+    }
+
+    bench_report("bench_arena", "arena/reset", end - start, iterations);
+}
+
+/*
+ * Grow a buffer without mem_realloc(), i.e. always move it.
+ */
+static void *
+bench_grow_copy(void *ptr, size_t old_size, size_t size)
+{
+    void *new_ptr;
+
+    new_ptr = malloc(size);
+
+    if (new_ptr) {
+        memcpy(new_ptr, ptr, old_size);
+        free(ptr);
+    }
+
+    return new_ptr;
+}
+
+static bool
+bench_grow_run(bool use_realloc, bool pinned, unsigned long iterations)
+{
+    void *pins[BENCH_GROW_NR_STEPS];
+    uint64_t start, cycles;
+    size_t size, nr_pins;
+    void *ptr, *new_ptr;
+    char label[32];
+    bool failed;
+
+    cycles = 0;
+    failed = false;
+
+    for (unsigned long i = 0; (i < iterations) && !failed; i++) {
+        size = BENCH_GROW_STEP;
+        ptr = malloc(size);
+        nr_pins = 0;
+
+        while (ptr && (size < BENCH_GROW_MAX_SIZE)) {
+            if (pinned) {
+                pins[nr_pins] = malloc(BENCH_GROW_PIN_SIZE);
+
+                if (!pins[nr_pins]) {
+                    break;
+                }
+
+                nr_pins++;
+            }
+
+            start = cpu_get_tsc();
+
+            if (use_realloc) {
+                new_ptr = realloc(ptr, size + BENCH_GROW_STEP);
+            } else {
+                new_ptr = bench_grow_copy(ptr, size, size + BENCH_GROW_STEP);
+            }
+
+            cycles += cpu_get_tsc() - start;
+
+            if (!new_ptr) {
+                break;
+            }
+
+            ptr = new_ptr;
+            size += BENCH_GROW_STEP;
+        }
+
+        failed = (size < BENCH_GROW_MAX_SIZE);
+        free(ptr);
+
+        for (size_t j = 0; j < nr_pins; j++) {
+            free(pins[j]);
+        }
+    }
+
+    if (failed) {
+        printf("bench_grow: error: unable to allocate buffers\n");
+        return false;
+    }
+
+    snprintf(label, sizeof(label), "%s%s",
+             use_realloc ? "realloc" : "alloc/copy/free",
+             pinned ? ", pinned" : "");
+    bench_report("bench_grow", label, cycles,
+                 iterations * BENCH_GROW_NR_STEPS);
+    return true;
+}
+
+static void
+bench_shell_grow(int argc, char **argv)
+{
+    unsigned long iterations;
+
+    if (bench_parse_iterations(argc, argv, &iterations) != 0) {
+        printf("bench_grow: error: invalid arguments\n");
+        return;
+    }
+
+    if (!bench_grow_run(false, false, iterations)
+        || !bench_grow_run(true, false, iterations)
+        || !bench_grow_run(false, true, iterations)) {
+        return;
+    }
+
+    bench_grow_run(true, true, iterations);
+}
+
+/*
+ * Replay an allocation trace through mem_alloc(), mem_realloc() and
+ * mem_free().
+ *
+ * The trace is the first boot module if any, or the built-in trace
+ * otherwise. Parsed operations and the block table are allocated from the
+ * page allocator, so that they don't disturb the heap.
+ */
+static void
+bench_shell_trace(int argc, char **argv)
+{
+    const struct boot_module *modules;
+    struct mem_info before, after;
+    struct trace_block *blocks;
+    struct trace_info info;
+    unsigned int nr_modules;
+    struct trace_op *ops;
+    const char *text;
+    size_t size;
+    int error;
+
+    (void)argc;
+    (void)argv;
+
+    modules = boot_get_modules(&nr_modules);
+
+    if (nr_modules != 0) {
+        text = (const char *)modules[0].start;
+        size = modules[0].end - modules[0].start;
+    } else {
+        text = bench_trace_start;
+        size = bench_trace_end - bench_trace_start;
+    }
+
+    error = trace_parse(text, size, NULL, &info);
+
+    if (error) {
+        printf("bench_trace: error: invalid trace at line %lu\n", info.line);
+        return;
+    }
+
+    if (info.nr_ops == 0) {
+        printf("bench_trace: error: empty trace\n");
+        return;
+    }
+
+    if ((info.nr_ops > (SIZE_MAX / sizeof(*ops)))
+        || (info.nr_blocks > (SIZE_MAX / sizeof(*blocks)))) {
+        printf("bench_trace: error: trace too large\n");
+        return;
+    }
+
+    ops = page_alloc(page_order(info.nr_ops * sizeof(*ops)));
+
+    if (!ops) {
+        printf("bench_trace: error: unable to allocate operations\n");
+        return;
+    }
+
+    blocks = page_alloc(page_order(info.nr_blocks * sizeof(*blocks)));
+
+    if (!blocks) {
+        printf("bench_trace: error: unable to allocate blocks\n");
+        goto out;
+    }
+
+    trace_parse(text, size, ops, &info);
+
+    mem_get_info(&before);
+    mem_reset_peak();
+    trace_replay(ops, info.nr_ops, blocks, info.nr_blocks,
+                 &bench_trace_allocator, &bench_trace_stats);
+    mem_get_info(&after);
+    trace_release(blocks, info.nr_blocks, &bench_trace_allocator);
+
+    trace_stats_print(&bench_trace_stats, "bench_trace");
+    printf("bench_trace: peak footprint: %zu bytes\n",
+           after.peak_size - before.allocated_size - before.cached_size
+           - before.large_size);
+    printf("bench_trace: final fragmentation: %u%%\n",
+           mem_info_fragmentation(&after));
+
+    page_free(blocks);
+out:
+    page_free(ops);
+}
+
+static struct shell_cmd bench_shell_cmds[] = {
+    SHELL_CMD_INITIALIZER("bench_ipc", bench_shell_ipc,
+        "bench_ipc [iterations]",
+        "measure the round trip latency of synchronous IPC"),
+    SHELL_CMD_INITIALIZER("bench_timer", bench_shell_timer,
+        "bench_timer [iterations]",
+        "measure the cost of scheduling and cancelling timers"),
+    SHELL_CMD_INITIALIZER("bench_mem", bench_shell_mem,
+        "bench_mem [iterations]",
+        "measure the allocation latency as the heap fragments"),
+    SHELL_CMD_INITIALIZER("bench_malloc", bench_shell_malloc,
+        "bench_malloc [iterations]",
+        "measure the allocator throughput with 1 to 8 threads"),
+    SHELL_CMD_INITIALIZER("bench_arena", bench_shell_arena,
+        "bench_arena [iterations]",
+        "compare freeing objects one by one with resetting an arena"),
+    SHELL_CMD_INITIALIZER("bench_grow", bench_shell_grow,
+        "bench_grow [iterations]",
+        "measure the cost of growing buffers with and without realloc"),
+    SHELL_CMD_INITIALIZER("bench_trace", bench_shell_trace,
+        "bench_trace",
+        "replay an allocation trace, from the first boot module if any"),
+};
+
+void
+bench_setup(void)
+{
+    int error;
+
+    for (size_t i = 0; i < ARRAY_SIZE(bench_shell_cmds); i++) {
+        error = shell_cmd_register(&bench_shell_cmds[i]);
+
+        if (error) {
+            panic("bench: unable to register shell command");
+        }
+    }
+}
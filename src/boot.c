@@ -21,11 +21,83 @@
  * SOFTWARE.
  */
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include <lib/macros.h>
 
 #include "boot.h"
+#include "page.h"
+#include "panic.h"
+
+/*
+ * Multiboot information flags.
+ */
+#define BOOT_INFO_MEMORY    0x01
+#define BOOT_INFO_MODS      0x08
+#define BOOT_INFO_MMAP      0x40
+
+/*
+ * Type of memory map entries describing available RAM.
+ */
+#define BOOT_MMAP_AVAILABLE 1
+
+/*
+ * Memory below 1 MiB is never used, see kernel.lds.
+ */
+#define BOOT_MEM_START      0x100000
+
+/*
+ * Maximum number of free memory regions. Additional regions are ignored.
+ */
+#define BOOT_MAX_MEM_REGIONS 8
+
+/*
+ * Maximum number of boot modules. Additional modules are ignored.
+ */
+#define BOOT_MAX_MODULES 4
+
+/*
+ * Multiboot information structure, as passed by the boot loader.
+ *
+ * Only the members used by the kernel are declared.
+ *
+ * See https://www.gnu.org/software/grub/manual/multiboot/multiboot.html.
+ */
+struct boot_info {
+    uint32_t flags;
+    uint32_t mem_lower;
+    uint32_t mem_upper;
+    uint32_t unused0[2];
+    uint32_t mods_count;
+    uint32_t mods_addr;
+    uint32_t unused1[4];
+    uint32_t mmap_length;
+    uint32_t mmap_addr;
+} __packed;
+
+/*
+ * Memory map entry.
+ *
+ * The size member doesn't include itself, and may be larger than the
+ * rest of the entry.
+ */
+struct boot_mmap_entry {
+    uint32_t size;
+    uint64_t base_addr;
+    uint64_t length;
+    uint32_t type;
+} __packed;
+
+/*
+ * Module entry.
+ */
+struct boot_mod_entry {
+    uint32_t mod_start;
+    uint32_t mod_end;
+    uint32_t string;
+    uint32_t reserved;
+} __packed;
 
 /*
  * This is the boot stack, used by the boot code to set the value of
@@ -41,3 +113,190 @@
  * [1] http://www.sco.com/developers/devspecs/abi386-4.pdf
  */
 uint8_t boot_stack[BOOT_STACK_SIZE] __aligned(4);
+
+/*
+ * Physical address of the multiboot information structure.
+ *
+ * See the assembly code at the boot_start label in boot_asm.S.
+ */
+uint32_t boot_info_addr;
+
+/*
+ * End of the kernel image, defined by the linker script.
+ */
+extern char _end[];
+
+static struct boot_mem_region boot_mem_regions[BOOT_MAX_MEM_REGIONS];
+static unsigned int boot_nr_mem_regions;
+
+static struct boot_module boot_modules[BOOT_MAX_MODULES];
+static unsigned int boot_nr_modules;
+
+static void
+boot_add_mem_region(uint64_t start, uint64_t end)
+{
+    struct boot_mem_region *region;
+    uint64_t kernel_end;
+
+    /*
+     * Skip lower memory and the kernel image, and ignore memory that
+     * isn't addressable with 32-bits pointers. The last page of the
+     * address space is also ignored, so that region ends don't overflow.
+     */
+    kernel_end = P2ROUND((uintptr_t)_end, PAGE_SIZE);
+
+    if (start < kernel_end) {
+        start = kernel_end;
+    }
+
+    if (end > P2ALIGN((uint64_t)UINTPTR_MAX, PAGE_SIZE)) {
+        end = P2ALIGN((uint64_t)UINTPTR_MAX, PAGE_SIZE);
+    }
+
+    start = P2ROUND(start, PAGE_SIZE);
+    end = P2ALIGN(end, PAGE_SIZE);
+
+    if (start >= end) {
+        return;
+    }
+
+    /*
+     * Modules may be anywhere in memory, and must be preserved. Add the
+     * parts of the region on each side of an overlapping module instead.
+     */
+    for (unsigned int i = 0; i < boot_nr_modules; i++) {
+        if ((boot_modules[i].start < end) && (start < boot_modules[i].end)) {
+            boot_add_mem_region(start, boot_modules[i].start);
+            boot_add_mem_region(boot_modules[i].end, end);
+            return;
+        }
+    }
+
+    if (boot_nr_mem_regions == ARRAY_SIZE(boot_mem_regions)) {
+        return;
+    }
+
+    region = &boot_mem_regions[boot_nr_mem_regions];
+    region->start = start;
+    region->end = end;
+    boot_nr_mem_regions++;
+}
+
+static void
+boot_add_module(uint32_t start, uint32_t end)
+{
+    struct boot_module *module;
+
+    if (start >= end) {
+        return;
+    }
+
+    if (boot_nr_modules == ARRAY_SIZE(boot_modules)) {
+        return;
+    }
+
+    module = &boot_modules[boot_nr_modules];
+    module->start = start;
+    module->end = end;
+    boot_nr_modules++;
+}
+
+void
+boot_setup(void)
+{
+    const struct boot_mmap_entry *entry;
+    const struct boot_mod_entry *mod;
+    const struct boot_info *info;
+    uintptr_t addr, end;
+
+    info = (const struct boot_info *)boot_info_addr;
+
+    /*
+     * Modules must be known before adding memory regions, so that they
+     * can be excluded.
+     */
+    if (info->flags & BOOT_INFO_MODS) {
+        mod = (const struct boot_mod_entry *)info->mods_addr;
+
+        for (uint32_t i = 0; i < info->mods_count; i++) {
+            boot_add_module(mod[i].mod_start, mod[i].mod_end);
+        }
+    }
+
+    if (info->flags & BOOT_INFO_MMAP) {
+        addr = info->mmap_addr;
+        end = addr + info->mmap_length;
+
+        while (addr < end) {
+            entry = (const struct boot_mmap_entry *)addr;
+
+            if (entry->type == BOOT_MMAP_AVAILABLE) {
+                boot_add_mem_region(entry->base_addr,
+                                    entry->base_addr + entry->length);
+            }
+
+            addr += sizeof(entry->size) + entry->size;
+        }
+    } else if (info->flags & BOOT_INFO_MEMORY) {
+        /*
+         * Without a memory map, assume upper memory is contiguous. The
+         * size of upper memory is given in KiB.
+         */
+        boot_add_mem_region(BOOT_MEM_START,
+                            BOOT_MEM_START
+                            + ((uint64_t)info->mem_upper * 1024));
+    }
+
+    if (boot_nr_mem_regions == 0) {
+        panic("boot: no available memory");
+    }
+}
+
+void *
+boot_alloc(size_t size)
+{
+    struct boot_mem_region *region;
+    void *ptr;
+
+    size = P2ROUND(size, PAGE_SIZE);
+
+    for (unsigned int i = 0; i < boot_nr_mem_regions; i++) {
+        region = &boot_mem_regions[i];
+
+        if ((region->end - region->start) >= size) {
+            ptr = (void *)region->start;
+            region->start += size;
+            return ptr;
+        }
+    }
+
+    return NULL;
+}
+
+size_t
+boot_get_free_size(void)
+{
+    size_t size;
+
+    size = 0;
+
+    for (unsigned int i = 0; i < boot_nr_mem_regions; i++) {
+        size += boot_mem_regions[i].end - boot_mem_regions[i].start;
+    }
+
+    return size;
+}
+
+const struct boot_mem_region *
+boot_get_mem_regions(unsigned int *nr_regionsp)
+{
+    *nr_regionsp = boot_nr_mem_regions;
+    return boot_mem_regions;
+}
+
+const struct boot_module *
+boot_get_modules(unsigned int *nr_modulesp)
+{
+    *nr_modulesp = boot_nr_modules;
+    return boot_modules;
+}
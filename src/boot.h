@@ -31,4 +31,70 @@
  */
 #define BOOT_STACK_SIZE 4096
 
+#ifndef __ASSEMBLER__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Region of free physical memory.
+ *
+ * Regions are page-aligned, and never overlap the kernel image.
+ */
+struct boot_mem_region {
+    uintptr_t start;
+    uintptr_t end;
+};
+
+/*
+ * Module loaded by the boot loader.
+ *
+ * Module memory is never part of free memory regions. Its content is
+ * identity mapped, and may be read at any time.
+ */
+struct boot_module {
+    uintptr_t start;
+    uintptr_t end;
+};
+
+/*
+ * Initialize the boot module.
+ *
+ * This function parses the information passed by the boot loader, in
+ * particular the memory map, which determines how much memory is
+ * available to the heap and the page allocator. It must be called
+ * before anything may overwrite that information, which may be stored
+ * anywhere in memory.
+ */
+void boot_setup(void);
+
+/*
+ * Allocate memory during bootstrap.
+ *
+ * The returned memory is page-aligned, contiguous, and uninitialized.
+ * Return NULL if there is no region large enough.
+ *
+ * This function is meant for the heap and the page allocator metadata,
+ * and may only be used until the page allocator takes all the remaining
+ * free memory.
+ */
+void * boot_alloc(size_t size);
+
+/*
+ * Return the total size of free memory.
+ */
+size_t boot_get_free_size(void);
+
+/*
+ * Return the free memory regions.
+ */
+const struct boot_mem_region * boot_get_mem_regions(unsigned int *nr_regionsp);
+
+/*
+ * Return the modules loaded by the boot loader.
+ */
+const struct boot_module * boot_get_modules(unsigned int *nr_modulesp);
+
+#endif /* __ASSEMBLER__ */
+
 #endif /* _BOOT_H */
@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) 2017 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "clock.h"
+#include "cpu.h"
+#include "i8254.h"
+#include "thread.h"
+
+/*
+ * Number of i8254 input clock periods used to calibrate the TSC, which
+ * amounts to 50ms.
+ */
+#define CLOCK_CALIBRATION_COUNT     (I8254_FREQ / 20)
+
+/*
+ * Number of calibration rounds.
+ *
+ * The shortest measurement is retained, as longer ones are caused by
+ * delays in accessing the i8254, e.g. because of emulation.
+ */
+#define CLOCK_CALIBRATION_ROUNDS    3
+
+#define CLOCK_TICK_NS               (CLOCK_NS_PER_SEC / THREAD_SCHED_FREQ)
+
+/*
+ * Fixed-point factor used to convert i8254 input clock periods to
+ * nanoseconds.
+ */
+#define CLOCK_I8254_SHIFT           16
+#define CLOCK_I8254_MULT            ((uint32_t)((CLOCK_NS_PER_SEC           \
+                                                 << CLOCK_I8254_SHIFT)      \
+                                                / I8254_FREQ))
+
+static bool clock_tsc_enabled;
+static uint64_t clock_tsc_freq;
+static uint64_t clock_tsc_base;
+static struct clock_scale clock_tsc_to_ns_scale;
+static struct clock_scale clock_ns_to_tsc_scale;
+
+/*
+ * Time of the fallback clock source.
+ *
+ * The number of ticks is updated from interrupt context. The last time
+ * returned is used to enforce monotonicity, because the i8254 counter
+ * may be reloaded before the interrupt that reports the new tick is
+ * handled.
+ */
+static uint64_t clock_ticks;
+static uint64_t clock_last_ns;
+
+void
+clock_scale_init(struct clock_scale *scale,
+                 uint64_t from_rate, uint64_t to_rate)
+{
+    uint64_t mult;
+
+    assert(from_rate != 0);
+
+    /*
+     * Use the highest precision for which the factor fits in 32 bits,
+     * so that conversions only need 32x32 bits multiplications.
+     */
+    scale->shift = 32;
+
+    for (;;) {
+        if (to_rate > (((uint64_t)-1) >> scale->shift)) {
+            scale->shift--;
+            continue;
+        }
+
+        mult = (to_rate << scale->shift) / from_rate;
+
+        if ((mult >> 32) == 0) {
+            break;
+        }
+
+        scale->shift--;
+    }
+
+    scale->mult = mult;
+}
+
+uint64_t
+clock_scale_apply(const struct clock_scale *scale, uint64_t value)
+{
+    uint32_t high, low;
+
+    high = value >> 32;
+    low = value;
+
+    return (((uint64_t)high * scale->mult) << (32 - scale->shift))
+           + (((uint64_t)low * scale->mult) >> scale->shift);
+}
+
+static uint64_t
+clock_tsc_measure(void)
+{
+    uint64_t start;
+
+    i8254_oneshot_start(CLOCK_CALIBRATION_COUNT);
+    start = cpu_get_tsc();
+
+    while (!i8254_oneshot_expired());
+
+    return cpu_get_tsc() - start;
+}
+
+/*
+ * Calibrate the TSC.
+ *
+ * Return false if the TSC doesn't appear to be running.
+ */
+static bool
+clock_tsc_calibrate(void)
+{
+    uint64_t cycles, min_cycles;
+
+    min_cycles = (uint64_t)-1;
+
+    for (unsigned int i = 0; i < CLOCK_CALIBRATION_ROUNDS; i++) {
+        cycles = clock_tsc_measure();
+
+        if (cycles < min_cycles) {
+            min_cycles = cycles;
+        }
+    }
+
+    clock_tsc_freq = (min_cycles * I8254_FREQ) / CLOCK_CALIBRATION_COUNT;
+
+    if (clock_tsc_freq == 0) {
+        return false;
+    }
+
+    clock_scale_init(&clock_tsc_to_ns_scale, clock_tsc_freq,
+                     CLOCK_NS_PER_SEC);
+    clock_scale_init(&clock_ns_to_tsc_scale, CLOCK_NS_PER_SEC,
+                     clock_tsc_freq);
+    return true;
+}
+
+static uint64_t
+clock_i8254_now_ns(void)
+{
+    uint32_t eflags, elapsed;
+    uint64_t ns;
+
+    eflags = cpu_intr_save();
+
+    elapsed = i8254_get_initial_count() - i8254_read_counter();
+    ns = (clock_ticks * CLOCK_TICK_NS)
+         + (((uint64_t)elapsed * CLOCK_I8254_MULT) >> CLOCK_I8254_SHIFT);
+
+    if (ns < clock_last_ns) {
+        ns = clock_last_ns;
+    } else {
+        clock_last_ns = ns;
+    }
+
+    cpu_intr_restore(eflags);
+
+    return ns;
+}
+
+void
+clock_setup(void)
+{
+    clock_tsc_enabled = cpu_has_tsc() && clock_tsc_calibrate();
+
+    if (clock_tsc_enabled) {
+        clock_tsc_base = cpu_get_tsc();
+    }
+}
+
+bool
+clock_uses_tsc(void)
+{
+    return clock_tsc_enabled;
+}
+
+uint64_t
+clock_get_tsc_freq(void)
+{
+    return clock_tsc_enabled ? clock_tsc_freq : 0;
+}
+
+uint64_t
+clock_ns_to_tsc(uint64_t ns)
+{
+    assert(clock_tsc_enabled);
+    return clock_tsc_base + clock_scale_apply(&clock_ns_to_tsc_scale, ns);
+}
+
+uint64_t
+clock_now_ns(void)
+{
+    if (clock_tsc_enabled) {
+        return clock_scale_apply(&clock_tsc_to_ns_scale,
+                                 cpu_get_tsc() - clock_tsc_base);
+    }
+
+    return clock_i8254_now_ns();
+}
+
+void
+clock_report_tick(void)
+{
+    clock_ticks++;
+}
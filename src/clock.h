@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2017 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ *
+ * Clock module.
+ *
+ * This module provides a 64-bits monotonic time with nanosecond
+ * resolution, which, unlike timer ticks, is suitable for latency
+ * measurements and never wraps in practice.
+ *
+ * The preferred clock source is the TSC, calibrated at boot against
+ * the i8254. If the processor has no TSC, the time is obtained by
+ * interpolating between timer ticks with the current count of the i8254,
+ * which gives a resolution of about 838ns, at the cost of a few slow
+ * I/O port accesses per reading.
+ */
+
+#ifndef _CLOCK_H
+#define _CLOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define CLOCK_NS_PER_SEC 1000000000ULL
+
+/*
+ * Fixed-point scaling factor.
+ *
+ * A scale is used to convert values between units of different rates,
+ * e.g. TSC cycles to nanoseconds, without divisions.
+ *
+ * All members are private.
+ */
+struct clock_scale {
+    uint32_t mult;
+    unsigned int shift;
+};
+
+/*
+ * Initialize a scale converting values in units of from_rate per second
+ * into units of to_rate per second.
+ *
+ * The from rate must be non-zero, and the ratio of the rates must be
+ * lower than 2^32.
+ */
+void clock_scale_init(struct clock_scale *scale,
+                      uint64_t from_rate, uint64_t to_rate);
+
+/*
+ * Convert a value using a scale.
+ */
+uint64_t clock_scale_apply(const struct clock_scale *scale, uint64_t value);
+
+/*
+ * Initialize the clock module.
+ *
+ * This function calibrates the TSC, and must be called with interrupts
+ * disabled, once the i8254 is initialized.
+ */
+void clock_setup(void);
+
+/*
+ * Return true if the TSC is used as the clock source.
+ */
+bool clock_uses_tsc(void);
+
+/*
+ * Return the frequency of the TSC, in Hz, or 0 if the TSC isn't used.
+ */
+uint64_t clock_get_tsc_freq(void);
+
+/*
+ * Convert a monotonic time, in nanoseconds, to the matching TSC value.
+ *
+ * The TSC must be used as the clock source.
+ */
+uint64_t clock_ns_to_tsc(uint64_t ns);
+
+/*
+ * Return the monotonic time, in nanoseconds, since the clock module was
+ * initialized.
+ *
+ * This function may be called from interrupt context.
+ */
+uint64_t clock_now_ns(void);
+
+/*
+ * Report a timer tick.
+ *
+ * This function is called by the i8254 interrupt handler.
+ */
+void clock_report_tick(void);
+
+#endif /* _CLOCK_H */
@@ -21,80 +21,26 @@
  * SOFTWARE.
  */
 
-#include <stdbool.h>
-
-#include <lib/list.h>
+#include <assert.h>
 
 #include "condvar.h"
 #include "mutex.h"
+#include "parking.h"
 #include "thread.h"
 
-/*
- * Structure used to bind a waiting thread and a condition variable.
- *
- * The purpose of this structure is to avoid adding the node to the thread
- * structure. Instead, it's allocated from the stack and only exists while
- * the thread is waiting for the condition variable to be signalled.
- *
- * When another thread signals the condition variable, it finds threads
- * to wake up by accessing the condition variable list of waiters.
- *
- * The awaken member records whether the waiting thread has actually been
- * awaken, to guard against spurious wake-ups.
- *
- * Preemption must be disabled when accessing a waiter.
- */
-struct condvar_waiter {
-    struct list node;
-    struct thread *thread;
-    bool awaken;
-};
-
-static void
-condvar_waiter_init(struct condvar_waiter *waiter, struct thread *thread)
-{
-    waiter->thread = thread;
-    waiter->awaken = false;
-}
-
-static bool
-condvar_waiter_awaken(const struct condvar_waiter *waiter)
-{
-    return waiter->awaken;
-}
-
-static bool
-condvar_waiter_wakeup(struct condvar_waiter *waiter)
-{
-    if (condvar_waiter_awaken(waiter)) {
-        return false;
-    }
-
-    thread_wakeup(waiter->thread);
-    waiter->awaken = true;
-    return true;
-}
-
 void
 condvar_init(struct condvar *condvar)
 {
-    list_init(&condvar->waiters);
+    condvar->nr_waiters = 0;
 }
 
 void
 condvar_signal(struct condvar *condvar)
 {
-    struct condvar_waiter *waiter;
-    bool awaken;
-
     thread_preempt_disable();
 
-    list_for_each_entry(&condvar->waiters, waiter, node) {
-        awaken = condvar_waiter_wakeup(waiter);
-
-        if (awaken) {
-            break;
-        }
+    if (condvar->nr_waiters != 0) {
+        parking_unpark_one(condvar);
     }
 
     thread_preempt_enable();
@@ -103,8 +49,6 @@ condvar_signal(struct condvar *condvar)
 void
 condvar_broadcast(struct condvar *condvar)
 {
-    struct condvar_waiter *waiter;
-
     /*
      * Note that this broadcast implementation, a very simple and naive one,
      * allows a situation known as the "thundering herd problem" [1].
@@ -126,8 +70,8 @@ condvar_broadcast(struct condvar *condvar)
 
     thread_preempt_disable();
 
-    list_for_each_entry(&condvar->waiters, waiter, node) {
-        condvar_waiter_wakeup(waiter);
+    if (condvar->nr_waiters != 0) {
+        parking_unpark_all(condvar);
     }
 
     thread_preempt_enable();
@@ -136,12 +80,6 @@ condvar_broadcast(struct condvar *condvar)
 void
 condvar_wait(struct condvar *condvar, struct mutex *mutex)
 {
-    struct condvar_waiter waiter;
-    struct thread *thread;
-
-    thread = thread_self();
-    condvar_waiter_init(&waiter, thread);
-
     thread_preempt_disable();
 
     /*
@@ -156,13 +94,16 @@ condvar_wait(struct condvar *condvar, struct mutex *mutex)
      */
     mutex_unlock(mutex);
 
-    list_insert_tail(&condvar->waiters, &waiter.node);
+    condvar->nr_waiters++;
+    assert(condvar->nr_waiters != 0);
 
-    do {
-        thread_sleep();
-    } while (!condvar_waiter_awaken(&waiter));
+    /*
+     * The parking lot guards against spurious wake-ups, and only returns
+     * once the calling thread has actually been unparked.
+     */
+    parking_park(condvar);
 
-    list_remove(&waiter.node);
+    condvar->nr_waiters--;
 
     thread_preempt_enable();
 
@@ -44,17 +44,19 @@
 #ifndef _CONDVAR_H
 #define _CONDVAR_H
 
-#include <lib/list.h>
-
 #include "mutex.h"
 
 /*
  * Condition variable type.
  *
+ * Waiting threads are queued in the parking lot (see parking.h). The
+ * number of waiters allows signalling to skip looking up the parking lot
+ * when no thread is waiting.
+ *
  * All members are private.
  */
 struct condvar {
-    struct list waiters;
+    unsigned long nr_waiters;
 };
 
 /*
@@ -26,6 +26,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <lib/macros.h>
 
@@ -35,7 +36,9 @@
 #include "thread.h"
 
 #define CPU_SEG_DATA_RW         0x00000200
+#define CPU_SEG_TASK_GATE       0x00000500
 #define CPU_SEG_CODE_RX         0x00000900
+#define CPU_SEG_TSS             0x00000900
 #define CPU_SEG_S               0x00001000
 #define CPU_SEG_P               0x00008000
 #define CPU_SEG_DB              0x00400000
@@ -43,6 +46,14 @@
 
 #define CPU_IDT_SIZE 256
 
+#define CPU_PF_STACK_SIZE 4096
+
+#define CPU_CPUID_FEATURES              1
+#define CPU_CPUID_FEATURES_EDX_PSE      0x00000008
+#define CPU_CPUID_FEATURES_EDX_TSC      0x00000010
+#define CPU_CPUID_FEATURES_EDX_APIC     0x00000200
+#define CPU_CPUID_FEATURES_ECX_DEADLINE 0x01000000
+
 struct cpu_seg_desc {
     uint32_t low;
     uint32_t high;
@@ -76,6 +87,41 @@ struct cpu_irq_handler {
     void *arg;
 };
 
+/*
+ * Task state segment.
+ *
+ * See Volume 3: System programming guide, "7.2.1 Task-State Segment (TSS)".
+ */
+struct cpu_tss {
+    uint32_t link;
+    uint32_t esp0;
+    uint32_t ss0;
+    uint32_t esp1;
+    uint32_t ss1;
+    uint32_t esp2;
+    uint32_t ss2;
+    uint32_t cr3;
+    uint32_t eip;
+    uint32_t eflags;
+    uint32_t eax;
+    uint32_t ecx;
+    uint32_t edx;
+    uint32_t ebx;
+    uint32_t esp;
+    uint32_t ebp;
+    uint32_t esi;
+    uint32_t edi;
+    uint32_t es;
+    uint32_t cs;
+    uint32_t ss;
+    uint32_t ds;
+    uint32_t fs;
+    uint32_t gs;
+    uint32_t ldt;
+    uint16_t trap;
+    uint16_t iomap_base;
+};
+
 /*
  * TODO Reference alignment recommendation.
  */
@@ -85,9 +131,27 @@ static struct cpu_seg_desc cpu_idt[CPU_IDT_SIZE] __aligned(8);
 
 static struct cpu_irq_handler cpu_irq_handlers[16]; /* TODO Macros */
 
+static struct cpu_irq_handler cpu_local_handlers[CPU_NR_LOCAL_VECTORS];
+
+/*
+ * The main TSS is where the state of the interrupted task is saved when
+ * switching to the page fault task. Since threads are switched in
+ * software, its content is otherwise unused.
+ */
+static struct cpu_tss cpu_tss;
+static struct cpu_tss cpu_pf_tss;
+
+static char cpu_pf_stack[CPU_PF_STACK_SIZE] __aligned(16);
+
+static cpu_page_fault_fn_t cpu_page_fault_fn;
+
 void cpu_load_gdt(const struct cpu_pseudo_desc *desc);
 void cpu_load_idt(const struct cpu_pseudo_desc *desc);
+void cpu_load_tr(uint32_t selector);
+void cpu_load_paging(uint32_t cr3);
 void cpu_intr_main(struct cpu_intr_frame *frame);
+void cpu_page_fault_main(uintptr_t addr, uint32_t error);
+void cpu_page_fault_task(void);
 
 /*
  * Low level interrupt service routines.
@@ -109,6 +173,8 @@ void cpu_isr_44(void);
 void cpu_isr_45(void);
 void cpu_isr_46(void);
 void cpu_isr_47(void);
+void cpu_isr_lapic_timer(void);
+void cpu_isr_lapic_spurious(void);
 
 uint32_t
 cpu_intr_save(void)
@@ -135,6 +201,93 @@ cpu_intr_enabled(void)
     return eflags & CPU_EFL_IF;
 }
 
+/*
+ * Return true if the processor supports the CPUID instruction.
+ *
+ * Support is detected by checking whether the ID flag of the EFLAGS
+ * register can be toggled.
+ */
+static bool
+cpu_has_cpuid(void)
+{
+    uint32_t eflags, orig;
+
+    orig = cpu_get_eflags();
+    cpu_set_eflags(orig ^ CPU_EFL_ID);
+    eflags = cpu_get_eflags();
+    cpu_set_eflags(orig);
+
+    return ((eflags ^ orig) & CPU_EFL_ID) != 0;
+}
+
+/*
+ * Get the basic feature flags.
+ *
+ * Return false if the CPUID instruction isn't supported, in which case
+ * the processor has none of the features reported by CPUID.
+ */
+static bool
+cpu_get_features(uint32_t *ecxp, uint32_t *edxp)
+{
+    uint32_t eax, ebx;
+
+    if (!cpu_has_cpuid()) {
+        return false;
+    }
+
+    cpu_cpuid(CPU_CPUID_FEATURES, &eax, &ebx, ecxp, edxp);
+    return true;
+}
+
+bool
+cpu_has_tsc(void)
+{
+    uint32_t ecx, edx;
+
+    return cpu_get_features(&ecx, &edx)
+           && ((edx & CPU_CPUID_FEATURES_EDX_TSC) != 0);
+}
+
+bool
+cpu_has_apic(void)
+{
+    uint32_t ecx, edx;
+
+    return cpu_get_features(&ecx, &edx)
+           && ((edx & CPU_CPUID_FEATURES_EDX_APIC) != 0);
+}
+
+bool
+cpu_has_tsc_deadline(void)
+{
+    uint32_t ecx, edx;
+
+    return cpu_get_features(&ecx, &edx)
+           && ((ecx & CPU_CPUID_FEATURES_ECX_DEADLINE) != 0);
+}
+
+bool
+cpu_has_pse(void)
+{
+    uint32_t ecx, edx;
+
+    return cpu_get_features(&ecx, &edx)
+           && ((edx & CPU_CPUID_FEATURES_EDX_PSE) != 0);
+}
+
+void
+cpu_enable_paging(const void *pdir)
+{
+    /*
+     * CR3 isn't saved on task switches, but it is loaded from the TSS
+     * of the new task, which includes switching back from the page
+     * fault task.
+     */
+    cpu_tss.cr3 = (uint32_t)pdir;
+    cpu_pf_tss.cr3 = (uint32_t)pdir;
+    cpu_load_paging((uint32_t)pdir);
+}
+
 void
 cpu_halt(void)
 {
@@ -202,6 +355,54 @@ cpu_seg_desc_init_intr_gate(struct cpu_seg_desc *desc,
                  | 0xe00;
 }
 
+static void
+cpu_seg_desc_init_tss(struct cpu_seg_desc *desc, const struct cpu_tss *tss)
+{
+    uint32_t base, limit;
+
+    base = (uint32_t)tss;
+    limit = sizeof(*tss) - 1;
+
+    desc->low = ((base & 0xffff) << 16)
+                | (limit & 0xffff);
+    desc->high = (base & 0xff000000)
+                 | (limit & 0xf0000)
+                 | CPU_SEG_P
+                 | CPU_SEG_TSS
+                 | ((base >> 16) & 0xff);
+}
+
+static void
+cpu_seg_desc_init_task_gate(struct cpu_seg_desc *desc, uint32_t selector)
+{
+    desc->low = selector << 16;
+    desc->high = CPU_SEG_P
+                 | CPU_SEG_TASK_GATE;
+}
+
+static void
+cpu_tss_init(struct cpu_tss *tss)
+{
+    memset(tss, 0, sizeof(*tss));
+    tss->iomap_base = sizeof(*tss);
+}
+
+static void
+cpu_tss_init_task(struct cpu_tss *tss, void (*fn)(void),
+                  void *stack, size_t stack_size)
+{
+    cpu_tss_init(tss);
+    tss->eip = (uint32_t)fn;
+    tss->eflags = CPU_EFL_ONE;
+    tss->esp = (uint32_t)stack + stack_size;
+    tss->cs = CPU_GDT_SEL_CODE;
+    tss->ss = CPU_GDT_SEL_DATA;
+    tss->ds = CPU_GDT_SEL_DATA;
+    tss->es = CPU_GDT_SEL_DATA;
+    tss->fs = CPU_GDT_SEL_DATA;
+    tss->gs = CPU_GDT_SEL_DATA;
+}
+
 static void
 cpu_pseudo_desc_init(struct cpu_pseudo_desc *desc,
                      const void *addr, size_t size)
@@ -239,6 +440,15 @@ cpu_lookup_irq_handler(unsigned int irq)
     return &cpu_irq_handlers[irq];
 }
 
+static struct cpu_irq_handler *
+cpu_lookup_local_handler(unsigned int vector)
+{
+    assert(vector >= CPU_IDT_VECT_LOCAL_BASE);
+    vector -= CPU_IDT_VECT_LOCAL_BASE;
+    assert(vector < ARRAY_SIZE(cpu_local_handlers));
+    return &cpu_local_handlers[vector];
+}
+
 static void
 cpu_irq_handler_set_fn(struct cpu_irq_handler *handler,
                        cpu_irq_handler_fn_t fn, void *arg)
@@ -257,8 +467,15 @@ cpu_setup_gdt(void)
     cpu_seg_desc_init_code(cpu_get_gdt_entry(CPU_GDT_SEL_CODE));
     cpu_seg_desc_init_data(cpu_get_gdt_entry(CPU_GDT_SEL_DATA));
 
+    cpu_tss_init(&cpu_tss);
+    cpu_tss_init_task(&cpu_pf_tss, cpu_page_fault_task,
+                      cpu_pf_stack, sizeof(cpu_pf_stack));
+    cpu_seg_desc_init_tss(cpu_get_gdt_entry(CPU_GDT_SEL_TSS), &cpu_tss);
+    cpu_seg_desc_init_tss(cpu_get_gdt_entry(CPU_GDT_SEL_PF_TSS), &cpu_pf_tss);
+
     cpu_pseudo_desc_init(&pseudo_desc, cpu_gdt, sizeof(cpu_gdt));
     cpu_load_gdt(&pseudo_desc);
+    cpu_load_tr(CPU_GDT_SEL_TSS);
 }
 
 static void
@@ -270,12 +487,24 @@ cpu_setup_idt(void)
         cpu_irq_handler_init(cpu_lookup_irq_handler(i));
     }
 
+    for (size_t i = 0; i < ARRAY_SIZE(cpu_local_handlers); i++) {
+        cpu_irq_handler_init(&cpu_local_handlers[i]);
+    }
+
     for (size_t i = 0; i < ARRAY_SIZE(cpu_idt); i++) {
         cpu_seg_desc_init_intr_gate(&cpu_idt[i], cpu_default_intr_handler);
     }
 
     cpu_seg_desc_init_intr_gate(&cpu_idt[CPU_IDT_VECT_GP],
                                 cpu_isr_general_protection);
+
+    /*
+     * Page faults go through a task gate, so that the processor switches
+     * to a known valid stack before pushing anything. Faults on thread
+     * stacks would otherwise turn into double faults.
+     */
+    cpu_seg_desc_init_task_gate(&cpu_idt[CPU_IDT_VECT_PF],
+                                CPU_GDT_SEL_PF_TSS);
     cpu_seg_desc_init_intr_gate(&cpu_idt[32], cpu_isr_32);
     cpu_seg_desc_init_intr_gate(&cpu_idt[33], cpu_isr_33);
     cpu_seg_desc_init_intr_gate(&cpu_idt[34], cpu_isr_34);
@@ -292,6 +521,10 @@ cpu_setup_idt(void)
     cpu_seg_desc_init_intr_gate(&cpu_idt[45], cpu_isr_45);
     cpu_seg_desc_init_intr_gate(&cpu_idt[46], cpu_isr_46);
     cpu_seg_desc_init_intr_gate(&cpu_idt[47], cpu_isr_47);
+    cpu_seg_desc_init_intr_gate(&cpu_idt[CPU_IDT_VECT_LAPIC_TIMER],
+                                cpu_isr_lapic_timer);
+    cpu_seg_desc_init_intr_gate(&cpu_idt[CPU_IDT_VECT_LAPIC_SPURIOUS],
+                                cpu_isr_lapic_spurious);
 
     cpu_pseudo_desc_init(&pseudo_desc, cpu_idt, sizeof(cpu_idt));
     cpu_load_idt(&pseudo_desc);
@@ -313,6 +546,19 @@ cpu_intr_main(struct cpu_intr_frame *frame)
         goto out;
     }
 
+    if (frame->vector >= CPU_IDT_VECT_LOCAL_BASE) {
+        handler = cpu_lookup_local_handler(frame->vector);
+
+        if (!handler->fn) {
+            printf("cpu: error: invalid handler for vector %u\n",
+                   (unsigned int)frame->vector);
+            goto out;
+        }
+
+        handler->fn(handler->arg);
+        goto out;
+    }
+
     irq = frame->vector - 32;
 
     /* TODO Explain order */
@@ -331,6 +577,25 @@ out:
     thread_preempt_enable();
 }
 
+void
+cpu_page_fault_main(uintptr_t addr, uint32_t error)
+{
+    if (!cpu_page_fault_fn) {
+        printf("cpu: error: page fault at %#x, error: %#x\n",
+               (unsigned int)addr, (unsigned int)error);
+        cpu_halt();
+    }
+
+    cpu_page_fault_fn(addr, error);
+}
+
+void
+cpu_page_fault_register(cpu_page_fault_fn_t fn)
+{
+    assert(!cpu_page_fault_fn);
+    cpu_page_fault_fn = fn;
+}
+
 void
 cpu_irq_register(unsigned int irq, cpu_irq_handler_fn_t fn, void *arg)
 {
@@ -343,6 +608,13 @@ cpu_irq_register(unsigned int irq, cpu_irq_handler_fn_t fn, void *arg)
     i8259_irq_enable(irq);
 }
 
+void
+cpu_local_intr_register(unsigned int vector, cpu_irq_handler_fn_t fn,
+                        void *arg)
+{
+    cpu_irq_handler_set_fn(cpu_lookup_local_handler(vector), fn, arg);
+}
+
 void
 cpu_setup(void)
 {
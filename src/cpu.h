@@ -29,6 +29,13 @@
  */
 #define CPU_EFL_ONE     0x002
 #define CPU_EFL_IF      0x200
+#define CPU_EFL_ID      0x200000
+
+/*
+ * Control register flags.
+ */
+#define CPU_CR0_PG      0x80000000
+#define CPU_CR4_PSE     0x00000010
 
 /*
  * GDT segment descriptor indexes.
@@ -36,16 +43,31 @@
 #define CPU_GDT_SEL_NULL    0x00
 #define CPU_GDT_SEL_CODE    0x08
 #define CPU_GDT_SEL_DATA    0x10
-#define CPU_GDT_SIZE        3
+#define CPU_GDT_SEL_TSS     0x18
+#define CPU_GDT_SEL_PF_TSS  0x20
+#define CPU_GDT_SIZE        5
 
 /*
  * IDT segment descriptor indexes.
  * Exception and interrupt vectors.
  */
 #define CPU_IDT_VECT_GP             13
+#define CPU_IDT_VECT_PF             14
 #define CPU_IDT_VECT_PIC_MASTER     32
 #define CPU_IDT_VECT_PIC_SLAVE      (CPU_IDT_VECT_PIC_MASTER + 8)
 
+/*
+ * Vectors of local interrupts, i.e. interrupts that aren't routed through
+ * the PIC.
+ *
+ * On older processors, the spurious vector of the local APIC must have
+ * its 4 lowest bits set.
+ */
+#define CPU_IDT_VECT_LOCAL_BASE     48
+#define CPU_IDT_VECT_LAPIC_TIMER    CPU_IDT_VECT_LOCAL_BASE
+#define CPU_IDT_VECT_LAPIC_SPURIOUS (CPU_IDT_VECT_LOCAL_BASE + 15)
+#define CPU_NR_LOCAL_VECTORS        16
+
 #ifndef __ASSEMBLER__
 
 #include <stdbool.h>
@@ -53,6 +75,14 @@
 
 typedef void (*cpu_irq_handler_fn_t)(void *arg);
 
+/*
+ * Type for page fault handlers.
+ *
+ * The address is the linear address which caused the fault, and the
+ * error code is the one pushed by the processor.
+ */
+typedef void (*cpu_page_fault_fn_t)(uintptr_t addr, uint32_t error);
+
 /*
  * Get/set the content of the EFLAGS register.
  */
@@ -80,10 +110,88 @@ bool cpu_intr_enabled(void);
 
 void cpu_idle(void);
 
+/*
+ * Return the value of the time stamp counter.
+ *
+ * The TSC is a 64-bits counter incremented at a constant rate on modern
+ * processors. Its frequency is unknown unless calibrated against another
+ * clock, which makes raw values only useful for relative measurements.
+ */
+uint64_t cpu_get_tsc(void);
+
+/*
+ * Execute the CPUID instruction for the given leaf.
+ *
+ * The processor must support the CPUID instruction.
+ */
+void cpu_cpuid(uint32_t leaf, uint32_t *eaxp, uint32_t *ebxp,
+               uint32_t *ecxp, uint32_t *edxp);
+
+/*
+ * Read/write a model specific register.
+ */
+uint64_t cpu_get_msr(uint32_t msr);
+void cpu_set_msr(uint32_t msr, uint64_t value);
+
+/*
+ * Return true if the processor has a time stamp counter.
+ */
+bool cpu_has_tsc(void);
+
+/*
+ * Return true if the processor has a local APIC.
+ */
+bool cpu_has_apic(void);
+
+/*
+ * Return true if the local APIC timer supports the TSC-deadline mode.
+ */
+bool cpu_has_tsc_deadline(void);
+
+/*
+ * Return true if the processor supports 4 MiB pages.
+ */
+bool cpu_has_pse(void);
+
+/*
+ * Enable paging, using the given page directory.
+ *
+ * Large pages are enabled as well. The code calling this function must
+ * be identity mapped.
+ */
+void cpu_enable_paging(const void *pdir);
+
+/*
+ * Invalidate the TLB entry for the page at the given address.
+ */
+void cpu_invlpg(const void *addr);
+
 void cpu_halt(void) __attribute__((noreturn));
 
 void cpu_irq_register(unsigned int irq, cpu_irq_handler_fn_t fn, void *arg);
 
+/*
+ * Register a handler for a local interrupt vector.
+ *
+ * Unlike IRQ handlers, local interrupt handlers are responsible for
+ * acknowledging the interrupt, since the way to do it depends on the
+ * source.
+ */
+void cpu_local_intr_register(unsigned int vector, cpu_irq_handler_fn_t fn,
+                             void *arg);
+
+/*
+ * Register the page fault handler.
+ *
+ * Page faults are handled by a separate task, with its own stack, so
+ * that faults caused by a stack pointer referring to an unmapped page
+ * can be serviced. As a result, the handler runs with interrupts
+ * disabled and must not use any service that may block, yield, or
+ * reenable preemption. In particular, mutexes may not be used, even
+ * with mutex_trylock.
+ */
+void cpu_page_fault_register(cpu_page_fault_fn_t fn);
+
 void cpu_setup(void);
 
 #endif /* __ASSEMBLER__ */
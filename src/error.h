@@ -31,6 +31,7 @@ enum {
     ERROR_IO,
     ERROR_BUSY,
     ERROR_EXIST,
+    ERROR_TIMEDOUT,
 };
 
 #endif /* _ERROR_H */
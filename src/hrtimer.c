@@ -0,0 +1,412 @@
+/*
+ * Copyright (c) 2017 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <lib/list.h>
+
+#include "clock.h"
+#include "cpu.h"
+#include "error.h"
+#include "hrtimer.h"
+#include "lapic.h"
+#include "panic.h"
+#include "thread.h"
+
+#define HRTIMER_STACK_SIZE 4096
+
+/*
+ * Timer states.
+ */
+#define HRTIMER_STATE_IDLE      0   /* Not scheduled */
+#define HRTIMER_STATE_SCHEDULED 1   /* In the sorted list of timers */
+#define HRTIMER_STATE_PENDING   2   /* Expired, waiting for the thread */
+
+/*
+ * Sleep request.
+ */
+struct hrtimer_sleeper {
+    struct thread *thread;
+    bool expired;
+};
+
+/*
+ * List of scheduled timers, sorted by expiry time.
+ *
+ * Timers may be scheduled and cancelled from interrupt context, which is
+ * why the lists of timers are protected by disabling interrupts.
+ */
+static struct list hrtimer_list;
+
+/*
+ * List of expired timers waiting to be run by the timer thread.
+ */
+static struct list hrtimer_pending_list;
+
+/*
+ * Timers the functions of which are currently running, in the timer
+ * thread and in interrupt context respectively.
+ */
+static struct hrtimer *hrtimer_running;
+static struct hrtimer *hrtimer_intr_running;
+
+static struct thread *hrtimer_thread;
+
+/*
+ * Number of expirations processed along with others, in the same
+ * interrupt.
+ */
+static unsigned long hrtimer_nr_coalesced;
+
+static bool
+hrtimer_expired(const struct hrtimer *timer, uint64_t now)
+{
+    return timer->time <= now;
+}
+
+/*
+ * Return the time at which a timer must have expired, i.e. its scheduled
+ * time plus its slack.
+ */
+static uint64_t
+hrtimer_deadline(const struct hrtimer *timer)
+{
+    return timer->time + timer->slack;
+}
+
+static void
+hrtimer_program(void)
+{
+    struct hrtimer *timer;
+
+    assert(!cpu_intr_enabled());
+
+    if (!lapic_available()) {
+        return;
+    }
+
+    if (list_empty(&hrtimer_list)) {
+        lapic_timer_stop();
+    } else {
+        timer = list_first_entry(&hrtimer_list, struct hrtimer, node);
+        lapic_timer_program(hrtimer_deadline(timer));
+    }
+}
+
+static void
+hrtimer_add(struct hrtimer *timer)
+{
+    struct hrtimer *tmp;
+    struct list *node;
+
+    assert(!cpu_intr_enabled());
+    assert(timer->state == HRTIMER_STATE_IDLE);
+
+    /*
+     * Timers are usually scheduled in the near future, after those
+     * already scheduled, so look for the insertion point from the tail.
+     */
+    list_for_each_reverse(&hrtimer_list, node) {
+        tmp = list_entry(node, struct hrtimer, node);
+
+        if (hrtimer_deadline(tmp) <= hrtimer_deadline(timer)) {
+            break;
+        }
+    }
+
+    list_insert_after(node, &timer->node);
+    timer->state = HRTIMER_STATE_SCHEDULED;
+}
+
+static void
+hrtimer_remove(struct hrtimer *timer)
+{
+    assert(!cpu_intr_enabled());
+    assert(timer->state != HRTIMER_STATE_IDLE);
+
+    list_remove(&timer->node);
+    timer->state = HRTIMER_STATE_IDLE;
+}
+
+/*
+ * Process expired timers.
+ *
+ * Hard IRQ timers are run immediately, while others are passed to the
+ * timer thread.
+ *
+ * Timers are sorted by deadline, and the interrupt is programmed for the
+ * first one. When it's raised, all the timers at the head of the list
+ * that have reached their scheduled time are processed, even if their
+ * deadline is later, which coalesces their expirations into a single
+ * interrupt.
+ */
+static void
+hrtimer_process(void)
+{
+    unsigned long nr_expired;
+    struct hrtimer *timer;
+    bool wakeup;
+
+    assert(!cpu_intr_enabled());
+
+    nr_expired = 0;
+    wakeup = false;
+
+    while (!list_empty(&hrtimer_list)) {
+        timer = list_first_entry(&hrtimer_list, struct hrtimer, node);
+
+        if (!hrtimer_expired(timer, clock_now_ns())) {
+            break;
+        }
+
+        hrtimer_remove(timer);
+        nr_expired++;
+
+        if (timer->flags & HRTIMER_HARDIRQ) {
+            hrtimer_intr_running = timer;
+            timer->fn(timer->arg);
+            hrtimer_intr_running = NULL;
+        } else {
+            list_insert_tail(&hrtimer_pending_list, &timer->node);
+            timer->state = HRTIMER_STATE_PENDING;
+            wakeup = true;
+        }
+    }
+
+    if (nr_expired > 1) {
+        hrtimer_nr_coalesced += nr_expired - 1;
+    }
+
+    hrtimer_program();
+
+    if (wakeup) {
+        thread_wakeup(hrtimer_thread);
+    }
+}
+
+static void
+hrtimer_intr(void *arg)
+{
+    (void)arg;
+
+    lapic_eoi();
+    hrtimer_process();
+}
+
+static void
+hrtimer_run(void *arg)
+{
+    struct hrtimer *timer;
+    uint32_t eflags;
+
+    (void)arg;
+
+    for (;;) {
+        thread_preempt_disable();
+        eflags = cpu_intr_save();
+
+        while (list_empty(&hrtimer_pending_list)) {
+            thread_sleep();
+        }
+
+        timer = list_first_entry(&hrtimer_pending_list, struct hrtimer, node);
+        hrtimer_remove(timer);
+        hrtimer_running = timer;
+
+        cpu_intr_restore(eflags);
+        thread_preempt_enable();
+
+        timer->fn(timer->arg);
+
+        eflags = cpu_intr_save();
+        hrtimer_running = NULL;
+        cpu_intr_restore(eflags);
+    }
+}
+
+void
+hrtimer_setup(void)
+{
+    int error;
+
+    list_init(&hrtimer_list);
+    list_init(&hrtimer_pending_list);
+    hrtimer_running = NULL;
+    hrtimer_intr_running = NULL;
+    hrtimer_nr_coalesced = 0;
+
+    if (lapic_available()) {
+        cpu_local_intr_register(CPU_IDT_VECT_LAPIC_TIMER, hrtimer_intr, NULL);
+    }
+
+    error = thread_create(&hrtimer_thread, hrtimer_run, NULL,
+                          "hrtimer", HRTIMER_STACK_SIZE, THREAD_MAX_PRIORITY);
+
+    if (error) {
+        panic("hrtimer: unable to create thread");
+    }
+}
+
+void
+hrtimer_init(struct hrtimer *timer, hrtimer_fn_t fn, void *arg, int flags)
+{
+    timer->fn = fn;
+    timer->arg = arg;
+    timer->flags = flags;
+    timer->slack = 0;
+    timer->state = HRTIMER_STATE_IDLE;
+}
+
+void
+hrtimer_set_slack(struct hrtimer *timer, uint64_t slack)
+{
+    uint32_t eflags;
+
+    eflags = cpu_intr_save();
+    timer->slack = slack;
+    cpu_intr_restore(eflags);
+}
+
+uint64_t
+hrtimer_get_time(const struct hrtimer *timer)
+{
+    uint64_t time;
+    uint32_t eflags;
+
+    eflags = cpu_intr_save();
+    time = timer->time;
+    cpu_intr_restore(eflags);
+
+    return time;
+}
+
+void
+hrtimer_schedule(struct hrtimer *timer, uint64_t ns)
+{
+    uint32_t eflags;
+    bool first;
+
+    eflags = cpu_intr_save();
+
+    if (timer->state != HRTIMER_STATE_IDLE) {
+        hrtimer_remove(timer);
+    }
+
+    timer->time = ns;
+    hrtimer_add(timer);
+
+    first = (list_first(&hrtimer_list) == &timer->node);
+
+    if (first) {
+        hrtimer_program();
+    }
+
+    cpu_intr_restore(eflags);
+}
+
+int
+hrtimer_cancel(struct hrtimer *timer)
+{
+    uint32_t eflags;
+    bool cancelled;
+    int error;
+
+    eflags = cpu_intr_save();
+
+    cancelled = (timer->state != HRTIMER_STATE_IDLE);
+
+    if (cancelled) {
+        hrtimer_remove(timer);
+    }
+
+    if ((timer == hrtimer_running) || (timer == hrtimer_intr_running)) {
+        error = ERROR_BUSY;
+    } else if (cancelled) {
+        error = 0;
+    } else {
+        error = ERROR_AGAIN;
+    }
+
+    cpu_intr_restore(eflags);
+
+    return error;
+}
+
+unsigned long
+hrtimer_get_nr_coalesced(void)
+{
+    unsigned long nr_coalesced;
+    uint32_t eflags;
+
+    eflags = cpu_intr_save();
+    nr_coalesced = hrtimer_nr_coalesced;
+    cpu_intr_restore(eflags);
+
+    return nr_coalesced;
+}
+
+static void
+hrtimer_sleep_expired(void *arg)
+{
+    struct hrtimer_sleeper *sleeper;
+
+    sleeper = arg;
+    sleeper->expired = true;
+    thread_wakeup(sleeper->thread);
+}
+
+void
+hrtimer_sleep(uint64_t duration)
+{
+    struct hrtimer_sleeper sleeper;
+    struct hrtimer timer;
+    uint32_t eflags;
+
+    sleeper.thread = thread_self();
+    sleeper.expired = false;
+    hrtimer_init(&timer, hrtimer_sleep_expired, &sleeper, HRTIMER_HARDIRQ);
+
+    thread_preempt_disable();
+    eflags = cpu_intr_save();
+
+    hrtimer_schedule(&timer, clock_now_ns() + duration);
+
+    while (!sleeper.expired) {
+        thread_sleep();
+    }
+
+    cpu_intr_restore(eflags);
+    thread_preempt_enable();
+}
+
+void
+hrtimer_report_tick(void)
+{
+    if (lapic_available()) {
+        return;
+    }
+
+    hrtimer_process();
+}
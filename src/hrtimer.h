@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2017 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ *
+ * High resolution timer module.
+ *
+ * High resolution timers expire at a monotonic time in nanoseconds, as
+ * returned by clock_now_ns(). A timer may also have a slack, in which
+ * case it may expire anywhere between its scheduled time and its
+ * deadline, i.e. its scheduled time plus its slack. Timers are kept in a
+ * list sorted by deadline, and the local APIC timer is programmed to
+ * raise an interrupt at the first deadline. All timers that have reached
+ * their scheduled time are then processed in that interrupt.
+ *
+ * Each timer selects the context its function runs in. Hard IRQ timers
+ * run directly from the interrupt handler, with interrupts disabled,
+ * which gives the lowest latency, but their functions must not block.
+ * Other timers run in a dedicated thread at the maximum priority, at
+ * the cost of a context switch.
+ *
+ * Without a local APIC, timers are checked on every timer tick, which
+ * makes them no more accurate than regular timers.
+ */
+
+#ifndef _HRTIMER_H
+#define _HRTIMER_H
+
+#include <stdint.h>
+
+#include <lib/list.h>
+
+/*
+ * Timer flags.
+ */
+#define HRTIMER_HARDIRQ 0x1 /* Run the timer function in interrupt context */
+
+/*
+ * Type for timer functions.
+ */
+typedef void (*hrtimer_fn_t)(void *arg);
+
+/*
+ * High resolution timer type.
+ *
+ * All members are private.
+ */
+struct hrtimer {
+    struct list node;
+    uint64_t time;
+    hrtimer_fn_t fn;
+    void *arg;
+    uint64_t slack;
+    int flags;
+    unsigned int state;
+};
+
+/*
+ * Initialize the hrtimer module.
+ */
+void hrtimer_setup(void);
+
+/*
+ * Initialize a high resolution timer.
+ */
+void hrtimer_init(struct hrtimer *timer, hrtimer_fn_t fn, void *arg,
+                  int flags);
+
+/*
+ * Set the slack of a timer, in nanoseconds.
+ *
+ * The slack is 0 by default, and only applies to later scheduling.
+ */
+void hrtimer_set_slack(struct hrtimer *timer, uint64_t slack);
+
+/*
+ * Return the time at which a timer is scheduled, in nanoseconds.
+ */
+uint64_t hrtimer_get_time(const struct hrtimer *timer);
+
+/*
+ * Schedule a timer.
+ *
+ * The timer function is run once the given monotonic time, in
+ * nanoseconds, has been reached. Scheduling a timer that is already
+ * scheduled reschedules it.
+ *
+ * This function may be called from interrupt context.
+ */
+void hrtimer_schedule(struct hrtimer *timer, uint64_t ns);
+
+/*
+ * Cancel a timer.
+ *
+ * If the timer is scheduled, it's cancelled, and its function won't run
+ * for that expiry.
+ *
+ * Return ERROR_BUSY if the timer function is currently running, whether
+ * a later expiry was cancelled or not, in which case the timer must not
+ * be released until its function returns. Otherwise, return 0 if the
+ * timer was scheduled, and ERROR_AGAIN if it wasn't. Since the functions
+ * of hard IRQ timers run with interrupts disabled, they can only be found
+ * running by themselves.
+ *
+ * This function may be called from interrupt context.
+ */
+int hrtimer_cancel(struct hrtimer *timer);
+
+/*
+ * Return the number of coalesced expirations.
+ *
+ * An expiration is coalesced when it's processed in the same interrupt
+ * as other expirations.
+ */
+unsigned long hrtimer_get_nr_coalesced(void);
+
+/*
+ * Make the calling thread sleep for the given duration, in nanoseconds.
+ */
+void hrtimer_sleep(uint64_t duration);
+
+/*
+ * Report a timer tick.
+ *
+ * This function is called by the i8254 interrupt handler, and only
+ * processes timers if the local APIC isn't available.
+ */
+void hrtimer_report_tick(void);
+
+#endif /* _HRTIMER_H */
@@ -23,21 +23,35 @@
 
 #include <lib/macros.h>
 
+#include "clock.h"
 #include "cpu.h"
+#include "hrtimer.h"
 #include "i8254.h"
 #include "io.h"
 #include "thread.h"
 
-#define I8254_FREQ                  1193182
-
 #define I8254_PORT_CHANNEL0         0x40
+#define I8254_PORT_CHANNEL2         0x42
 #define I8254_PORT_MODE             0x43
 
+/*
+ * The gate of channel 2 and the speaker are controlled through the
+ * system control port of the keyboard controller, which also reports
+ * the output of channel 2.
+ */
+#define I8254_PORT_SYSTEM_CONTROL   0x61
+#define I8254_SYSTEM_CONTROL_GATE2  0x01
+#define I8254_SYSTEM_CONTROL_SPKR   0x02
+#define I8254_SYSTEM_CONTROL_OUT2   0x20
+
 #define I8254_CONTROL_BINARY        0x00
+#define I8254_CONTROL_INTR_ON_TC    0x00
 #define I8254_CONTROL_RATE_GEN      0x04
+#define I8254_CONTROL_LATCH         0x00
 #define I8254_CONTROL_RW_LSB        0x10
 #define I8254_CONTROL_RW_MSB        0x20
 #define I8254_CONTROL_COUNTER0      0x00
+#define I8254_CONTROL_COUNTER2      0x80
 
 #define I8254_INITIAL_COUNT         DIV_CEIL(I8254_FREQ, THREAD_SCHED_FREQ)
 
@@ -47,6 +61,8 @@ static void
 i8254_irq_handler(void *arg)
 {
     (void)arg;
+    clock_report_tick();
+    hrtimer_report_tick();
     thread_report_tick();
 }
 
@@ -68,3 +84,50 @@ i8254_setup(void)
     io_write(I8254_PORT_CHANNEL0, value & 0xff);
     io_write(I8254_PORT_CHANNEL0, value >> 8);
 }
+
+uint16_t
+i8254_get_initial_count(void)
+{
+    return I8254_INITIAL_COUNT;
+}
+
+uint16_t
+i8254_read_counter(void)
+{
+    uint16_t value;
+    uint32_t eflags;
+
+    eflags = cpu_intr_save();
+    io_write(I8254_PORT_MODE, I8254_CONTROL_COUNTER0 | I8254_CONTROL_LATCH);
+    value = io_read(I8254_PORT_CHANNEL0);
+    value |= (uint16_t)io_read(I8254_PORT_CHANNEL0) << 8;
+    cpu_intr_restore(eflags);
+
+    return value;
+}
+
+void
+i8254_oneshot_start(uint16_t count)
+{
+    uint8_t control;
+
+    control = io_read(I8254_PORT_SYSTEM_CONTROL);
+    control &= ~I8254_SYSTEM_CONTROL_SPKR;
+    control |= I8254_SYSTEM_CONTROL_GATE2;
+    io_write(I8254_PORT_SYSTEM_CONTROL, control);
+
+    io_write(I8254_PORT_MODE, I8254_CONTROL_COUNTER2
+                              | I8254_CONTROL_RW_MSB
+                              | I8254_CONTROL_RW_LSB
+                              | I8254_CONTROL_INTR_ON_TC
+                              | I8254_CONTROL_BINARY);
+    io_write(I8254_PORT_CHANNEL2, count & 0xff);
+    io_write(I8254_PORT_CHANNEL2, count >> 8);
+}
+
+bool
+i8254_oneshot_expired(void)
+{
+    return (io_read(I8254_PORT_SYSTEM_CONTROL) & I8254_SYSTEM_CONTROL_OUT2)
+           != 0;
+}
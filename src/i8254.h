@@ -27,9 +27,48 @@
 #ifndef _I8254_H
 #define _I8254_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Frequency of the input clock of the i8254, in Hz.
+ */
+#define I8254_FREQ 1193182
+
 /*
  * Initialize the i8254 module.
  */
 void i8254_setup(void);
 
+/*
+ * Return the initial count of channel 0, i.e. the number of input clock
+ * periods between two timer interrupts.
+ */
+uint16_t i8254_get_initial_count(void);
+
+/*
+ * Return the current count of channel 0.
+ *
+ * The counter is latched before being read so that both bytes are
+ * consistent. It counts down from the initial count, and is reloaded
+ * when it reaches 0, at which point a timer interrupt is raised.
+ */
+uint16_t i8254_read_counter(void);
+
+/*
+ * Start a one-shot countdown on channel 2.
+ *
+ * Channel 2 isn't connected to the interrupt controller. Instead, its
+ * output can be polled with i8254_oneshot_expired(), which makes it
+ * suitable for busy waiting, e.g. when calibrating other clocks. It
+ * may only be used with interrupts disabled, during initialization.
+ */
+void i8254_oneshot_start(uint16_t count);
+
+/*
+ * Return true if the countdown started with i8254_oneshot_start() has
+ * reached 0.
+ */
+bool i8254_oneshot_expired(void);
+
 #endif /* _I8254_H */
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2017 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdbool.h>
+
+#include <lib/list.h>
+
+#include "idle.h"
+#include "thread.h"
+
+/*
+ * List of registered idle work.
+ *
+ * Work is only added, with preemption disabled, so that the idle thread
+ * may walk the list without further synchronization, even when it's
+ * preempted in the middle of a walk.
+ */
+static struct list idle_works = LIST_INITIALIZER(idle_works);
+
+void
+idle_work_init(struct idle_work *work, idle_work_fn_t fn, void *arg)
+{
+    work->fn = fn;
+    work->arg = arg;
+}
+
+void
+idle_work_register(struct idle_work *work)
+{
+    thread_preempt_disable();
+    list_insert_tail(&idle_works, &work->node);
+    thread_preempt_enable();
+}
+
+bool
+idle_run(void)
+{
+    struct idle_work *work;
+    bool more;
+
+    more = false;
+
+    list_for_each_entry(&idle_works, work, node) {
+        more |= work->fn(work->arg);
+    }
+
+    return more;
+}
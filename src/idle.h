@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2017 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ *
+ * Idle work.
+ *
+ * The idle thread runs when no other thread is runnable. Instead of
+ * halting the processor right away, it first runs idle work, i.e.
+ * background tasks that make later operations cheaper, such as zeroing
+ * pages in advance, or returning cached memory to where it can be
+ * coalesced. Busy periods don't pay for any of it.
+ *
+ * Work functions are called repeatedly, and each call should only do a
+ * small, bounded amount of work, such as zeroing a block of pages, and
+ * report whether there is more to do. Since the idle thread runs with
+ * preemption enabled, it's preempted as soon as another thread becomes
+ * runnable, e.g. when an interrupt wakes it up, and work resumes the next
+ * time the processor is idle.
+ *
+ * Work functions must never sleep, since the idle thread must always be
+ * runnable. In particular, they must acquire mutexes with mutex_trylock(),
+ * and return if a mutex is already locked. The only exception is mutexes
+ * that are never held by sleeping threads, such as the page allocator
+ * mutex, since the idle thread only runs when all other threads are
+ * sleeping, which means such mutexes are always unlocked.
+ *
+ * In addition, work functions must disable preemption before acquiring a
+ * mutex, and only enable it again once the mutex is released. Otherwise,
+ * a thread woken up by an interrupt could preempt the idle thread while
+ * it holds the mutex, and since the idle thread only runs when no other
+ * thread is runnable, threads waiting for that mutex would be blocked for
+ * as long as others keep the processor busy. Note that re-enabling
+ * preemption is a preemption point, which is why it must not be done
+ * between acquiring and releasing the mutex. The page allocator
+ * functions follow the same rule internally.
+ */
+
+#ifndef _IDLE_H
+#define _IDLE_H
+
+#include <stdbool.h>
+
+#include <lib/list.h>
+
+/*
+ * Type for idle work functions.
+ *
+ * Return true if there is more work to do.
+ */
+typedef bool (*idle_work_fn_t)(void *arg);
+
+/*
+ * Idle work.
+ *
+ * All members are private.
+ */
+struct idle_work {
+    struct list node;
+    idle_work_fn_t fn;
+    void *arg;
+};
+
+/*
+ * Initialize idle work.
+ */
+void idle_work_init(struct idle_work *work, idle_work_fn_t fn, void *arg);
+
+/*
+ * Register idle work.
+ *
+ * Once registered, the work function is called whenever the processor
+ * is idle, until it reports that there is nothing left to do, and again
+ * the next time the processor becomes idle. Idle work can't be
+ * unregistered.
+ *
+ * This function may be called at any time after the thread module is
+ * bootstrapped.
+ */
+void idle_work_register(struct idle_work *work);
+
+/*
+ * Run all registered idle work once.
+ *
+ * Return true if there is more work to do.
+ *
+ * This function is called by the idle thread.
+ */
+bool idle_run(void);
+
+#endif /* _IDLE_H */
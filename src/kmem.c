@@ -0,0 +1,484 @@
+/*
+ * Copyright (c) 2017 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include <lib/list.h>
+#include <lib/macros.h>
+#include <lib/shell.h>
+
+#include "idle.h"
+#include "kmem.h"
+#include "mutex.h"
+#include "page.h"
+#include "panic.h"
+#include "thread.h"
+
+/*
+ * Size of processor cache lines, used as the colouring step.
+ */
+#define KMEM_CACHE_LINE_SIZE    64
+
+/*
+ * Minimum number of buffers per slab.
+ *
+ * Slabs are one page large, and made larger for large objects, so that
+ * they contain at least KMEM_MIN_BUFS_PER_SLAB buffers, which keeps the
+ * unused space at the end of slabs reasonably small.
+ */
+#define KMEM_MIN_BUFS_PER_SLAB  8
+
+/*
+ * Number of free slabs caches keep when trimmed by the idle thread.
+ */
+#define KMEM_IDLE_FREE_SLABS    1
+
+/*
+ * Buffer control word.
+ *
+ * A buffer is the memory used to store an object, followed by its control
+ * word. While the buffer is free, the control word links it in the free
+ * list of its slab. While it's allocated, the control word points to its
+ * slab, which is how objects are returned to their slab when freed. Using
+ * storage outside the object itself allows preserving its constructed
+ * state while it's free.
+ */
+union kmem_bufctl {
+    union kmem_bufctl *next;
+    struct kmem_slab *slab;
+};
+
+/*
+ * Slab descriptor.
+ *
+ * Descriptors are stored at the beginning of their slab, which is a block
+ * of pages, followed by the colouring space and the buffers. Slabs which
+ * have allocated objects but aren't full are linked in the partial list
+ * of their cache, empty slabs are linked in the free list, and full slabs
+ * aren't linked at all.
+ */
+struct kmem_slab {
+    struct list node;
+    unsigned long nr_refs;
+    union kmem_bufctl *first_free;
+};
+
+/*
+ * Registry of caches.
+ *
+ * The list is only modified with preemption disabled, which allows
+ * initializing caches very early, before the scheduler is running.
+ * Caches are never removed.
+ */
+static struct list kmem_cache_list = LIST_INITIALIZER(kmem_cache_list);
+
+static struct idle_work kmem_trim_work;
+
+static union kmem_bufctl *
+kmem_buf_to_bufctl(const struct kmem_cache *cache, void *buf)
+{
+    return (union kmem_bufctl *)((char *)buf + cache->bufctl_offset);
+}
+
+static void *
+kmem_bufctl_to_buf(const struct kmem_cache *cache, union kmem_bufctl *bufctl)
+{
+    return (char *)bufctl - cache->bufctl_offset;
+}
+
+static size_t
+kmem_cache_header_size(const struct kmem_cache *cache)
+{
+    return P2ROUND(sizeof(struct kmem_slab), cache->align);
+}
+
+static bool
+kmem_cache_empty(const struct kmem_cache *cache)
+{
+    return list_empty(&cache->partial_slabs) && list_empty(&cache->free_slabs);
+}
+
+static struct kmem_slab *
+kmem_slab_create(struct kmem_cache *cache, size_t colour)
+{
+    union kmem_bufctl *bufctl;
+    struct kmem_slab *slab;
+    char *buf;
+
+    slab = page_alloc(cache->slab_order);
+
+    if (!slab) {
+        return NULL;
+    }
+
+    slab->nr_refs = 0;
+    slab->first_free = NULL;
+
+    buf = (char *)slab + kmem_cache_header_size(cache) + colour
+          + ((cache->bufs_per_slab - 1) * cache->buf_size);
+
+    /*
+     * Build the free list backward, so that objects are allocated in
+     * increasing address order.
+     */
+    for (unsigned long i = 0; i < cache->bufs_per_slab; i++) {
+        if (cache->ctor) {
+            cache->ctor(buf);
+        }
+
+        bufctl = kmem_buf_to_bufctl(cache, buf);
+        bufctl->next = slab->first_free;
+        slab->first_free = bufctl;
+        buf -= cache->buf_size;
+    }
+
+    return slab;
+}
+
+static void
+kmem_slab_destroy(struct kmem_slab *slab)
+{
+    assert(slab->nr_refs == 0);
+    page_free(slab);
+}
+
+/*
+ * Add a new slab to a cache.
+ *
+ * The cache must not be locked, since constructors may take a while.
+ */
+static int
+kmem_cache_grow(struct kmem_cache *cache)
+{
+    struct kmem_slab *slab;
+    size_t colour;
+
+    mutex_lock(&cache->mutex);
+
+    colour = cache->colour;
+    cache->colour += KMEM_CACHE_LINE_SIZE;
+
+    if (cache->colour > cache->colour_max) {
+        cache->colour = 0;
+    }
+
+    mutex_unlock(&cache->mutex);
+
+    slab = kmem_slab_create(cache, colour);
+
+    if (!slab) {
+        return -1;
+    }
+
+    mutex_lock(&cache->mutex);
+    list_insert_tail(&cache->free_slabs, &slab->node);
+    cache->nr_slabs++;
+    cache->nr_free_slabs++;
+    cache->nr_bufs += cache->bufs_per_slab;
+    cache->nr_free_bufs += cache->bufs_per_slab;
+    mutex_unlock(&cache->mutex);
+
+    return 0;
+}
+
+void
+kmem_cache_init(struct kmem_cache *cache, const char *name,
+                size_t obj_size, size_t align, kmem_ctor_fn_t ctor)
+{
+    size_t header_size, free_size;
+
+    assert(obj_size != 0);
+    assert(ISP2(align));
+    assert(align <= KMEM_CACHE_LINE_SIZE);
+
+    if (align < sizeof(union kmem_bufctl)) {
+        align = sizeof(union kmem_bufctl);
+    }
+
+    mutex_init(&cache->mutex);
+    list_init(&cache->partial_slabs);
+    list_init(&cache->free_slabs);
+    cache->obj_size = obj_size;
+    cache->align = align;
+    cache->bufctl_offset = P2ROUND(obj_size, sizeof(union kmem_bufctl));
+    cache->buf_size = P2ROUND(cache->bufctl_offset
+                              + sizeof(union kmem_bufctl), align);
+    cache->ctor = ctor;
+    cache->nr_slabs = 0;
+    cache->nr_free_slabs = 0;
+    cache->nr_bufs = 0;
+    cache->nr_free_bufs = 0;
+    snprintf(cache->name, sizeof(cache->name), "%s", name);
+
+    header_size = kmem_cache_header_size(cache);
+    cache->slab_order = 0;
+    cache->slab_size = PAGE_SIZE;
+
+    while (((cache->slab_size - header_size) / cache->buf_size)
+           < KMEM_MIN_BUFS_PER_SLAB) {
+        cache->slab_order++;
+        cache->slab_size *= 2;
+    }
+
+    assert(cache->slab_order < PAGE_NR_ORDERS);
+
+    cache->bufs_per_slab = (cache->slab_size - header_size) / cache->buf_size;
+
+    /*
+     * The space left at the end of slabs is used to shift buffers by a
+     * varying number of cache lines from one slab to another.
+     */
+    free_size = cache->slab_size - header_size
+                - (cache->bufs_per_slab * cache->buf_size);
+    cache->colour = 0;
+    cache->colour_max = P2ALIGN(free_size, KMEM_CACHE_LINE_SIZE);
+
+    thread_preempt_disable();
+    list_insert_tail(&kmem_cache_list, &cache->node);
+    thread_preempt_enable();
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *cache)
+{
+    union kmem_bufctl *bufctl;
+    struct kmem_slab *slab;
+    int error;
+
+    mutex_lock(&cache->mutex);
+
+    while (kmem_cache_empty(cache)) {
+        mutex_unlock(&cache->mutex);
+
+        error = kmem_cache_grow(cache);
+
+        if (error) {
+            kmem_reclaim();
+            error = kmem_cache_grow(cache);
+
+            if (error) {
+                return NULL;
+            }
+        }
+
+        mutex_lock(&cache->mutex);
+    }
+
+    if (list_empty(&cache->partial_slabs)) {
+        slab = list_first_entry(&cache->free_slabs, struct kmem_slab, node);
+        list_remove(&slab->node);
+        list_insert_head(&cache->partial_slabs, &slab->node);
+        cache->nr_free_slabs--;
+    } else {
+        slab = list_first_entry(&cache->partial_slabs, struct kmem_slab, node);
+    }
+
+    bufctl = slab->first_free;
+    assert(bufctl);
+    slab->first_free = bufctl->next;
+    slab->nr_refs++;
+    cache->nr_free_bufs--;
+
+    if (slab->nr_refs == cache->bufs_per_slab) {
+        list_remove(&slab->node);
+    }
+
+    bufctl->slab = slab;
+
+    mutex_unlock(&cache->mutex);
+
+    return kmem_bufctl_to_buf(cache, bufctl);
+}
+
+void
+kmem_cache_free(struct kmem_cache *cache, void *obj)
+{
+    union kmem_bufctl *bufctl;
+    struct kmem_slab *slab;
+
+    if (!obj) {
+        return;
+    }
+
+    bufctl = kmem_buf_to_bufctl(cache, obj);
+    slab = bufctl->slab;
+
+    mutex_lock(&cache->mutex);
+
+    assert(slab->nr_refs != 0);
+
+    if (slab->nr_refs == cache->bufs_per_slab) {
+        list_insert_head(&cache->partial_slabs, &slab->node);
+    }
+
+    bufctl->next = slab->first_free;
+    slab->first_free = bufctl;
+    slab->nr_refs--;
+    cache->nr_free_bufs++;
+
+    if (slab->nr_refs == 0) {
+        list_remove(&slab->node);
+        list_insert_tail(&cache->free_slabs, &slab->node);
+        cache->nr_free_slabs++;
+    }
+
+    mutex_unlock(&cache->mutex);
+}
+
+void
+kmem_cache_reclaim(struct kmem_cache *cache)
+{
+    struct kmem_slab *slab, *tmp;
+    struct list slabs;
+
+    mutex_lock(&cache->mutex);
+
+    list_set_head(&slabs, &cache->free_slabs);
+    list_init(&cache->free_slabs);
+    cache->nr_slabs -= cache->nr_free_slabs;
+    cache->nr_bufs -= cache->nr_free_slabs * cache->bufs_per_slab;
+    cache->nr_free_bufs -= cache->nr_free_slabs * cache->bufs_per_slab;
+    cache->nr_free_slabs = 0;
+
+    mutex_unlock(&cache->mutex);
+
+    list_for_each_entry_safe(&slabs, slab, tmp, node) {
+        kmem_slab_destroy(slab);
+    }
+}
+
+void
+kmem_reclaim(void)
+{
+    struct kmem_cache *cache;
+
+    list_for_each_entry(&kmem_cache_list, cache, node) {
+        kmem_cache_reclaim(cache);
+    }
+}
+
+/*
+ * Trim caches, one slab at a time.
+ *
+ * When the processor is idle, free slabs in excess of KMEM_IDLE_FREE_SLABS
+ * are returned to the page allocator, where they can be merged with their
+ * buddies. The most recently freed slabs are released first, since the
+ * oldest are reused first.
+ */
+static bool
+kmem_trim_work_run(void *arg)
+{
+    struct kmem_cache *cache;
+    struct kmem_slab *slab;
+
+    (void)arg;
+
+    list_for_each_entry(&kmem_cache_list, cache, node) {
+        thread_preempt_disable();
+
+        if (mutex_trylock(&cache->mutex) != 0) {
+            thread_preempt_enable();
+            continue;
+        }
+
+        slab = NULL;
+
+        if (cache->nr_free_slabs > KMEM_IDLE_FREE_SLABS) {
+            slab = list_last_entry(&cache->free_slabs, struct kmem_slab, node);
+            list_remove(&slab->node);
+            cache->nr_slabs--;
+            cache->nr_free_slabs--;
+            cache->nr_bufs -= cache->bufs_per_slab;
+            cache->nr_free_bufs -= cache->bufs_per_slab;
+        }
+
+        mutex_unlock(&cache->mutex);
+        thread_preempt_enable();
+
+        if (slab) {
+            kmem_slab_destroy(slab);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void
+kmem_shell_info(int argc, char **argv)
+{
+    struct kmem_cache *cache;
+
+    (void)argc;
+    (void)argv;
+
+    printf("kmem: %-16s %8s %8s %8s %6s %8s %8s %10s %10s\n",
+           "name", "obj_size", "buf_size", "slab", "bufs", "slabs",
+           "free", "bufs", "free");
+
+    list_for_each_entry(&kmem_cache_list, cache, node) {
+        mutex_lock(&cache->mutex);
+        printf("kmem: %-16s %8zu %8zu %8zu %6lu %8lu %8lu %10lu %10lu\n",
+               cache->name, cache->obj_size, cache->buf_size,
+               cache->slab_size, cache->bufs_per_slab, cache->nr_slabs,
+               cache->nr_free_slabs, cache->nr_bufs, cache->nr_free_bufs);
+        mutex_unlock(&cache->mutex);
+    }
+}
+
+static void
+kmem_shell_reclaim(int argc, char **argv)
+{
+    (void)argc;
+    (void)argv;
+
+    kmem_reclaim();
+}
+
+static struct shell_cmd kmem_shell_cmds[] = {
+    SHELL_CMD_INITIALIZER("kmem_info", kmem_shell_info,
+        "kmem_info",
+        "display object cache usage"),
+    SHELL_CMD_INITIALIZER("kmem_reclaim", kmem_shell_reclaim,
+        "kmem_reclaim",
+        "release the empty slabs of all caches"),
+};
+
+void
+kmem_setup(void)
+{
+    int error;
+
+    for (size_t i = 0; i < ARRAY_SIZE(kmem_shell_cmds); i++) {
+        error = shell_cmd_register(&kmem_shell_cmds[i]);
+
+        if (error) {
+            panic("kmem: unable to register shell command");
+        }
+    }
+
+    idle_work_init(&kmem_trim_work, kmem_trim_work_run, NULL);
+    idle_work_register(&kmem_trim_work);
+}
@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2017 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ *
+ * Object caching allocator.
+ *
+ * This is a simple implementation of the slab allocator [1]. Each cache
+ * manages objects of a single size, carved out of blocks of pages, called
+ * slabs, obtained from the page allocator. Allocating and freeing an
+ * object only takes a few list operations on the cache, without any
+ * boundary tag, and without locking the global heap, which makes caches
+ * well suited for small, frequently allocated objects.
+ *
+ * Objects may be constructed once, when their slab is created, and are
+ * assumed to be returned to their cache in their constructed state, so
+ * that initialization common to all uses is only done once. Slabs are
+ * "coloured", i.e. objects start at varying offsets in different slabs,
+ * so that objects at the same index in different slabs don't all compete
+ * for the same processor cache lines. Empty slabs are kept around until
+ * they're reclaimed, which happens when pages are exhausted, or on
+ * request.
+ *
+ * [1] https://www.usenix.org/legacy/publications/library/proceedings/bos94/full_papers/bonwick.ps
+ */
+
+#ifndef _KMEM_H
+#define _KMEM_H
+
+#include <stddef.h>
+
+#include <lib/list.h>
+
+#include "mutex.h"
+
+/*
+ * Maximum size of cache names, including the null terminating character.
+ */
+#define KMEM_NAME_SIZE 16
+
+/*
+ * Type for object constructors.
+ */
+typedef void (*kmem_ctor_fn_t)(void *obj);
+
+/*
+ * Object cache.
+ *
+ * All members are private.
+ */
+struct kmem_cache {
+    struct mutex mutex;
+    struct list node;
+    struct list partial_slabs;
+    struct list free_slabs;
+    size_t obj_size;
+    size_t align;
+    size_t bufctl_offset;
+    size_t buf_size;
+    unsigned int slab_order;
+    size_t slab_size;
+    unsigned long bufs_per_slab;
+    size_t colour;
+    size_t colour_max;
+    kmem_ctor_fn_t ctor;
+    unsigned long nr_slabs;
+    unsigned long nr_free_slabs;
+    unsigned long nr_bufs;
+    unsigned long nr_free_bufs;
+    char name[KMEM_NAME_SIZE];
+};
+
+/*
+ * Initialize the kmem module.
+ *
+ * This function registers the kmem shell commands, and the idle work
+ * that trims caches. Caches may be initialized and used before it's
+ * called.
+ */
+void kmem_setup(void);
+
+/*
+ * Initialize a cache.
+ *
+ * The alignment must be a power-of-two, no larger than a cache line. If
+ * zero, objects are aligned like pointers. The constructor is optional.
+ *
+ * Caches are never destroyed.
+ */
+void kmem_cache_init(struct kmem_cache *cache, const char *name,
+                     size_t obj_size, size_t align, kmem_ctor_fn_t ctor);
+
+/*
+ * Allocate an object from a cache.
+ *
+ * Return NULL if memory is exhausted.
+ */
+void * kmem_cache_alloc(struct kmem_cache *cache);
+
+/*
+ * Return an object to its cache.
+ *
+ * The object must be in its constructed state, if the cache has a
+ * constructor.
+ */
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
+
+/*
+ * Release the empty slabs of a cache to the page allocator.
+ */
+void kmem_cache_reclaim(struct kmem_cache *cache);
+
+/*
+ * Release the empty slabs of all caches to the page allocator.
+ */
+void kmem_reclaim(void);
+
+#endif /* _KMEM_H */
@@ -0,0 +1,220 @@
+/*
+ * Copyright (c) 2017 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "clock.h"
+#include "cpu.h"
+#include "i8254.h"
+#include "lapic.h"
+
+#define LAPIC_MSR_BASE              0x1b
+#define LAPIC_MSR_BASE_ENABLE       0x800
+#define LAPIC_MSR_BASE_ADDR_MASK    0xfffff000
+#define LAPIC_MSR_TSC_DEADLINE      0x6e0
+
+#define LAPIC_REG_TPR               0x080
+#define LAPIC_REG_EOI               0x0b0
+#define LAPIC_REG_SVR               0x0f0
+#define LAPIC_REG_LVT_TIMER         0x320
+#define LAPIC_REG_LVT_LINT0         0x350
+#define LAPIC_REG_LVT_LINT1         0x360
+#define LAPIC_REG_TIMER_ICR         0x380
+#define LAPIC_REG_TIMER_CCR         0x390
+#define LAPIC_REG_TIMER_DCR         0x3e0
+
+#define LAPIC_SVR_ENABLE            0x100
+
+#define LAPIC_LVT_DELIVERY_NMI      0x400
+#define LAPIC_LVT_DELIVERY_EXTINT   0x700
+#define LAPIC_LVT_MASKED            0x10000
+#define LAPIC_LVT_TIMER_ONESHOT     0x00000
+#define LAPIC_LVT_TIMER_DEADLINE    0x40000
+
+/*
+ * Divide the bus clock by 16 for the timer, which, with common bus
+ * frequencies, gives a resolution in the tens of nanoseconds, and a
+ * range of over a minute.
+ */
+#define LAPIC_TIMER_DCR_DIV16       0x3
+
+/*
+ * Number of i8254 input clock periods used to calibrate the timer, which
+ * amounts to 10ms.
+ */
+#define LAPIC_CALIBRATION_COUNT     (I8254_FREQ / 100)
+
+static volatile uint32_t *lapic_regs;
+
+static bool lapic_deadline_enabled;
+
+/*
+ * Scale converting nanoseconds to timer counts, in one-shot mode.
+ */
+static struct clock_scale lapic_timer_scale;
+
+static uint32_t
+lapic_read(unsigned int reg)
+{
+    return lapic_regs[reg / sizeof(*lapic_regs)];
+}
+
+static void
+lapic_write(unsigned int reg, uint32_t value)
+{
+    lapic_regs[reg / sizeof(*lapic_regs)] = value;
+}
+
+static void
+lapic_spurious_intr(void *arg)
+{
+    /*
+     * Spurious interrupts must not be acknowledged.
+     */
+    (void)arg;
+}
+
+static void
+lapic_timer_calibrate(void)
+{
+    uint32_t counts;
+    uint64_t freq;
+
+    lapic_write(LAPIC_REG_TIMER_DCR, LAPIC_TIMER_DCR_DIV16);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED
+                                     | LAPIC_LVT_TIMER_ONESHOT
+                                     | CPU_IDT_VECT_LAPIC_TIMER);
+
+    i8254_oneshot_start(LAPIC_CALIBRATION_COUNT);
+    lapic_write(LAPIC_REG_TIMER_ICR, (uint32_t)-1);
+
+    while (!i8254_oneshot_expired());
+
+    counts = (uint32_t)-1 - lapic_read(LAPIC_REG_TIMER_CCR);
+    lapic_write(LAPIC_REG_TIMER_ICR, 0);
+
+    freq = ((uint64_t)counts * I8254_FREQ) / LAPIC_CALIBRATION_COUNT;
+    clock_scale_init(&lapic_timer_scale, CLOCK_NS_PER_SEC, freq);
+}
+
+void
+lapic_setup(void)
+{
+    uint64_t base;
+
+    assert(!cpu_intr_enabled());
+
+    if (!cpu_has_apic()) {
+        return;
+    }
+
+    base = cpu_get_msr(LAPIC_MSR_BASE);
+    cpu_set_msr(LAPIC_MSR_BASE, base | LAPIC_MSR_BASE_ENABLE);
+    lapic_regs = (volatile uint32_t *)(uint32_t)(base
+                                                 & LAPIC_MSR_BASE_ADDR_MASK);
+
+    cpu_local_intr_register(CPU_IDT_VECT_LAPIC_SPURIOUS,
+                            lapic_spurious_intr, NULL);
+
+    /*
+     * Set up virtual wire mode, so that the i8259 keeps delivering
+     * external interrupts.
+     */
+    lapic_write(LAPIC_REG_TPR, 0);
+    lapic_write(LAPIC_REG_LVT_LINT0, LAPIC_LVT_DELIVERY_EXTINT);
+    lapic_write(LAPIC_REG_LVT_LINT1, LAPIC_LVT_DELIVERY_NMI);
+    lapic_write(LAPIC_REG_SVR, LAPIC_SVR_ENABLE | CPU_IDT_VECT_LAPIC_SPURIOUS);
+
+    lapic_deadline_enabled = cpu_has_tsc_deadline() && clock_uses_tsc();
+
+    if (lapic_deadline_enabled) {
+        lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_TIMER_DEADLINE
+                                         | CPU_IDT_VECT_LAPIC_TIMER);
+    } else {
+        lapic_timer_calibrate();
+        lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_TIMER_ONESHOT
+                                         | CPU_IDT_VECT_LAPIC_TIMER);
+    }
+}
+
+bool
+lapic_available(void)
+{
+    return lapic_regs != NULL;
+}
+
+bool
+lapic_timer_uses_deadline(void)
+{
+    return lapic_deadline_enabled;
+}
+
+void
+lapic_eoi(void)
+{
+    assert(!cpu_intr_enabled());
+    lapic_write(LAPIC_REG_EOI, 0);
+}
+
+void
+lapic_timer_program(uint64_t ns)
+{
+    uint64_t now, counts;
+
+    assert(!cpu_intr_enabled());
+    assert(lapic_available());
+
+    if (lapic_deadline_enabled) {
+        cpu_set_msr(LAPIC_MSR_TSC_DEADLINE, clock_ns_to_tsc(ns));
+        return;
+    }
+
+    now = clock_now_ns();
+    counts = (ns > now) ? clock_scale_apply(&lapic_timer_scale, ns - now) : 0;
+
+    /*
+     * Writing 0 to the initial count register stops the timer.
+     */
+    if (counts == 0) {
+        counts = 1;
+    } else if ((counts >> 32) != 0) {
+        counts = (uint32_t)-1;
+    }
+
+    lapic_write(LAPIC_REG_TIMER_ICR, counts);
+}
+
+void
+lapic_timer_stop(void)
+{
+    assert(!cpu_intr_enabled());
+    assert(lapic_available());
+
+    if (lapic_deadline_enabled) {
+        cpu_set_msr(LAPIC_MSR_TSC_DEADLINE, 0);
+    } else {
+        lapic_write(LAPIC_REG_TIMER_ICR, 0);
+    }
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2017 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ *
+ * Local APIC driver.
+ *
+ * Only the features needed for high resolution timers are supported.
+ * External interrupts keep being delivered by the i8259 PIC, through
+ * the local APIC configured in virtual wire mode.
+ *
+ * The local APIC registers are accessed at their default physical
+ * address, which must be identity mapped.
+ */
+
+#ifndef _LAPIC_H
+#define _LAPIC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Initialize the lapic module.
+ *
+ * If the processor has no local APIC, this function does nothing. It
+ * calibrates the timer, and must be called with interrupts disabled,
+ * once the clock module is initialized.
+ */
+void lapic_setup(void);
+
+/*
+ * Return true if the local APIC is available.
+ */
+bool lapic_available(void);
+
+/*
+ * Return true if the timer uses the TSC-deadline mode.
+ */
+bool lapic_timer_uses_deadline(void);
+
+/*
+ * Report an end of interrupt.
+ *
+ * This function must be called with interrupts disabled.
+ */
+void lapic_eoi(void);
+
+/*
+ * Program the timer to raise an interrupt at the given monotonic time,
+ * in nanoseconds.
+ *
+ * If the time has already passed, the interrupt is raised as soon as
+ * possible. In one-shot mode, the timer may fire before the given time
+ * if it's too far in the future for the counter, in which case it must
+ * simply be reprogrammed. This function must be called with interrupts
+ * disabled.
+ */
+void lapic_timer_program(uint64_t ns);
+
+/*
+ * Stop the timer.
+ *
+ * This function must be called with interrupts disabled.
+ */
+void lapic_timer_stop(void);
+
+#endif /* _LAPIC_H */
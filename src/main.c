@@ -27,15 +27,26 @@
 #include <lib/macros.h>
 #include <lib/shell.h>
 
+#include "bench.h"
+#include "boot.h"
+#include "clock.h"
 #include "cpu.h"
+#include "hrtimer.h"
 #include "i8254.h"
 #include "i8259.h"
+#include "kmem.h"
+#include "lapic.h"
 #include "mem.h"
+#include "mutex.h"
+#include "page.h"
 #include "panic.h"
+#include "parking.h"
+#include "printf.h"
 #include "sw.h"
 #include "thread.h"
 #include "timer.h"
 #include "uart.h"
+#include "vm.h"
 
 /*
  * XXX The Clang compiler apparently doesn't like the lack of prototype for
@@ -52,15 +63,28 @@ void
 main(void)
 {
     thread_bootstrap();
+    boot_setup();
+    parking_setup();
     cpu_setup();
     i8259_setup();
     i8254_setup();
+    clock_setup();
+    lapic_setup();
     uart_setup();
-    mem_setup();
+    printf_setup();
+    mem_bootstrap();
+    page_bootstrap();
+    vm_setup();
     thread_setup();
-    timer_setup();
+    hrtimer_setup();
     shell_setup();
+    mem_setup();
+    page_setup();
+    kmem_setup();
+    timer_setup();
+    mutex_setup();
     sw_setup();
+    bench_setup();
 
     printf("X1 " QUOTE(VERSION) "\n\n");
 
@@ -31,6 +31,15 @@
  *        - Algorithm A (First-fit method)
  *        - Algorithm C (Liberation with boundary tags)
  *
+ * Free blocks, however, aren't stored in a single list searched with the
+ * first-fit method, but in segregated free lists, using the Two-Level
+ * Segregated Fit (TLSF) algorithm [1], which makes both allocation and
+ * liberation constant time operations, regardless of fragmentation.
+ *
+ * [1] M. Masmano, I. Ripoll, A. Crespo, and J. Real. TLSF: a new dynamic
+ *     memory allocator for real-time systems. In Proceedings of the 16th
+ *     Euromicro Conference on Real-Time Systems, 2004.
+ *
  * The point of a memory allocator is to manage memory in terms of allocation
  * and liberation requests. Allocation finds and reserves memory for a user,
  * whereas liberation makes that memory available again for future allocations.
@@ -123,28 +132,38 @@
  */
 
 #include <assert.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 
 #include <lib/list.h>
 #include <lib/macros.h>
+#include <lib/shell.h>
 
+#include "boot.h"
+#include "idle.h"
 #include "mem.h"
 #include "mutex.h"
+#include "page.h"
+#include "panic.h"
+#include "thread.h"
 
 /*
- * Total size of the backing storage heap.
+ * Bounds of the size of the backing storage heap.
  *
- * Note that the resulting kernel image file remains much smaller than this.
- * The reason is because the heap is defined as uninitialized data, which are
- * allocated out of the bss section by default. The bss section is filled
- * with zeroes when the kernel image is loaded by the boot loader, as
- * mandated by the ELF specification, which means there is no need to store
- * the heap data, or any other statically allocated uninitialized data, in
- * the kernel image file.
+ * The heap isn't statically allocated, which would require the boot loader
+ * to fill it with zeroes, as mandated by the ELF specification for the bss
+ * section, and would make its size independent of the amount of memory
+ * actually available. Instead, the heap is carved out of free memory
+ * reported by the boot loader, and takes half of it, within these bounds,
+ * the rest being left to the page allocator. Since the heap is initialized
+ * with a single free block, its initialization doesn't depend on its size.
  */
-#define MEM_HEAP_SIZE       (32 * 1024 * 1024)
+#define MEM_HEAP_MIN_SIZE   (1024 * 1024)
+#define MEM_HEAP_MAX_SIZE   (1024 * 1024 * 1024)
 
 /*
  * Alignment required on addresses returned by mem_alloc().
@@ -164,20 +183,66 @@
 /*
  * The heap itself must be aligned, so that the first block is also aligned.
  * Assuming all blocks have an aligned size, the last block must also end on
- * an aligned address.
+ * an aligned address. The heap is made of whole pages, which guarantees
+ * both, as long as pages are larger than the alignment.
  *
  * This kind of check increases safety and robustness when changing
- * compile-time parameters such as the heap size declared above.
- *
- * Another relevant check would be to make sure the heap is large enough
- * to contain at least one block, but since the minimum block size is
- * defined using the C sizeof operator, unknown to the C preprocessor,
- * this check requires C11 static assertions.
+ * compile-time parameters such as the alignment declared above.
+ */
+#if !P2ALIGNED(PAGE_SIZE, MEM_ALIGN)
+#error "invalid heap alignment"
+#endif
+
+/*
+ * Number of second level classes, per first level range.
+ */
+#define MEM_SL_SHIFT        4
+#define MEM_SL_COUNT        (1 << MEM_SL_SHIFT)
+
+/*
+ * Sizes below this threshold all belong to the first range of the first
+ * level, divided in classes of MEM_ALIGN bytes.
+ */
+#define MEM_FL_MIN_SHIFT    (MEM_SL_SHIFT + 2)
+#define MEM_SMALL_SIZE      (1 << MEM_FL_MIN_SHIFT)
+
+#if (MEM_SMALL_SIZE / MEM_SL_COUNT) != MEM_ALIGN
+#error "invalid segregated free lists parameters"
+#endif
+
+/*
+ * Number of first level ranges, covering all sizes below 4 GiB, so that
+ * a 32-bits bitmap is enough.
  */
-#if !P2ALIGNED(MEM_HEAP_SIZE, MEM_ALIGN)
-#error "invalid heap size"
+#define MEM_FL_MAX_SHIFT    32
+#define MEM_FL_COUNT        (MEM_FL_MAX_SHIFT - MEM_FL_MIN_SHIFT + 1)
+
+#if MEM_HEAP_MAX_SIZE >= (1ULL << (MEM_FL_MAX_SHIFT - 1))
+#error "heap too large for segregated free lists"
 #endif
 
+/*
+ * Magazine parameters.
+ *
+ * Magazines cache up to MEM_MAGAZINE_SIZE free blocks of a size class, and
+ * are refilled from, and flushed to, the heap MEM_MAGAZINE_BATCH blocks at
+ * a time. Blocks larger than MEM_MAGAZINE_MAX_SIZE are never cached.
+ */
+#define MEM_MAGAZINE_SIZE       16
+#define MEM_MAGAZINE_BATCH      (MEM_MAGAZINE_SIZE / 2)
+#define MEM_MAGAZINE_MAX_SIZE   512
+
+/*
+ * Allocations at least this large are served by the page allocator, so
+ * that large buffers don't fragment the heap.
+ */
+#define MEM_LARGE_SIZE          (4 * PAGE_SIZE)
+
+/*
+ * Value used in magazine maps for sizes without magazine.
+ */
+#define MEM_MAGAZINE_NONE       0xff
+
 /*
  * Masks applied on boundary tags to extract the size and the allocation flag.
  */
@@ -221,15 +286,52 @@ struct mem_free_node {
 };
 
 /*
- * List of free nodes.
+ * Segregated free lists.
+ *
+ * Free blocks are sorted in size classes, each with its own list. The
+ * first level divides sizes in power-of-two ranges, and the second level
+ * divides each of these ranges in MEM_SL_COUNT linear classes. For small
+ * sizes, the first level is collapsed into a single range, split in
+ * classes as large as the alignment. Bitmaps record which lists are
+ * non-empty, so that finding a suitable list only takes a few bit
+ * scanning instructions, instead of walking free blocks.
  *
  * Here is an example of a TODO entry, a method used to store and retrieve
  * pending tasks using source code only :
  *
  * TODO Statistics counters.
  */
-struct mem_free_list {
-    struct list free_nodes;
+struct mem_free_lists {
+    size_t free_size;
+    uint32_t fl_bitmap;
+    uint32_t sl_bitmaps[MEM_FL_COUNT];
+    struct list free_nodes[MEM_FL_COUNT][MEM_SL_COUNT];
+};
+
+/*
+ * Magazine of free blocks.
+ *
+ * Most allocations are small, and many of them are short-lived, so that
+ * it's worth keeping recently freed blocks of common sizes around, in
+ * magazines [1]. Allocating from, and freeing to, a magazine only
+ * requires disabling preemption, which is how per-processor data are
+ * normally protected. As a result, the global heap mutex is only taken
+ * when a magazine is empty or full, and blocks are then transferred in
+ * batches, which amortizes the cost of locking.
+ *
+ * All blocks in a magazine are at least as large as its size, but may be
+ * larger, since blocks aren't always split. On allocation, the request
+ * size is rounded up to the size of a magazine, whereas on liberation,
+ * blocks are stored in the largest magazine they can serve.
+ *
+ * There is a single processor, hence a single set of magazines.
+ *
+ * [1] https://www.usenix.org/legacy/event/usenix01/full_papers/bonwick/bonwick.pdf
+ */
+struct mem_magazine {
+    size_t size;
+    unsigned int nr_rounds;
+    void *rounds[MEM_MAGAZINE_SIZE];
 };
 
 /*
@@ -243,22 +345,51 @@ struct mem_free_list {
  * The heap must be correctly aligned, so that the first block is
  * correctly aligned.
  */
-static char mem_heap[MEM_HEAP_SIZE] __aligned(MEM_ALIGN);
+static char *mem_heap;
+static size_t mem_heap_size;
 
 /*
- * The unique free list.
- *
- * In order to improve allocation speed, multiple lists may be used, each
- * for a specific size range. Such lists are called segregated free lists
- * and enable more allocation policies, such as instant-fit.
+ * Total size of blocks of pages used for large allocations.
+ */
+static size_t mem_large_size;
+
+/*
+ * Largest amount of memory allocated at once, including blocks cached in
+ * magazines and large allocations.
  */
-static struct mem_free_list mem_free_list;
+static size_t mem_peak_size;
+
+/*
+ * The segregated free lists.
+ */
+static struct mem_free_lists mem_free_lists;
 
 /*
  * Global mutex used to serialize access to allocation data.
  */
 static struct mutex mem_mutex;
 
+/*
+ * Block sizes of magazines.
+ */
+static const size_t mem_magazine_sizes[] = {
+    16, 24, 32, 48, 64, 96, 128, 192, 256, 384, MEM_MAGAZINE_MAX_SIZE,
+};
+
+static struct mem_magazine mem_magazines[ARRAY_SIZE(mem_magazine_sizes)];
+
+/*
+ * Maps of block sizes, in units of the alignment, to magazine indexes.
+ *
+ * The allocation map returns the smallest magazine a block size fits in,
+ * and the liberation map the largest magazine a block of that size can
+ * serve.
+ */
+static uint8_t mem_magazine_alloc_map[(MEM_MAGAZINE_MAX_SIZE / MEM_ALIGN) + 1];
+static uint8_t mem_magazine_free_map[(MEM_MAGAZINE_MAX_SIZE / MEM_ALIGN) + 1];
+
+static struct idle_work mem_trim_work;
+
 static bool
 mem_aligned(size_t value)
 {
@@ -268,7 +399,13 @@ mem_aligned(size_t value)
 static void *
 mem_heap_end(void)
 {
-    return &mem_heap[sizeof(mem_heap)];
+    return &mem_heap[mem_heap_size];
+}
+
+static bool
+mem_heap_inside(const void *ptr)
+{
+    return ((const char *)ptr >= mem_heap) && (ptr < mem_heap_end());
 }
 
 static bool
@@ -441,6 +578,12 @@ mem_block_payload(struct mem_block *block)
     return block->payload;
 }
 
+static size_t
+mem_block_payload_size(const struct mem_block *block)
+{
+    return mem_block_size(block) - (sizeof(struct mem_btag) * 2);
+}
+
 static struct mem_free_node *
 mem_block_get_free_node(struct mem_block *block)
 {
@@ -459,76 +602,162 @@ mem_block_inside_heap(const struct mem_block *block)
             && ((void *)mem_block_end(block) <= heap_end));
 }
 
+/*
+ * Return the index of the most significant bit set in a non-zero value.
+ */
+static unsigned int
+mem_fls(size_t value)
+{
+    assert(value != 0);
+    return (sizeof(value) * CHAR_BIT) - 1 - __builtin_clzl(value);
+}
+
+/*
+ * Return the index of the least significant bit set in a non-zero value.
+ */
+static unsigned int
+mem_ffs(uint32_t value)
+{
+    assert(value != 0);
+    return __builtin_ctz(value);
+}
+
+/*
+ * Compute the first and second level indexes of the class a block size
+ * belongs to.
+ */
+static void
+mem_free_lists_map(size_t size, unsigned int *flp, unsigned int *slp)
+{
+    unsigned int msb;
+
+    if (size < MEM_SMALL_SIZE) {
+        *flp = 0;
+        *slp = size / (MEM_SMALL_SIZE / MEM_SL_COUNT);
+        return;
+    }
+
+    msb = mem_fls(size);
+    *flp = msb - MEM_FL_MIN_SHIFT + 1;
+    *slp = (size >> (msb - MEM_SL_SHIFT)) & (MEM_SL_COUNT - 1);
+}
+
 static void
-mem_free_list_add(struct mem_free_list *list, struct mem_block *block)
+mem_free_lists_add(struct mem_free_lists *lists, struct mem_block *block)
 {
     struct mem_free_node *free_node;
+    unsigned int fl, sl;
 
     assert(mem_block_allocated(block));
 
     mem_block_clear_allocated(block);
     free_node = mem_block_get_free_node(block);
+    mem_free_lists_map(mem_block_size(block), &fl, &sl);
 
     /*
      * Free blocks may be added at either the head or the tail of a list.
-     * In this case, it's normally better to add at the head, because the
-     * first-fit algorithm implementation starts from the beginning. This
-     * means there is a good chance that a block recently freed may "soon"
-     * be allocated again. Since it's likely that this block was accessed
-     * before it was freed, there is a good chance that (part of) its memory
-     * is still in the processor cache, potentially increasing the chances
-     * of cache hits and saving a few expensive accesses from the processor
-     * to memory. This is an example of inexpensive micro-optimization.
+     * In this case, it's normally better to add at the head, because
+     * allocation takes the first block of a list. This means there is a
+     * good chance that a block recently freed may "soon" be allocated
+     * again. Since it's likely that this block was accessed before it was
+     * freed, there is a good chance that (part of) its memory is still in
+     * the processor cache, potentially increasing the chances of cache hits
+     * and saving a few expensive accesses from the processor to memory.
+     * This is an example of inexpensive micro-optimization.
      */
-    list_insert_head(&list->free_nodes, &free_node->node);
+    list_insert_head(&lists->free_nodes[fl][sl], &free_node->node);
+    lists->sl_bitmaps[fl] |= (1U << sl);
+    lists->fl_bitmap |= (1U << fl);
+    lists->free_size += mem_block_size(block);
 }
 
 static void
-mem_free_list_remove(struct mem_free_list *list, struct mem_block *block)
+mem_free_lists_remove(struct mem_free_lists *lists, struct mem_block *block)
 {
     struct mem_free_node *free_node;
-
-    (void)list;
+    unsigned int fl, sl;
 
     assert(!mem_block_allocated(block));
 
     free_node = mem_block_get_free_node(block);
     list_remove(&free_node->node);
+    mem_free_lists_map(mem_block_size(block), &fl, &sl);
+    lists->free_size -= mem_block_size(block);
+
+    if (list_empty(&lists->free_nodes[fl][sl])) {
+        lists->sl_bitmaps[fl] &= ~(1U << sl);
+
+        if (lists->sl_bitmaps[fl] == 0) {
+            lists->fl_bitmap &= ~(1U << fl);
+        }
+    }
+
     mem_block_set_allocated(block);
 }
 
 static struct mem_block *
-mem_free_list_find(struct mem_free_list *list, size_t size)
+mem_free_lists_find(struct mem_free_lists *lists, size_t size)
 {
     struct mem_free_node *free_node;
-    struct mem_block *block;
+    unsigned int fl, sl;
+    uint32_t bitmap;
 
     /*
-     * The algorithmic complexity of this operation is O(n) [1] which
+     * Blocks in a class may be smaller than the requested size, unless
+     * the class is entirely above it. Round the size up to the next class
+     * boundary, so that any block found is large enough, without ever
+     * walking a list. This "good-fit" policy wastes at most a fraction of
+     * 1 / MEM_SL_COUNT of the block.
+     *
+     * The algorithmic complexity of this operation is O(1) [1], which
      * basically means the maximum number of steps, and time, for the
-     * operation to complete depend on the number of elements in the list.
-     * This is one of the main reasons why memory allocation is generally
-     * avoided in interrupt handlers and real-time applications. Special
-     * allocators with guaranteed constant time or a fixed and known worst
-     * case time, may be used in these cases.
+     * operation to complete doesn't depend on the number of free blocks.
+     * This is what makes this allocator suitable for real-time uses,
+     * unlike first-fit allocators, the worst case of which grows with
+     * fragmentation.
      *
      * [1] https://en.wikipedia.org/wiki/Big_O_notation
      */
-    list_for_each_entry(&list->free_nodes, free_node, node) {
-        block = mem_block_from_payload(free_node);
+    if (size > mem_heap_size) {
+        return NULL;
+    } else if (size >= MEM_SMALL_SIZE) {
+        size += (1UL << (mem_fls(size) - MEM_SL_SHIFT)) - 1;
+    }
+
+    mem_free_lists_map(size, &fl, &sl);
 
-        if (mem_block_size(block) >= size) {
-            return block;
+    bitmap = lists->sl_bitmaps[fl] & (~0U << sl);
+
+    if (bitmap == 0) {
+        bitmap = lists->fl_bitmap & (~0U << (fl + 1));
+
+        if (bitmap == 0) {
+            return NULL;
         }
+
+        fl = mem_ffs(bitmap);
+        bitmap = lists->sl_bitmaps[fl];
     }
 
-    return NULL;
+    sl = mem_ffs(bitmap);
+    free_node = list_first_entry(&lists->free_nodes[fl][sl],
+                                 struct mem_free_node, node);
+    return mem_block_from_payload(free_node);
 }
 
 static void
-mem_free_list_init(struct mem_free_list *list)
+mem_free_lists_init(struct mem_free_lists *lists)
 {
-    list_init(&list->free_nodes);
+    lists->free_size = 0;
+    lists->fl_bitmap = 0;
+
+    for (size_t i = 0; i < ARRAY_SIZE(lists->free_nodes); i++) {
+        lists->sl_bitmaps[i] = 0;
+
+        for (size_t j = 0; j < ARRAY_SIZE(lists->free_nodes[i]); j++) {
+            list_init(&lists->free_nodes[i][j]);
+        }
+    }
 }
 
 static bool
@@ -576,8 +805,8 @@ mem_block_merge(struct mem_block *block1, struct mem_block *block2)
         return NULL;
     }
 
-    mem_free_list_remove(&mem_free_list, block1);
-    mem_free_list_remove(&mem_free_list, block2);
+    mem_free_lists_remove(&mem_free_lists, block1);
+    mem_free_lists_remove(&mem_free_lists, block2);
     size = mem_block_size(block1) + mem_block_size(block2);
 
     if (block1 > block2) {
@@ -585,20 +814,83 @@ mem_block_merge(struct mem_block *block1, struct mem_block *block2)
     }
 
     mem_block_init(block1, size);
-    mem_free_list_add(&mem_free_list, block1);
+    mem_free_lists_add(&mem_free_lists, block1);
     return block1;
 }
 
+static void
+mem_magazines_init(void)
+{
+    size_t size;
+    uint8_t index;
+
+    for (size_t i = 0; i < ARRAY_SIZE(mem_magazines); i++) {
+        assert(mem_aligned(mem_magazine_sizes[i]));
+        mem_magazines[i].size = mem_magazine_sizes[i];
+        mem_magazines[i].nr_rounds = 0;
+    }
+
+    for (size_t i = 0; i < ARRAY_SIZE(mem_magazine_alloc_map); i++) {
+        size = i * MEM_ALIGN;
+        index = MEM_MAGAZINE_NONE;
+
+        for (size_t j = 0; j < ARRAY_SIZE(mem_magazines); j++) {
+            if (mem_magazines[j].size >= size) {
+                index = j;
+                break;
+            }
+        }
+
+        mem_magazine_alloc_map[i] = index;
+        index = MEM_MAGAZINE_NONE;
+
+        for (size_t j = 0; j < ARRAY_SIZE(mem_magazines); j++) {
+            if (mem_magazines[j].size > size) {
+                break;
+            }
+
+            index = j;
+        }
+
+        mem_magazine_free_map[i] = index;
+    }
+}
+
 void
-mem_setup(void)
+mem_bootstrap(void)
 {
     struct mem_block *block;
+    size_t size;
+
+    size = MIN(boot_get_free_size() / 2, MEM_HEAP_MAX_SIZE);
+    size = P2ALIGN(size, PAGE_SIZE);
+
+    for (;;) {
+        if (size < MEM_HEAP_MIN_SIZE) {
+            panic("mem: unable to allocate heap");
+        }
 
+        mem_heap = boot_alloc(size);
+
+        if (mem_heap) {
+            break;
+        }
+
+        /*
+         * Free memory may be split in several regions, none of which
+         * is large enough.
+         */
+        size = P2ALIGN(size / 2, PAGE_SIZE);
+    }
+
+    mem_heap_size = size;
     block = (struct mem_block *)mem_heap;
-    mem_block_init(block, sizeof(mem_heap));
-    mem_free_list_init(&mem_free_list);
-    mem_free_list_add(&mem_free_list, block);
+    mem_block_init(block, mem_heap_size);
+    mem_free_lists_init(&mem_free_lists);
+    mem_free_lists_add(&mem_free_lists, block);
     mutex_init(&mem_mutex);
+    mutex_set_name(&mem_mutex, "mem");
+    mem_magazines_init();
 }
 
 static size_t
@@ -619,58 +911,64 @@ mem_convert_to_block_size(size_t size)
     return size;
 }
 
-void *
-mem_alloc(size_t size)
+/*
+ * Record the current amount of allocated memory if it's a new peak.
+ *
+ * Free blocks are temporarily removed from the free lists while blocks
+ * are split or merged, so this function must only be called once the
+ * heap is consistent, i.e. right before unlocking the heap mutex.
+ *
+ * The heap mutex must be locked.
+ */
+static void
+mem_update_peak(void)
 {
-    struct mem_block *block, *block2;
-    void *ptr;
+    size_t size;
 
-    if (size == 0) {
-        return NULL;
-    }
+    size = mem_heap_size - mem_free_lists.free_size + mem_large_size;
 
-    size = mem_convert_to_block_size(size);
+    if (size > mem_peak_size) {
+        mem_peak_size = size;
+    }
+}
 
-    mutex_lock(&mem_mutex);
+/*
+ * Allocate a block from the heap.
+ *
+ * The heap mutex must be locked.
+ */
+static struct mem_block *
+mem_heap_alloc(size_t size)
+{
+    struct mem_block *block, *block2;
 
-    block = mem_free_list_find(&mem_free_list, size);
+    block = mem_free_lists_find(&mem_free_lists, size);
 
     if (block == NULL) {
-        mutex_unlock(&mem_mutex);
         return NULL;
     }
 
-    mem_free_list_remove(&mem_free_list, block);
+    mem_free_lists_remove(&mem_free_lists, block);
     block2 = mem_block_split(block, size);
 
     if (block2 != NULL) {
-        mem_free_list_add(&mem_free_list, block2);
+        mem_free_lists_add(&mem_free_lists, block2);
     }
 
-    mutex_unlock(&mem_mutex);
-
-    ptr = mem_block_payload(block);
-    assert(mem_aligned((uintptr_t)ptr));
-    return ptr;
+    return block;
 }
 
-void
-mem_free(void *ptr)
+/*
+ * Release a block to the heap.
+ *
+ * The heap mutex must be locked.
+ */
+static void
+mem_heap_free(struct mem_block *block)
 {
-    struct mem_block *block, *tmp;
+    struct mem_block *tmp;
 
-    if (!ptr) {
-        return;
-    }
-
-    assert(mem_aligned((uintptr_t)ptr));
-
-    block = mem_block_from_payload(ptr);
-    assert(mem_block_inside_heap(block));
-
-    mutex_lock(&mem_mutex);
-
-    mem_free_list_add(&mem_free_list, block);
+    mem_free_lists_add(&mem_free_lists, block);
 
     tmp = mem_block_prev(block);
 
@@ -687,6 +985,1025 @@ mem_free(void *ptr)
     if (tmp) {
         mem_block_merge(block, tmp);
     }
+}
+
+/*
+ * Shrink an allocated block to the given block size, and return the
+ * remaining space to the heap, if large enough to form a block.
+ *
+ * The heap mutex must be locked.
+ */
+static void
+mem_heap_shrink(struct mem_block *block, size_t size)
+{
+    struct mem_block *block2;
+
+    block2 = mem_block_split(block, size);
+
+    if (block2) {
+        mem_heap_free(block2);
+    }
+}
+
+/*
+ * Grow an allocated block in place to the given block size, by absorbing
+ * the next block, if free and large enough.
+ *
+ * Return true if the block was grown.
+ *
+ * The heap mutex must be locked.
+ */
+static bool
+mem_heap_grow(struct mem_block *block, size_t size)
+{
+    struct mem_block *next;
+    size_t total_size;
+
+    next = mem_block_next(block);
+
+    if (!next || mem_block_allocated(next)) {
+        return false;
+    }
+
+    total_size = mem_block_size(block) + mem_block_size(next);
+
+    if (total_size < size) {
+        return false;
+    }
+
+    mem_free_lists_remove(&mem_free_lists, next);
+    mem_block_init(block, total_size);
+    mem_heap_shrink(block, size);
+    return true;
+}
+
+/*
+ * Allocate a block from the heap, such that the address at the given
+ * offset in its payload is aligned.
+ *
+ * A block large enough to contain a suitably aligned block, whatever its
+ * address, is allocated first, and then trimmed, the unused space before
+ * and after the aligned block being returned to the heap. The space before
+ * the aligned block must be large enough to form a block itself, which may
+ * push the aligned block further by a few alignment units.
+ *
+ * The heap mutex must be locked.
+ */
+static struct mem_block *
+mem_heap_alloc_aligned(size_t size, size_t align, size_t offset)
+{
+    struct mem_block *block, *block2;
+    uintptr_t payload, addr;
+
+    assert(ISP2(align));
+    assert(mem_aligned(offset));
+
+    if (align <= MEM_ALIGN) {
+        return mem_heap_alloc(size);
+    }
+
+    if (size > (SIZE_MAX - align - MEM_BLOCK_MIN_SIZE)) {
+        return NULL;
+    }
+
+    block = mem_heap_alloc(size + align + MEM_BLOCK_MIN_SIZE);
+
+    if (!block) {
+        return NULL;
+    }
+
+    payload = (uintptr_t)mem_block_payload(block);
+    addr = P2ROUND(payload + offset, align) - offset;
+
+    while ((addr != payload) && ((addr - payload) < MEM_BLOCK_MIN_SIZE)) {
+        addr += align;
+    }
+
+    if (addr != payload) {
+        block2 = mem_block_split(block, addr - payload);
+        assert(block2);
+        mem_heap_free(block);
+        block = block2;
+    }
+
+    mem_heap_shrink(block, size);
+    return block;
+}
+
+/*
+ * Allocate up to max_blocks blocks from the heap, and store their payload
+ * in the given array.
+ *
+ * Return the number of blocks allocated.
+ */
+static unsigned int
+mem_heap_alloc_batch(size_t size, void **ptrs, unsigned int max_blocks)
+{
+    struct mem_block *block;
+    unsigned int nr_blocks;
+
+    mutex_lock(&mem_mutex);
+
+    for (nr_blocks = 0; nr_blocks < max_blocks; nr_blocks++) {
+        block = mem_heap_alloc(size);
+
+        if (!block) {
+            break;
+        }
+
+        ptrs[nr_blocks] = mem_block_payload(block);
+    }
+
+    mem_update_peak();
+    mutex_unlock(&mem_mutex);
+
+    return nr_blocks;
+}
+
+static void
+mem_heap_free_batch(void **ptrs, unsigned int nr_blocks)
+{
+    if (nr_blocks == 0) {
+        return;
+    }
+
+    mutex_lock(&mem_mutex);
+
+    for (unsigned int i = 0; i < nr_blocks; i++) {
+        mem_heap_free(mem_block_from_payload(ptrs[i]));
+    }
 
     mutex_unlock(&mem_mutex);
 }
+
+static struct mem_magazine *
+mem_magazine_lookup(const uint8_t *map, size_t size)
+{
+    uint8_t index;
+
+    if (size > MEM_MAGAZINE_MAX_SIZE) {
+        return NULL;
+    }
+
+    index = map[size / MEM_ALIGN];
+    return (index == MEM_MAGAZINE_NONE) ? NULL : &mem_magazines[index];
+}
+
+static void *
+mem_magazine_alloc(struct mem_magazine *magazine)
+{
+    void *rounds[MEM_MAGAZINE_BATCH];
+    unsigned int i, nr_rounds;
+    void *ptr;
+
+    thread_preempt_disable();
+
+    if (magazine->nr_rounds != 0) {
+        magazine->nr_rounds--;
+        ptr = magazine->rounds[magazine->nr_rounds];
+        thread_preempt_enable();
+        return ptr;
+    }
+
+    thread_preempt_enable();
+
+    /*
+     * The magazine is empty, refill it. Since preemption is enabled while
+     * the heap is locked, other threads may refill it in the meantime, in
+     * which case extra blocks are returned to the heap.
+     */
+    nr_rounds = mem_heap_alloc_batch(magazine->size, rounds,
+                                     ARRAY_SIZE(rounds));
+
+    if (nr_rounds == 0) {
+        return NULL;
+    }
+
+    thread_preempt_disable();
+
+    for (i = 1; i < nr_rounds; i++) {
+        if (magazine->nr_rounds == ARRAY_SIZE(magazine->rounds)) {
+            break;
+        }
+
+        magazine->rounds[magazine->nr_rounds] = rounds[i];
+        magazine->nr_rounds++;
+    }
+
+    thread_preempt_enable();
+
+    mem_heap_free_batch(&rounds[i], nr_rounds - i);
+
+    return rounds[0];
+}
+
+static void
+mem_magazine_free(struct mem_magazine *magazine, void *ptr)
+{
+    void *rounds[MEM_MAGAZINE_BATCH];
+
+    thread_preempt_disable();
+
+    if (magazine->nr_rounds != ARRAY_SIZE(magazine->rounds)) {
+        magazine->rounds[magazine->nr_rounds] = ptr;
+        magazine->nr_rounds++;
+        thread_preempt_enable();
+        return;
+    }
+
+    /*
+     * The magazine is full, flush a batch of blocks to the heap, making
+     * room for the new one.
+     */
+    magazine->nr_rounds -= ARRAY_SIZE(rounds);
+    memcpy(rounds, &magazine->rounds[magazine->nr_rounds], sizeof(rounds));
+    magazine->rounds[magazine->nr_rounds] = ptr;
+    magazine->nr_rounds++;
+
+    thread_preempt_enable();
+
+    mem_heap_free_batch(rounds, ARRAY_SIZE(rounds));
+}
+
+/*
+ * Return all blocks cached in magazines to the heap.
+ */
+static void
+mem_magazines_drain(void)
+{
+    void *rounds[MEM_MAGAZINE_SIZE];
+    struct mem_magazine *magazine;
+    unsigned int nr_rounds;
+
+    for (size_t i = 0; i < ARRAY_SIZE(mem_magazines); i++) {
+        magazine = &mem_magazines[i];
+
+        thread_preempt_disable();
+        nr_rounds = magazine->nr_rounds;
+        memcpy(rounds, magazine->rounds, nr_rounds * sizeof(rounds[0]));
+        magazine->nr_rounds = 0;
+        thread_preempt_enable();
+
+        mem_heap_free_batch(rounds, nr_rounds);
+    }
+}
+
+/*
+ * Allocate a block from the heap, such that the address at the given
+ * offset in its payload is aligned.
+ *
+ * The heap mutex must not be locked.
+ */
+static struct mem_block *
+mem_alloc_block(size_t size, size_t align, size_t offset)
+{
+    struct mem_block *block;
+
+    mutex_lock(&mem_mutex);
+    block = mem_heap_alloc_aligned(size, align, offset);
+    mem_update_peak();
+    mutex_unlock(&mem_mutex);
+
+    if (block == NULL) {
+        /*
+         * Blocks cached in magazines may be what prevents this allocation
+         * from succeeding, either directly, or because they prevent
+         * coalescing. Return them to the heap and try again.
+         */
+        mem_magazines_drain();
+
+        mutex_lock(&mem_mutex);
+        block = mem_heap_alloc_aligned(size, align, offset);
+        mem_update_peak();
+        mutex_unlock(&mem_mutex);
+    }
+
+    return block;
+}
+
+/*
+ * Trim magazines, one batch at a time.
+ *
+ * Blocks cached in magazines can't be coalesced with their neighbors.
+ * When the processor is idle, magazines are trimmed down to a single
+ * batch, which is enough to absorb the start of the next burst of
+ * allocations, and the rest is returned to the heap. This is done with
+ * mutex_trylock(), since the idle thread must not sleep, and with
+ * preemption disabled before the heap mutex is acquired, so that the idle
+ * thread can't be preempted while holding it.
+ */
+static bool
+mem_trim_work_run(void *arg)
+{
+    void *rounds[MEM_MAGAZINE_BATCH];
+    struct mem_magazine *magazine;
+    unsigned int nr_rounds;
+
+    (void)arg;
+
+    for (size_t i = 0; i < ARRAY_SIZE(mem_magazines); i++) {
+        magazine = &mem_magazines[i];
+
+        thread_preempt_disable();
+        nr_rounds = magazine->nr_rounds;
+        thread_preempt_enable();
+
+        if (nr_rounds <= MEM_MAGAZINE_BATCH) {
+            continue;
+        }
+
+        thread_preempt_disable();
+
+        if (mutex_trylock(&mem_mutex) != 0) {
+            thread_preempt_enable();
+            return false;
+        }
+
+        nr_rounds = MIN(magazine->nr_rounds - MEM_MAGAZINE_BATCH,
+                        ARRAY_SIZE(rounds));
+        magazine->nr_rounds -= nr_rounds;
+        memcpy(rounds, &magazine->rounds[magazine->nr_rounds],
+               nr_rounds * sizeof(rounds[0]));
+
+        for (unsigned int j = 0; j < nr_rounds; j++) {
+            mem_heap_free(mem_block_from_payload(rounds[j]));
+        }
+
+        mutex_unlock(&mem_mutex);
+        thread_preempt_enable();
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * Allocate a block of pages for a large allocation.
+ *
+ * The heap mutex is only used to account for the block.
+ */
+static void *
+mem_large_alloc(size_t size, bool zeroed)
+{
+    unsigned int order;
+    void *ptr;
+
+    order = page_order(size);
+    ptr = zeroed ? page_alloc_zeroed(order) : page_alloc(order);
+
+    if (ptr) {
+        mutex_lock(&mem_mutex);
+        mem_large_size += (size_t)PAGE_SIZE << order;
+        mem_update_peak();
+        mutex_unlock(&mem_mutex);
+    }
+
+    return ptr;
+}
+
+static void
+mem_large_free(void *ptr)
+{
+    size_t size;
+
+    size = (size_t)PAGE_SIZE << page_get_order(ptr);
+    page_free(ptr);
+
+    mutex_lock(&mem_mutex);
+    mem_large_size -= size;
+    mutex_unlock(&mem_mutex);
+}
+
+static void *
+mem_alloc_raw(size_t size)
+{
+    struct mem_magazine *magazine;
+    struct mem_block *block;
+    void *ptr;
+
+    if (size >= MEM_LARGE_SIZE) {
+        ptr = mem_large_alloc(size, false);
+
+        if (ptr) {
+            return ptr;
+        }
+    }
+
+    size = mem_convert_to_block_size(size);
+    magazine = mem_magazine_lookup(mem_magazine_alloc_map, size);
+
+    if (magazine) {
+        ptr = mem_magazine_alloc(magazine);
+
+        if (ptr) {
+            return ptr;
+        }
+    }
+
+    block = mem_alloc_block(size, MEM_ALIGN, 0);
+
+    if (block == NULL) {
+        return NULL;
+    }
+
+    ptr = mem_block_payload(block);
+    assert(mem_aligned((uintptr_t)ptr));
+    return ptr;
+}
+
+static void *
+mem_alloc_aligned_raw(size_t size, size_t align, size_t offset)
+{
+    struct mem_block *block;
+    void *ptr;
+
+    /* Blocks of pages are aligned on a page boundary */
+    if ((size >= MEM_LARGE_SIZE) && (align <= PAGE_SIZE) && (offset == 0)) {
+        ptr = mem_large_alloc(size, false);
+
+        if (ptr) {
+            return ptr;
+        }
+    }
+
+    block = mem_alloc_block(mem_convert_to_block_size(size), align, offset);
+
+    if (block == NULL) {
+        return NULL;
+    }
+
+    ptr = mem_block_payload(block);
+    assert(P2ALIGNED((uintptr_t)ptr + offset, align));
+    return ptr;
+}
+
+static void
+mem_free_raw(void *ptr)
+{
+    struct mem_magazine *magazine;
+    struct mem_block *block;
+
+    if (!mem_heap_inside(ptr)) {
+        mem_large_free(ptr);
+        return;
+    }
+
+    assert(mem_aligned((uintptr_t)ptr));
+
+    block = mem_block_from_payload(ptr);
+    assert(mem_block_inside_heap(block));
+    assert(mem_block_allocated(block));
+
+    magazine = mem_magazine_lookup(mem_magazine_free_map,
+                                   mem_block_size(block));
+
+    if (magazine) {
+        mem_magazine_free(magazine, ptr);
+        return;
+    }
+
+    mutex_lock(&mem_mutex);
+    mem_heap_free(block);
+    mutex_unlock(&mem_mutex);
+}
+
+/*
+ * Resize a block in place if possible, or move it otherwise.
+ *
+ * Heap blocks are shrunk by splitting them, and grown by absorbing the next
+ * block when it's free, which is common when a buffer is grown repeatedly
+ * without other allocations in between. Blocks of pages are kept as long
+ * as the new size requires the same order.
+ */
+static void *
+mem_realloc_raw(void *ptr, size_t size)
+{
+    struct mem_block *block;
+    size_t old_size, block_size;
+    unsigned int order;
+    void *new_ptr;
+    bool resized;
+
+    if (!mem_heap_inside(ptr)) {
+        order = page_get_order(ptr);
+
+        if ((size >= MEM_LARGE_SIZE) && (page_order(size) == order)) {
+            return ptr;
+        }
+
+        old_size = (size_t)PAGE_SIZE << order;
+    } else {
+        block = mem_block_from_payload(ptr);
+        assert(mem_block_inside_heap(block));
+        assert(mem_block_allocated(block));
+
+        old_size = mem_block_payload_size(block);
+
+        if (size < MEM_LARGE_SIZE) {
+            block_size = mem_convert_to_block_size(size);
+
+            if ((block_size <= mem_block_size(block))
+                && ((mem_block_size(block) - block_size)
+                    < MEM_BLOCK_MIN_SIZE)) {
+                return ptr;
+            }
+
+            mutex_lock(&mem_mutex);
+
+            if (block_size <= mem_block_size(block)) {
+                mem_heap_shrink(block, block_size);
+                resized = true;
+            } else {
+                resized = mem_heap_grow(block, block_size);
+            }
+
+            mem_update_peak();
+            mutex_unlock(&mem_mutex);
+
+            if (resized) {
+                return ptr;
+            }
+        }
+    }
+
+    new_ptr = mem_alloc_raw(size);
+
+    if (!new_ptr) {
+        return NULL;
+    }
+
+    memcpy(new_ptr, ptr, MIN(old_size, size));
+    mem_free_raw(ptr);
+    return new_ptr;
+}
+
+#ifdef MEMSTAT
+
+/*
+ * Number of entries in the call site table.
+ */
+#define MEM_STATS_NR_SITES      256
+
+#if !ISP2(MEM_STATS_NR_SITES)
+#error "number of call sites must be a power-of-two"
+#endif
+
+/*
+ * Number of buckets in size histograms.
+ *
+ * Bucket i counts allocations of sizes in the range [2^i, 2^(i + 1)),
+ * except for the last bucket, which counts all larger sizes too.
+ */
+#define MEM_STATS_NR_BUCKETS    16
+
+/*
+ * Allocation statistics of a call site.
+ */
+struct mem_site {
+    const void *addr;
+    unsigned long nr_allocs;
+    unsigned long nr_frees;
+    size_t live_bytes;
+    size_t max_live_bytes;
+    unsigned long sizes[MEM_STATS_NR_BUCKETS];
+};
+
+/*
+ * Header preceding allocated memory, recording where it was allocated,
+ * and how much was requested.
+ */
+struct mem_stats_hdr {
+    struct mem_site *site;
+    size_t size;
+};
+
+#define MEM_STATS_HDR_SIZE sizeof(struct mem_stats_hdr)
+
+/*
+ * Call site table.
+ *
+ * Call sites are looked up with open addressing, and never removed.
+ * Allocations from new call sites once the table is full are accounted
+ * in the overflow entry, which has a null address. The table is only
+ * accessed with preemption disabled, which is enough on a single
+ * processor, and much cheaper than locking.
+ */
+static struct mem_site mem_sites[MEM_STATS_NR_SITES];
+static struct mem_site mem_site_overflow;
+
+static struct mem_site *
+mem_stats_lookup(const void *addr)
+{
+    struct mem_site *site;
+    uint32_t index;
+
+    /* Multiplicative hashing, see Knuth, Volume 3, 6.4 */
+    index = ((uint32_t)(uintptr_t)addr * 2654435761U) / (UINT32_MAX
+            / MEM_STATS_NR_SITES + 1);
+
+    for (size_t i = 0; i < ARRAY_SIZE(mem_sites); i++) {
+        site = &mem_sites[(index + i) & (ARRAY_SIZE(mem_sites) - 1)];
+
+        if (site->addr == addr) {
+            return site;
+        } else if (!site->addr) {
+            site->addr = addr;
+            return site;
+        }
+    }
+
+    return &mem_site_overflow;
+}
+
+static void *
+mem_stats_record_alloc(void *ptr, const void *addr, size_t size)
+{
+    struct mem_stats_hdr *hdr;
+    struct mem_site *site;
+    unsigned int bucket;
+
+    bucket = MIN(mem_fls(size), MEM_STATS_NR_BUCKETS - 1);
+
+    thread_preempt_disable();
+    site = mem_stats_lookup(addr);
+    site->nr_allocs++;
+    site->live_bytes += size;
+
+    if (site->live_bytes > site->max_live_bytes) {
+        site->max_live_bytes = site->live_bytes;
+    }
+
+    site->sizes[bucket]++;
+    thread_preempt_enable();
+
+    hdr = ptr;
+    hdr->site = site;
+    hdr->size = size;
+    return hdr + 1;
+}
+
+static void *
+mem_stats_record_free(void *ptr)
+{
+    struct mem_stats_hdr *hdr;
+
+    hdr = (struct mem_stats_hdr *)ptr - 1;
+
+    thread_preempt_disable();
+    assert(hdr->site->live_bytes >= hdr->size);
+    hdr->site->nr_frees++;
+    hdr->site->live_bytes -= hdr->size;
+    thread_preempt_enable();
+
+    return hdr;
+}
+
+static void *
+mem_stats_raw(void *ptr)
+{
+    return (struct mem_stats_hdr *)ptr - 1;
+}
+
+/*
+ * Account for a resized allocation.
+ *
+ * Resizing doesn't count as an allocation, and the memory remains charged
+ * to the call site that originally allocated it.
+ */
+static void *
+mem_stats_record_realloc(void *ptr, size_t size)
+{
+    struct mem_stats_hdr *hdr;
+    struct mem_site *site;
+
+    hdr = ptr;
+    site = hdr->site;
+
+    thread_preempt_disable();
+    assert(site->live_bytes >= hdr->size);
+    site->live_bytes = site->live_bytes - hdr->size + size;
+
+    if (site->live_bytes > site->max_live_bytes) {
+        site->max_live_bytes = site->live_bytes;
+    }
+
+    thread_preempt_enable();
+
+    hdr->size = size;
+    return hdr + 1;
+}
+
+static void
+mem_stats_print_site(const struct mem_site *site)
+{
+    struct mem_site snapshot;
+
+    thread_preempt_disable();
+    snapshot = *site;
+    thread_preempt_enable();
+
+    printf("mem_stats: %10p %10lu %10lu %10zu %10zu\n",
+           snapshot.addr, snapshot.nr_allocs, snapshot.nr_frees,
+           snapshot.live_bytes, snapshot.max_live_bytes);
+    printf("mem_stats:   sizes:");
+
+    for (unsigned int i = 0; i < ARRAY_SIZE(snapshot.sizes); i++) {
+        if (snapshot.sizes[i] != 0) {
+            printf(" %lu%s:%lu", 1UL << i,
+                   (i == (ARRAY_SIZE(snapshot.sizes) - 1)) ? "+" : "",
+                   snapshot.sizes[i]);
+        }
+    }
+
+    printf("\n");
+}
+
+/*
+ * Print call sites by decreasing live bytes.
+ *
+ * Sites are sorted from values read without disabling preemption, which
+ * is harmless since the result is only meant to be approximate anyway.
+ */
+static void
+mem_stats_print_sites(void)
+{
+    uint16_t indexes[MEM_STATS_NR_SITES];
+    size_t nr_sites, j;
+    uint16_t index;
+
+    nr_sites = 0;
+
+    for (size_t i = 0; i < ARRAY_SIZE(mem_sites); i++) {
+        if (!mem_sites[i].addr) {
+            continue;
+        }
+
+        index = i;
+
+        for (j = nr_sites; j > 0; j--) {
+            if (mem_sites[indexes[j - 1]].live_bytes
+                >= mem_sites[index].live_bytes) {
+                break;
+            }
+
+            indexes[j] = indexes[j - 1];
+        }
+
+        indexes[j] = index;
+        nr_sites++;
+    }
+
+    printf("mem_stats: %10s %10s %10s %10s %10s\n",
+           "site", "allocs", "frees", "live", "max_live");
+
+    for (size_t i = 0; i < nr_sites; i++) {
+        mem_stats_print_site(&mem_sites[indexes[i]]);
+    }
+
+    if (mem_site_overflow.nr_allocs != 0) {
+        mem_stats_print_site(&mem_site_overflow);
+    }
+}
+
+#else /* MEMSTAT */
+
+/*
+ * Statistics are disabled, turn the probes into no-ops.
+ */
+#define MEM_STATS_HDR_SIZE 0
+#define mem_stats_record_alloc(ptr, addr, size) ((void)(addr), (ptr))
+#define mem_stats_record_free(ptr) (ptr)
+#define mem_stats_raw(ptr) (ptr)
+#define mem_stats_record_realloc(ptr, size) (ptr)
+#define mem_stats_print_sites()
+
+#endif /* MEMSTAT */
+
+/*
+ * Allocate memory on behalf of the given call site.
+ */
+static void *
+mem_alloc_site(size_t size, size_t align, const void *site)
+{
+    void *ptr;
+
+    if ((size == 0) || (size > (SIZE_MAX - MEM_STATS_HDR_SIZE))) {
+        return NULL;
+    }
+
+    size += MEM_STATS_HDR_SIZE;
+
+    if (align <= MEM_ALIGN) {
+        ptr = mem_alloc_raw(size);
+    } else {
+        ptr = mem_alloc_aligned_raw(size, align, MEM_STATS_HDR_SIZE);
+    }
+
+    if (!ptr) {
+        return NULL;
+    }
+
+    return mem_stats_record_alloc(ptr, site, size - MEM_STATS_HDR_SIZE);
+}
+
+void *
+mem_alloc(size_t size)
+{
+    return mem_alloc_site(size, MEM_ALIGN, __builtin_return_address(0));
+}
+
+void *
+mem_alloc_aligned(size_t size, size_t align)
+{
+    if ((align == 0) || !ISP2(align)) {
+        return NULL;
+    }
+
+    return mem_alloc_site(size, align, __builtin_return_address(0));
+}
+
+void *
+mem_calloc(size_t nr_elems, size_t size)
+{
+    const void *site;
+    void *ptr;
+
+    if ((size != 0) && (nr_elems > (SIZE_MAX / size))) {
+        return NULL;
+    }
+
+    size *= nr_elems;
+    site = __builtin_return_address(0);
+
+    /* Large blocks may have been zeroed in advance */
+    if ((size >= MEM_LARGE_SIZE) && (size <= (SIZE_MAX - MEM_STATS_HDR_SIZE))) {
+        ptr = mem_large_alloc(size + MEM_STATS_HDR_SIZE, true);
+
+        if (ptr) {
+            return mem_stats_record_alloc(ptr, site, size);
+        }
+    }
+
+    ptr = mem_alloc_site(size, MEM_ALIGN, site);
+
+    if (ptr) {
+        memset(ptr, 0, size);
+    }
+
+    return ptr;
+}
+
+void *
+mem_realloc(void *ptr, size_t size)
+{
+    if (!ptr) {
+        return mem_alloc_site(size, MEM_ALIGN, __builtin_return_address(0));
+    } else if (size == 0) {
+        mem_free(ptr);
+        return NULL;
+    } else if (size > (SIZE_MAX - MEM_STATS_HDR_SIZE)) {
+        return NULL;
+    }
+
+    ptr = mem_realloc_raw(mem_stats_raw(ptr), size + MEM_STATS_HDR_SIZE);
+
+    if (!ptr) {
+        return NULL;
+    }
+
+    return mem_stats_record_realloc(ptr, size);
+}
+
+void
+mem_free(void *ptr)
+{
+    if (!ptr) {
+        return;
+    }
+
+    mem_free_raw(mem_stats_record_free(ptr));
+}
+
+void
+mem_get_info(struct mem_info *info)
+{
+    struct mem_block *block;
+    size_t size;
+
+    info->heap_size = mem_heap_size;
+    info->nr_allocated_blocks = 0;
+    info->allocated_size = 0;
+    info->nr_cached_blocks = 0;
+    info->cached_size = 0;
+    info->nr_free_blocks = 0;
+    info->free_size = 0;
+    info->largest_free_size = 0;
+
+    mutex_lock(&mem_mutex);
+
+    for (block = (struct mem_block *)mem_heap;
+         (void *)block < mem_heap_end();
+         block = (struct mem_block *)mem_block_end(block)) {
+        size = mem_block_size(block);
+
+        if (mem_block_allocated(block)) {
+            info->nr_allocated_blocks++;
+            info->allocated_size += size;
+        } else {
+            info->nr_free_blocks++;
+            info->free_size += size;
+
+            if (size > info->largest_free_size) {
+                info->largest_free_size = size;
+            }
+        }
+    }
+
+    info->large_size = mem_large_size;
+    info->peak_size = mem_peak_size;
+
+    mutex_unlock(&mem_mutex);
+
+    thread_preempt_disable();
+
+    for (size_t i = 0; i < ARRAY_SIZE(mem_magazines); i++) {
+        for (unsigned int j = 0; j < mem_magazines[i].nr_rounds; j++) {
+            block = mem_block_from_payload(mem_magazines[i].rounds[j]);
+            info->nr_cached_blocks++;
+            info->cached_size += mem_block_size(block);
+        }
+    }
+
+    thread_preempt_enable();
+
+    info->nr_allocated_blocks -= info->nr_cached_blocks;
+    info->allocated_size -= info->cached_size;
+}
+
+unsigned int
+mem_info_fragmentation(const struct mem_info *info)
+{
+    if (info->free_size == 0) {
+        return 0;
+    }
+
+    return 100 - (unsigned int)(((uint64_t)info->largest_free_size * 100)
+                                / info->free_size);
+}
+
+void
+mem_reset_peak(void)
+{
+    mutex_lock(&mem_mutex);
+    mem_peak_size = 0;
+    mem_update_peak();
+    mutex_unlock(&mem_mutex);
+}
+
+static void
+mem_shell_stats(int argc, char **argv)
+{
+    struct mem_info info;
+
+    (void)argc;
+    (void)argv;
+
+    mem_get_info(&info);
+
+    printf("mem_stats: heap: %zu bytes at %p\n", info.heap_size, mem_heap);
+    printf("mem_stats: allocated: %lu blocks, %zu bytes\n",
+           info.nr_allocated_blocks, info.allocated_size);
+    printf("mem_stats: cached: %lu blocks, %zu bytes\n",
+           info.nr_cached_blocks, info.cached_size);
+    printf("mem_stats: free: %lu blocks, %zu bytes, largest: %zu bytes\n",
+           info.nr_free_blocks, info.free_size, info.largest_free_size);
+    printf("mem_stats: external fragmentation: %u%%\n",
+           mem_info_fragmentation(&info));
+    printf("mem_stats: large: %zu bytes, peak usage: %zu bytes\n",
+           info.large_size, info.peak_size);
+
+    mem_stats_print_sites();
+}
+
+static struct shell_cmd mem_shell_cmds[] = {
+    SHELL_CMD_INITIALIZER("mem_stats", mem_shell_stats,
+        "mem_stats",
+        "display heap usage, fragmentation, and call site statistics"),
+};
+
+void
+mem_setup(void)
+{
+    int error;
+
+    for (size_t i = 0; i < ARRAY_SIZE(mem_shell_cmds); i++) {
+        error = shell_cmd_register(&mem_shell_cmds[i]);
+
+        if (error) {
+            panic("mem: unable to register shell command");
+        }
+    }
+
+    idle_work_init(&mem_trim_work, mem_trim_work_run, NULL);
+    idle_work_register(&mem_trim_work);
+}
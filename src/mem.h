@@ -25,6 +25,19 @@
  *
  * Here, the word "dynamic" is used in opposition to "static", which denotes
  * memory allocated at compile time by the linker.
+ *
+ *
+ * Memory statistics
+ * -----------------
+ * The mem_stats shell command walks the heap and reports the number of
+ * allocated and free blocks, the largest free block, the resulting
+ * external fragmentation, and the peak memory usage. When built with the
+ * MEMSTAT macro defined, e.g. with
+ * $ make CPPFLAGS=-DMEMSTAT
+ * allocations are also accounted per call site, i.e. per return address
+ * of mem_alloc(), with allocation and free counts, live bytes and a size
+ * histogram, at the cost of a small header per allocation. Call sites can
+ * be resolved to functions with addr2line(1) on the kernel image.
  */
 
 #ifndef _MEM_H
@@ -32,8 +45,42 @@
 
 #include <stddef.h>
 
+/*
+ * Memory usage, as reported by mem_get_info().
+ *
+ * Sizes are in bytes, and include block overhead. Blocks cached in
+ * magazines are only counted as cached. The large size is the total size
+ * of the blocks of pages serving large allocations, which aren't part of
+ * the heap. The peak size is the largest amount of memory allocated at
+ * once, cached blocks and large allocations included, since the last call
+ * to mem_reset_peak().
+ */
+struct mem_info {
+    size_t heap_size;
+    unsigned long nr_allocated_blocks;
+    size_t allocated_size;
+    unsigned long nr_cached_blocks;
+    size_t cached_size;
+    unsigned long nr_free_blocks;
+    size_t free_size;
+    size_t largest_free_size;
+    size_t large_size;
+    size_t peak_size;
+};
+
 /*
  * Initialize the mem module.
+ *
+ * This function must be called before any allocation.
+ */
+void mem_bootstrap(void);
+
+/*
+ * Set up the mem module.
+ *
+ * This function registers the mem_stats shell command, and must be
+ * called after the shell module is initialized. It also registers idle
+ * work that trims allocation magazines.
  */
 void mem_setup(void);
 
@@ -79,14 +126,78 @@ void mem_setup(void);
  */
 void * mem_alloc(size_t size);
 
+/*
+ * Allocate aligned memory.
+ *
+ * This function is similar to mem_alloc(), except that the returned
+ * address is aligned to the given alignment, which must be a power-of-two.
+ * Memory is carved out of a larger free block, the unused parts of which
+ * are returned to the heap, so that only a fraction of the alignment is
+ * lost. Large allocations aligned to at most a page come directly from
+ * the page allocator.
+ *
+ * Return NULL if the alignment is invalid or if memory is exhausted.
+ */
+void * mem_alloc_aligned(size_t size, size_t align);
+
+/*
+ * Allocate zeroed memory.
+ *
+ * This function conforms to the specification of the standard calloc()
+ * function, i.e. it allocates memory for an array of nr_elems elements
+ * of the given size, and fills it with zeroes. It returns NULL if the
+ * total size overflows.
+ */
+void * mem_calloc(size_t nr_elems, size_t size);
+
+/*
+ * Resize memory.
+ *
+ * This function conforms to the specification of the standard realloc()
+ * function, i.e. :
+ *  - If ptr is NULL, it behaves like mem_alloc().
+ *  - If size is 0, it behaves like mem_free(), and returns NULL.
+ *  - Otherwise, the content of the block is preserved up to the smallest
+ *    of the old and new sizes, and the returned value is the address of
+ *    the resized block, which may have moved. On failure, NULL is returned
+ *    and the original block is left untouched.
+ *
+ * Blocks are resized in place whenever possible, in particular when grown
+ * and followed by a free block large enough. The alignment of blocks
+ * allocated with mem_alloc_aligned() isn't preserved if they move.
+ */
+void * mem_realloc(void *ptr, size_t size);
+
 /*
  * Free memory.
  *
  * This function conforms to the specification of the standard free()
  * function, i.e. :
  *  - It may safely be called with a NULL argument.
- *  - Otherwise, it may only be passed memory addresses returned by mem_alloc().
+ *  - Otherwise, it may only be passed memory addresses returned by mem_alloc()
+ *    or the other allocation functions of this module.
  */
 void mem_free(void *ptr);
 
+/*
+ * Walk the heap and report memory usage.
+ *
+ * The heap is locked during the walk, the cost of which is linear in the
+ * number of blocks.
+ */
+void mem_get_info(struct mem_info *info);
+
+/*
+ * Return the external fragmentation of the heap, in percent.
+ *
+ * External fragmentation is the proportion of free memory which can't be
+ * allocated in a single block, i.e. 1 - (largest free block / free memory).
+ */
+unsigned int mem_info_fragmentation(const struct mem_info *info);
+
+/*
+ * Restart peak memory usage tracking from the current usage.
+ */
+void mem_reset_peak(void);
+
 #endif /* _MEM_H */
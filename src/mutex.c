@@ -24,93 +24,263 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 
 #include <lib/list.h>
 #include <lib/macros.h>
+#include <lib/shell.h>
 
+#include "cpu.h"
 #include "error.h"
 #include "mutex.h"
+#include "panic.h"
+#include "parking.h"
 #include "thread.h"
 
 /*
- * Structure used to bind a waiting thread and a mutex.
+ * Mutex states.
  *
- * The purpose of this structure is to avoid adding the node to the thread
- * structure. Instead, it's allocated from the stack and only exists while
- * the thread is waiting for the mutex to be unlocked.
- *
- * When the owner unlocks the mutex, it finds threads to wake up by
- * accessing the mutex list of waiters.
+ * The contended state means that threads may be parked on the mutex.
+ * It's how an unlocking thread knows whether it needs to look up the
+ * parking lot or not.
+ */
+#define MUTEX_UNLOCKED  0
+#define MUTEX_LOCKED    1
+#define MUTEX_CONTENDED 2
+
+#ifdef LOCKSTAT
+
+/*
+ * Registry of named mutexes.
  *
- * Preemption must be disabled when accessing a waiter.
+ * The list is only modified with preemption disabled, which allows naming
+ * mutexes very early, before the scheduler is running. The registry mutex
+ * serializes the lockstat command, which sorts the list in multiple steps.
+ * It's deliberately left unnamed so that it never appears in the registry.
  */
-struct mutex_waiter {
-    struct list node;
-    struct thread *thread;
-};
+static struct list mutex_stats_list = LIST_INITIALIZER(mutex_stats_list);
+static struct mutex mutex_stats_mutex;
 
 static void
-mutex_waiter_init(struct mutex_waiter *waiter, struct thread *thread)
+mutex_stats_init(struct mutex_stats *stats)
+{
+    stats->name = NULL;
+    stats->nr_acquisitions = 0;
+    stats->nr_contended = 0;
+    stats->total_wait = 0;
+    stats->max_wait = 0;
+    stats->total_hold = 0;
+    stats->max_hold = 0;
+}
+
+static uint64_t
+mutex_stats_now(void)
 {
-    waiter->thread = thread;
+    return cpu_get_tsc();
 }
 
+/*
+ * Preemption must be disabled when calling the functions below, so that
+ * recording is atomic with respect to readers.
+ */
+
 static void
-mutex_waiter_wakeup(struct mutex_waiter *waiter)
+mutex_stats_record_acquire(struct mutex_stats *stats,
+                           bool contended, uint64_t start)
 {
-    thread_wakeup(waiter->thread);
+    uint64_t now, wait;
+
+    now = mutex_stats_now();
+    stats->nr_acquisitions++;
+
+    if (contended) {
+        wait = now - start;
+        stats->nr_contended++;
+        stats->total_wait += wait;
+
+        if (wait > stats->max_wait) {
+            stats->max_wait = wait;
+        }
+    }
+
+    stats->acquire_time = now;
 }
 
-void
-mutex_init(struct mutex *mutex)
+static void
+mutex_stats_record_release(struct mutex_stats *stats)
 {
-    list_init(&mutex->waiters);
-    mutex->locked = false;
+    uint64_t hold;
+
+    hold = mutex_stats_now() - stats->acquire_time;
+    stats->total_hold += hold;
+
+    if (hold > stats->max_hold) {
+        stats->max_hold = hold;
+    }
 }
 
+/*
+ * Sort the registry by decreasing total wait time.
+ *
+ * This is a simple insertion sort, which is fine since the registry is
+ * expected to be short, and mostly sorted from one call to the next.
+ *
+ * The registry mutex must be locked.
+ */
 static void
-mutex_set_owner(struct mutex *mutex, struct thread *thread)
+mutex_stats_sort(void)
 {
-    assert(!mutex->owner);
-    assert(!mutex->locked);
+    struct mutex_stats *stats, *tmp, *prev;
+    uint64_t wait;
 
-    mutex->owner = thread;
-    mutex->locked = true;
+    list_for_each_entry_safe(&mutex_stats_list, stats, tmp, node) {
+        thread_preempt_disable();
+        wait = stats->total_wait;
+        prev = stats;
+
+        while (!list_end(&mutex_stats_list, list_prev(&prev->node))) {
+            prev = list_prev_entry(prev, node);
+
+            if (prev->total_wait >= wait) {
+                prev = list_next_entry(prev, node);
+                break;
+            }
+        }
+
+        if (prev != stats) {
+            list_remove(&stats->node);
+            list_insert_before(&prev->node, &stats->node);
+        }
+
+        thread_preempt_enable();
+    }
 }
 
 static void
-mutex_clear_owner(struct mutex *mutex)
+mutex_shell_lockstat(int argc, char **argv)
 {
-    assert(mutex->owner == thread_self());
-    assert(mutex->locked);
+    struct mutex_stats *stats, snapshot;
+
+    (void)argc;
+    (void)argv;
+
+    mutex_lock(&mutex_stats_mutex);
+
+    mutex_stats_sort();
 
-    mutex->owner = NULL;
-    mutex->locked = false;
+    printf("lockstat: %-16s %10s %10s %14s %12s %14s %12s\n",
+           "name", "acquired", "contended",
+           "wait_total", "wait_max", "hold_total", "hold_max");
+
+    list_for_each_entry(&mutex_stats_list, stats, node) {
+        thread_preempt_disable();
+        snapshot = *stats;
+        thread_preempt_enable();
+
+        printf("lockstat: %-16s %10lu %10lu %14llu %12llu %14llu %12llu\n",
+               snapshot.name, snapshot.nr_acquisitions, snapshot.nr_contended,
+               (unsigned long long)snapshot.total_wait,
+               (unsigned long long)snapshot.max_wait,
+               (unsigned long long)snapshot.total_hold,
+               (unsigned long long)snapshot.max_hold);
+    }
+
+    mutex_unlock(&mutex_stats_mutex);
+}
+
+static struct shell_cmd mutex_shell_cmds[] = {
+    SHELL_CMD_INITIALIZER("lockstat", mutex_shell_lockstat,
+        "lockstat",
+        "display mutex statistics, sorted by total wait time"),
+};
+
+#else /* LOCKSTAT */
+
+/*
+ * Statistics are disabled, turn the probes into no-ops.
+ */
+#define mutex_stats_init(stats)
+#define mutex_stats_now() 0
+#define mutex_stats_record_acquire(stats, contended, start)
+#define mutex_stats_record_release(stats)
+
+#endif /* LOCKSTAT */
+
+void
+mutex_setup(void)
+{
+#ifdef LOCKSTAT
+    int error;
+
+    mutex_init(&mutex_stats_mutex);
+
+    for (size_t i = 0; i < ARRAY_SIZE(mutex_shell_cmds); i++) {
+        error = shell_cmd_register(&mutex_shell_cmds[i]);
+
+        if (error) {
+            panic("mutex: unable to register shell command");
+        }
+    }
+#endif /* LOCKSTAT */
+}
+
+void
+mutex_init(struct mutex *mutex)
+{
+    mutex->state = MUTEX_UNLOCKED;
+    mutex_stats_init(&mutex->stats);
+}
+
+void
+mutex_set_name(struct mutex *mutex, const char *name)
+{
+#ifdef LOCKSTAT
+    assert(name);
+    assert(!mutex->stats.name);
+
+    thread_preempt_disable();
+    mutex->stats.name = name;
+    list_insert_tail(&mutex_stats_list, &mutex->stats.node);
+    thread_preempt_enable();
+#else /* LOCKSTAT */
+    (void)mutex;
+    (void)name;
+#endif /* LOCKSTAT */
 }
 
 void
 mutex_lock(struct mutex *mutex)
 {
-    struct thread *thread;
+    uint64_t start __unused;
+    bool contended;
 
-    thread = thread_self();
+    start = 0;
 
     thread_preempt_disable();
 
-    if (mutex->locked) {
-        struct mutex_waiter waiter;
+    contended = (mutex->state != MUTEX_UNLOCKED);
 
-        mutex_waiter_init(&waiter, thread);
-        list_insert_tail(&mutex->waiters, &waiter.node);
+    if (contended) {
+        start = mutex_stats_now();
 
         do {
-            thread_sleep();
-        } while (mutex->locked);
+            mutex->state = MUTEX_CONTENDED;
+            parking_park(mutex);
+        } while (mutex->state != MUTEX_UNLOCKED);
 
-        list_remove(&waiter.node);
+        /*
+         * Other threads may still be parked on the mutex, but knowing
+         * that would require looking up the parking lot. Instead, assume
+         * the mutex is still contended. At worst, the next unlock looks
+         * up the parking lot for nothing.
+         */
+        mutex->state = MUTEX_CONTENDED;
+    } else {
+        mutex->state = MUTEX_LOCKED;
     }
 
-    mutex_set_owner(mutex, thread);
+    mutex_stats_record_acquire(&mutex->stats, contended, start);
 
     thread_preempt_enable();
 }
@@ -122,11 +292,12 @@ mutex_trylock(struct mutex *mutex)
 
     thread_preempt_disable();
 
-    if (mutex->locked) {
+    if (mutex->state != MUTEX_UNLOCKED) {
         error = ERROR_BUSY;
     } else {
         error = 0;
-        mutex_set_owner(mutex, thread_self());
+        mutex->state = MUTEX_LOCKED;
+        mutex_stats_record_acquire(&mutex->stats, false, 0);
     }
 
     thread_preempt_enable();
@@ -137,15 +308,18 @@ mutex_trylock(struct mutex *mutex)
 void
 mutex_unlock(struct mutex *mutex)
 {
-    struct mutex_waiter *waiter;
+    unsigned long state;
 
     thread_preempt_disable();
 
-    mutex_clear_owner(mutex);
+    state = mutex->state;
+    assert(state != MUTEX_UNLOCKED);
+
+    mutex_stats_record_release(&mutex->stats);
+    mutex->state = MUTEX_UNLOCKED;
 
-    if (!list_empty(&mutex->waiters)) {
-        waiter = list_first_entry(&mutex->waiters, struct mutex_waiter, node);
-        mutex_waiter_wakeup(waiter);
+    if (state == MUTEX_CONTENDED) {
+        parking_unpark_one(mutex);
     }
 
     thread_preempt_enable();
@@ -101,7 +101,8 @@
  * synchronization.
  *
  * The implementation of this module is very simple and doesn't prevent
- * unbounded priority inversions.
+ * unbounded priority inversions. Since a mutex is a single word, it
+ * doesn't even record its owner.
  *
  * When deciding whether to use a mutex or to disable preemption for
  * mutual exclusion, keep in mind that all real-world mutex implementations
@@ -112,33 +113,90 @@
  *
  * This mutex interface matches the "fast" kind of POSIX mutexes. In
  * particular, a mutex cannot be locked recursively.
+ *
+ * Lock statistics
+ * ---------------
+ * When built with the LOCKSTAT macro defined, e.g. with
+ * $ make CPPFLAGS=-DLOCKSTAT
+ * each mutex keeps track of the number of times it was acquired, how
+ * many of those acquisitions were contended, and how long threads waited
+ * for and held it. Times are measured in raw TSC cycles. Named mutexes
+ * are added to a global registry, and the lockstat shell command prints
+ * their statistics, sorted by total wait time. When the macro isn't
+ * defined, none of this code is built, and mutexes remain as small and
+ * fast as without statistics.
  */
 
 #ifndef _MUTEX_H
 #define _MUTEX_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include <lib/list.h>
 
 #include "thread.h"
 
+#ifdef LOCKSTAT
+
+/*
+ * Mutex statistics.
+ *
+ * Times are in TSC cycles.
+ */
+struct mutex_stats {
+    struct list node;
+    const char *name;
+    unsigned long nr_acquisitions;
+    unsigned long nr_contended;
+    uint64_t total_wait;
+    uint64_t max_wait;
+    uint64_t total_hold;
+    uint64_t max_hold;
+    uint64_t acquire_time;
+};
+
+#endif /* LOCKSTAT */
+
 /*
  * Mutex type.
  *
+ * Waiting threads are queued in the parking lot (see parking.h), so that
+ * a mutex is a single word of state, unless statistics are enabled.
+ *
  * All members are private.
  */
 struct mutex {
-    struct list waiters;
-    struct thread *owner;
-    bool locked;
+    unsigned long state;
+#ifdef LOCKSTAT
+    struct mutex_stats stats;
+#endif /* LOCKSTAT */
 };
 
+/*
+ * Initialize the mutex module.
+ *
+ * This function registers the lockstat shell command if lock statistics
+ * are enabled, and must be called after the shell module is initialized.
+ * Mutexes may be used before calling this function.
+ */
+void mutex_setup(void);
+
 /*
  * Initialize a mutex.
  */
 void mutex_init(struct mutex *mutex);
 
+/*
+ * Set the name of a mutex.
+ *
+ * Naming a mutex adds it to the registry of mutexes reported by the
+ * lockstat shell command. The name isn't copied, and the mutex must
+ * persist in memory once named. This function has no effect if lock
+ * statistics are disabled.
+ */
+void mutex_set_name(struct mutex *mutex, const char *name);
+
 /*
  * Lock a mutex.
  *
@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2017 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "once.h"
+#include "parking.h"
+#include "thread.h"
+
+/*
+ * Once states.
+ *
+ * The initial state must be 0, for consistency with ONCE_INITIALIZER.
+ */
+#define ONCE_NEW        0
+#define ONCE_RUNNING    1
+#define ONCE_DONE       2
+
+void
+once_init(struct once *once)
+{
+    once->state = ONCE_NEW;
+}
+
+void
+once_run(struct once *once, once_fn_t fn)
+{
+    thread_preempt_disable();
+
+    if (once->state == ONCE_NEW) {
+        once->state = ONCE_RUNNING;
+        thread_preempt_enable();
+
+        fn();
+
+        thread_preempt_disable();
+        once->state = ONCE_DONE;
+        parking_unpark_all(once);
+    } else {
+        while (once->state != ONCE_DONE) {
+            parking_park(once);
+        }
+    }
+
+    thread_preempt_enable();
+}
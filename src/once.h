@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2017 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ *
+ * Once module.
+ *
+ * A once object guarantees that an initialization function is run
+ * exactly once, no matter how many threads concurrently attempt to run
+ * it. Threads that lose the race wait until the winner has completed
+ * the initialization, so that on return, the initialization is always
+ * complete. This interface is close to pthread_once().
+ *
+ * Like mutexes and condition variables, once objects are a single word,
+ * and waiting threads are queued in the parking lot (see parking.h).
+ */
+
+#ifndef _ONCE_H
+#define _ONCE_H
+
+/*
+ * Type for initialization functions.
+ */
+typedef void (*once_fn_t)(void);
+
+/*
+ * Once type.
+ *
+ * All members are private.
+ */
+struct once {
+    unsigned long state;
+};
+
+/*
+ * Static once initializer.
+ */
+#define ONCE_INITIALIZER { 0 }
+
+/*
+ * Initialize a once object.
+ */
+void once_init(struct once *once);
+
+/*
+ * Run an initialization function once.
+ *
+ * The first thread to call this function with the given once object runs
+ * the given function. Other threads sleep until it completes, and later
+ * calls return immediately.
+ */
+void once_run(struct once *once, once_fn_t fn);
+
+#endif /* _ONCE_H */
@@ -0,0 +1,632 @@
+/*
+ * Copyright (c) 2017 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <lib/list.h>
+#include <lib/macros.h>
+#include <lib/shell.h>
+
+#include "boot.h"
+#include "idle.h"
+#include "mutex.h"
+#include "page.h"
+#include "panic.h"
+#include "thread.h"
+
+/*
+ * Value of the order of pages which don't start an allocated block.
+ */
+#define PAGE_ORDER_NONE     0xff
+
+/*
+ * Parameters of pre-zeroed block pools.
+ *
+ * Pools are only kept for small orders, which are the most common, e.g.
+ * for thread stacks, and keep at most PAGE_ZERO_POOL_SIZE blocks each.
+ */
+#define PAGE_ZERO_MAX_ORDER 2
+#define PAGE_ZERO_POOL_SIZE 4
+
+/*
+ * Free block.
+ *
+ * The list node is stored in the first page of the block itself.
+ */
+struct page_free_block {
+    struct list node;
+};
+
+/*
+ * Page pool.
+ *
+ * The pool spans all the free memory left once the heap is allocated.
+ * It may contain holes, such as reserved memory between free regions,
+ * or the heap itself, which are never added to the free lists, and are
+ * therefore never merged with free blocks.
+ */
+static char *page_pool;
+static size_t page_nr_pages;
+
+/*
+ * Free lists, and the number of free blocks, of each order.
+ */
+static struct list page_free_lists[PAGE_NR_ORDERS];
+static unsigned long page_nr_free_blocks[PAGE_NR_ORDERS];
+
+/*
+ * Bitmap of orders with a non-empty free list.
+ */
+static uint32_t page_free_orders;
+
+/*
+ * Free bitmaps.
+ *
+ * Bit i of the bitmap of an order is set if the ith block of that order
+ * is free, as a whole. The bitmaps of all orders are stored contiguously,
+ * starting at their respective offsets, in bits. Order i has
+ * page_nr_pages >> i bits, which is less than twice the number of pages
+ * overall.
+ */
+static uint32_t *page_bitmap;
+static size_t page_bitmap_offsets[PAGE_NR_ORDERS];
+
+/*
+ * Order of the block started by each page, if allocated.
+ */
+static uint8_t *page_orders;
+
+/*
+ * Page allocator mutex.
+ *
+ * It's only acquired with preemption disabled, and critical sections
+ * never sleep, which bounds the time other threads may wait for it, even
+ * when the idle thread holds it. On this uniprocessor system, it's then
+ * never found locked by another thread, which is why it's acquired with
+ * mutex_trylock().
+ */
+static struct mutex page_mutex;
+
+/*
+ * Pool of pre-zeroed blocks of an order.
+ *
+ * Blocks are zeroed by the idle thread, so that zeroed allocations are
+ * as cheap as regular ones when the system isn't always busy. Pooled
+ * blocks are allocated as far as the buddy system is concerned. Pools
+ * are protected by disabling preemption.
+ */
+struct page_zero_pool {
+    unsigned int nr_blocks;
+    void *blocks[PAGE_ZERO_POOL_SIZE];
+};
+
+static struct page_zero_pool page_zero_pools[PAGE_ZERO_MAX_ORDER + 1];
+
+static struct idle_work page_zero_work;
+
+static size_t
+page_bitmap_bit(unsigned int order, size_t index)
+{
+    return page_bitmap_offsets[order] + (index >> order);
+}
+
+static bool
+page_bitmap_test(unsigned int order, size_t index)
+{
+    size_t bit;
+
+    bit = page_bitmap_bit(order, index);
+    return page_bitmap[bit / 32] & (1U << (bit % 32));
+}
+
+static void
+page_bitmap_set(unsigned int order, size_t index)
+{
+    size_t bit;
+
+    bit = page_bitmap_bit(order, index);
+    page_bitmap[bit / 32] |= (1U << (bit % 32));
+}
+
+static void
+page_bitmap_clear(unsigned int order, size_t index)
+{
+    size_t bit;
+
+    bit = page_bitmap_bit(order, index);
+    page_bitmap[bit / 32] &= ~(1U << (bit % 32));
+}
+
+static size_t
+page_index(const void *addr)
+{
+    return ((const char *)addr - page_pool) >> PAGE_SHIFT;
+}
+
+static struct page_free_block *
+page_block(size_t index)
+{
+    return (struct page_free_block *)&page_pool[index << PAGE_SHIFT];
+}
+
+static void
+page_block_add(unsigned int order, size_t index)
+{
+    assert(P2ALIGNED(index, 1 << order));
+
+    list_insert_head(&page_free_lists[order], &page_block(index)->node);
+    page_nr_free_blocks[order]++;
+    page_free_orders |= (1U << order);
+    page_bitmap_set(order, index);
+}
+
+static void
+page_block_remove(unsigned int order, size_t index)
+{
+    assert(page_bitmap_test(order, index));
+
+    list_remove(&page_block(index)->node);
+    page_nr_free_blocks[order]--;
+
+    if (list_empty(&page_free_lists[order])) {
+        page_free_orders &= ~(1U << order);
+    }
+
+    page_bitmap_clear(order, index);
+}
+
+static bool
+page_owns(const void *addr)
+{
+    return ((const char *)addr >= page_pool)
+           && ((const char *)addr < &page_pool[page_nr_pages << PAGE_SHIFT]);
+}
+
+/*
+ * Add a free range of pages to the free lists, as blocks as large as
+ * their alignment allows.
+ */
+static void
+page_add_range(size_t index, size_t end)
+{
+    unsigned int order;
+
+    while (index < end) {
+        order = PAGE_NR_ORDERS - 1;
+
+        while (!P2ALIGNED(index, (size_t)1 << order)
+               || ((index + ((size_t)1 << order)) > end)) {
+            order--;
+        }
+
+        page_block_add(order, index);
+        index += (size_t)1 << order;
+    }
+}
+
+void
+page_bootstrap(void)
+{
+    const struct boot_mem_region *regions;
+    size_t offset, bitmap_size;
+    unsigned int nr_regions;
+    uintptr_t start, end;
+
+    regions = boot_get_mem_regions(&nr_regions);
+    start = UINTPTR_MAX;
+    end = 0;
+
+    for (unsigned int i = 0; i < nr_regions; i++) {
+        if (regions[i].start == regions[i].end) {
+            continue;
+        }
+
+        start = MIN(start, regions[i].start);
+        end = MAX(end, regions[i].end);
+    }
+
+    if (start >= end) {
+        panic("page: no free memory");
+    }
+
+    page_pool = (char *)start;
+    page_nr_pages = (end - start) >> PAGE_SHIFT;
+
+    offset = 0;
+
+    for (unsigned int i = 0; i < PAGE_NR_ORDERS; i++) {
+        list_init(&page_free_lists[i]);
+        page_nr_free_blocks[i] = 0;
+        page_bitmap_offsets[i] = offset;
+        offset += page_nr_pages >> i;
+    }
+
+    /*
+     * Metadata are allocated from the pool itself, before the remaining
+     * free memory is added to the free lists.
+     */
+    bitmap_size = DIV_CEIL(offset, 32) * sizeof(*page_bitmap);
+    page_bitmap = boot_alloc(bitmap_size);
+    page_orders = boot_alloc(page_nr_pages * sizeof(*page_orders));
+
+    if (!page_bitmap || !page_orders) {
+        panic("page: unable to allocate metadata");
+    }
+
+    memset(page_bitmap, 0, bitmap_size);
+    memset(page_orders, PAGE_ORDER_NONE, page_nr_pages * sizeof(*page_orders));
+
+    for (unsigned int i = 0; i < nr_regions; i++) {
+        page_add_range(page_index((void *)regions[i].start),
+                       page_index((void *)regions[i].end));
+    }
+
+    mutex_init(&page_mutex);
+    mutex_set_name(&page_mutex, "page");
+}
+
+static void
+page_lock(void)
+{
+    int error;
+
+    thread_preempt_disable();
+    error = mutex_trylock(&page_mutex);
+    assert(!error);
+}
+
+static void
+page_unlock(void)
+{
+    mutex_unlock(&page_mutex);
+    thread_preempt_enable();
+}
+
+unsigned int
+page_order(size_t size)
+{
+    unsigned int order;
+
+    order = 0;
+
+    while ((order < PAGE_NR_ORDERS)
+           && (((size_t)PAGE_SIZE << order) < size)) {
+        order++;
+    }
+
+    return order;
+}
+
+/*
+ * Allocate a block of pages.
+ *
+ * The page mutex must be locked.
+ */
+static void *
+page_alloc_locked(unsigned int order)
+{
+    struct page_free_block *block;
+    unsigned int block_order;
+    uint32_t orders;
+    size_t index;
+
+    orders = page_free_orders & (~0U << order);
+
+    if (orders == 0) {
+        return NULL;
+    }
+
+    block_order = __builtin_ctz(orders);
+    block = list_first_entry(&page_free_lists[block_order],
+                             struct page_free_block, node);
+    index = page_index(block);
+    page_block_remove(block_order, index);
+
+    /*
+     * Split the block until it has the requested order, returning the
+     * upper halves to the free lists.
+     */
+    while (block_order > order) {
+        block_order--;
+        page_block_add(block_order, index + (1 << block_order));
+    }
+
+    page_orders[index] = order;
+    return block;
+}
+
+/*
+ * Return all pre-zeroed blocks to the free lists.
+ */
+static void
+page_zero_pools_drain(void)
+{
+    void *blocks[PAGE_ZERO_POOL_SIZE];
+    struct page_zero_pool *pool;
+    unsigned int nr_blocks;
+
+    for (size_t i = 0; i < ARRAY_SIZE(page_zero_pools); i++) {
+        pool = &page_zero_pools[i];
+
+        thread_preempt_disable();
+        nr_blocks = pool->nr_blocks;
+        memcpy(blocks, pool->blocks, nr_blocks * sizeof(blocks[0]));
+        pool->nr_blocks = 0;
+        thread_preempt_enable();
+
+        for (unsigned int j = 0; j < nr_blocks; j++) {
+            page_free(blocks[j]);
+        }
+    }
+}
+
+void *
+page_alloc(unsigned int order)
+{
+    void *addr;
+
+    if (order >= PAGE_NR_ORDERS) {
+        return NULL;
+    }
+
+    page_lock();
+    addr = page_alloc_locked(order);
+    page_unlock();
+
+    if (!addr) {
+        /*
+         * Pre-zeroed blocks are only an optimization, give them back
+         * and try again.
+         */
+        page_zero_pools_drain();
+
+        page_lock();
+        addr = page_alloc_locked(order);
+        page_unlock();
+    }
+
+    return addr;
+}
+
+void *
+page_alloc_zeroed(unsigned int order)
+{
+    struct page_zero_pool *pool;
+    void *addr;
+
+    if (order <= PAGE_ZERO_MAX_ORDER) {
+        pool = &page_zero_pools[order];
+        addr = NULL;
+
+        thread_preempt_disable();
+
+        if (pool->nr_blocks != 0) {
+            pool->nr_blocks--;
+            addr = pool->blocks[pool->nr_blocks];
+        }
+
+        thread_preempt_enable();
+
+        if (addr) {
+            return addr;
+        }
+    }
+
+    addr = page_alloc(order);
+
+    if (addr) {
+        memset(addr, 0, (size_t)PAGE_SIZE << order);
+    }
+
+    return addr;
+}
+
+/*
+ * Refill pre-zeroed block pools, one block at a time.
+ *
+ * Zeroing is done with preemption enabled, while the block is privately
+ * owned by the idle thread. If memory is short, pools aren't refilled,
+ * so that they never compete with regular allocations.
+ */
+static bool
+page_zero_work_run(void *arg)
+{
+    struct page_zero_pool *pool;
+    unsigned int nr_blocks;
+    void *addr;
+    bool stored;
+
+    (void)arg;
+
+    for (unsigned int i = 0; i < ARRAY_SIZE(page_zero_pools); i++) {
+        pool = &page_zero_pools[i];
+
+        thread_preempt_disable();
+        nr_blocks = pool->nr_blocks;
+        thread_preempt_enable();
+
+        if (nr_blocks == ARRAY_SIZE(pool->blocks)) {
+            continue;
+        }
+
+        thread_preempt_disable();
+
+        if (mutex_trylock(&page_mutex) != 0) {
+            thread_preempt_enable();
+            return false;
+        }
+
+        addr = page_alloc_locked(i);
+        page_unlock();
+
+        if (!addr) {
+            return false;
+        }
+
+        memset(addr, 0, (size_t)PAGE_SIZE << i);
+
+        thread_preempt_disable();
+
+        stored = (pool->nr_blocks != ARRAY_SIZE(pool->blocks));
+
+        if (stored) {
+            pool->blocks[pool->nr_blocks] = addr;
+            pool->nr_blocks++;
+        }
+
+        thread_preempt_enable();
+
+        if (!stored) {
+            page_free(addr);
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+void
+page_free(void *addr)
+{
+    unsigned int order;
+    size_t index, buddy;
+
+    assert(page_owns(addr));
+    assert(P2ALIGNED((uintptr_t)addr, PAGE_SIZE));
+
+    index = page_index(addr);
+
+    page_lock();
+
+    order = page_orders[index];
+    assert(order != PAGE_ORDER_NONE);
+    page_orders[index] = PAGE_ORDER_NONE;
+
+    /*
+     * Merge the block with its buddy as long as the buddy is free, as a
+     * whole. The buddy of a block is the other half of the block of the
+     * next order, which is obtained by flipping the bit of the index that
+     * corresponds to the order. Since the pool size isn't necessarily a
+     * multiple of the largest block size, the buddy of a block at the end
+     * of the pool may not exist.
+     */
+    while (order < (PAGE_NR_ORDERS - 1)) {
+        buddy = index ^ ((size_t)1 << order);
+
+        if ((buddy + ((size_t)1 << order)) > page_nr_pages) {
+            break;
+        }
+
+        if (!page_bitmap_test(order, buddy)) {
+            break;
+        }
+
+        page_block_remove(order, buddy);
+        index &= ~((size_t)1 << order);
+        order++;
+    }
+
+    page_block_add(order, index);
+
+    page_unlock();
+}
+
+unsigned int
+page_get_order(const void *addr)
+{
+    unsigned int order;
+
+    assert(page_owns(addr));
+    assert(P2ALIGNED((uintptr_t)addr, PAGE_SIZE));
+
+    /*
+     * The order of an allocated block only changes when it's freed, which
+     * only its owner may do, so there is no need to lock.
+     */
+    order = page_orders[page_index(addr)];
+    assert(order != PAGE_ORDER_NONE);
+    return order;
+}
+
+static void
+page_shell_info(int argc, char **argv)
+{
+    unsigned long nr_free_blocks[PAGE_NR_ORDERS], nr_free_pages;
+
+    (void)argc;
+    (void)argv;
+
+    page_lock();
+
+    for (unsigned int i = 0; i < PAGE_NR_ORDERS; i++) {
+        nr_free_blocks[i] = page_nr_free_blocks[i];
+    }
+
+    page_unlock();
+
+    nr_free_pages = 0;
+
+    printf("page: %5s %10s %10s\n", "order", "size", "free");
+
+    for (unsigned int i = 0; i < PAGE_NR_ORDERS; i++) {
+        printf("page: %5u %9luk %10lu\n", i,
+               ((unsigned long)PAGE_SIZE << i) / 1024, nr_free_blocks[i]);
+        nr_free_pages += nr_free_blocks[i] << i;
+    }
+
+    printf("page: %lu/%lu pages free\n", nr_free_pages,
+           (unsigned long)page_nr_pages);
+
+    for (unsigned int i = 0; i < ARRAY_SIZE(page_zero_pools); i++) {
+        printf("page: order %u: %u pre-zeroed blocks\n", i,
+               page_zero_pools[i].nr_blocks);
+    }
+}
+
+static struct shell_cmd page_shell_cmds[] = {
+    SHELL_CMD_INITIALIZER("page_info", page_shell_info,
+        "page_info",
+        "display the number of free page blocks of each order"),
+};
+
+void
+page_setup(void)
+{
+    int error;
+
+    for (size_t i = 0; i < ARRAY_SIZE(page_shell_cmds); i++) {
+        error = shell_cmd_register(&page_shell_cmds[i]);
+
+        if (error) {
+            panic("page: unable to register shell command");
+        }
+    }
+
+    idle_work_init(&page_zero_work, page_zero_work_run, NULL);
+    idle_work_register(&page_zero_work);
+}
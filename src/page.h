@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2017 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ *
+ * Page allocator.
+ *
+ * This module manages the free physical pages with the binary buddy
+ * system [1]. Memory is allocated in blocks of 2^order contiguous pages,
+ * the offset of which in the pool is a multiple of their size. A block
+ * is split in two halves, called buddies, when smaller blocks are needed,
+ * and freed blocks are merged with their buddy when it's also free, so
+ * that both operations take O(log n) steps, n being the number of orders.
+ * Free blocks are linked in per-order free lists, and their state is also
+ * recorded in per-order bitmaps, so that checking whether a buddy is free
+ * doesn't require touching its memory.
+ *
+ * Pages are meant for large or page-aligned allocations, such as thread
+ * stacks, slabs and large buffers, so that these don't fragment the heap
+ * used for small objects.
+ *
+ * [1] https://en.wikipedia.org/wiki/Buddy_memory_allocation
+ */
+
+#ifndef _PAGE_H
+#define _PAGE_H
+
+#include <stddef.h>
+
+#define PAGE_SHIFT  12
+#define PAGE_SIZE   (1 << PAGE_SHIFT)
+
+/*
+ * Number of block orders.
+ *
+ * The largest block is 2^(PAGE_NR_ORDERS - 1) pages.
+ */
+#define PAGE_NR_ORDERS 13
+
+/*
+ * Initialize the page allocator.
+ *
+ * The page allocator takes all the free memory left by the boot module,
+ * which must not allocate memory any more. Pages may be allocated once
+ * this function returns.
+ */
+void page_bootstrap(void);
+
+/*
+ * Initialize the page module.
+ *
+ * This function registers the page shell commands, and the idle work
+ * that fills the pools of pre-zeroed blocks.
+ */
+void page_setup(void);
+
+/*
+ * Return the smallest order of a block at least as large as the given size.
+ */
+unsigned int page_order(size_t size);
+
+/*
+ * Allocate a block of 2^order pages.
+ *
+ * The block is aligned on a page boundary. Return NULL if there is no
+ * free block large enough.
+ */
+void * page_alloc(unsigned int order);
+
+/*
+ * Allocate a block of 2^order zeroed pages.
+ *
+ * Small blocks are taken from pools of blocks zeroed in advance by the
+ * idle thread, if available. Otherwise, this function is equivalent to
+ * page_alloc() followed by zeroing the block.
+ */
+void * page_alloc_zeroed(unsigned int order);
+
+/*
+ * Free a block of pages.
+ *
+ * The address must have been returned by page_alloc(). The order of the
+ * block is known to the allocator.
+ */
+void page_free(void *addr);
+
+/*
+ * Return the order of an allocated block of pages.
+ *
+ * The address must have been returned by page_alloc(), and the block not
+ * freed yet.
+ */
+unsigned int page_get_order(const void *addr);
+
+#endif /* _PAGE_H */
@@ -27,6 +27,7 @@
 #include "cpu.h"
 #include "panic.h"
 #include "thread.h"
+#include "uart.h"
 
 void
 panic(const char *format, ...)
@@ -35,6 +36,7 @@ panic(const char *format, ...)
 
     thread_preempt_disable();
     cpu_intr_disable();
+    uart_sync();
     printf("\npanic: ");
     va_start(ap, format);
     vprintf(format, ap);
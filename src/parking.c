@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2017 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <lib/hash.h>
+#include <lib/list.h>
+#include <lib/macros.h>
+
+#include "parking.h"
+#include "thread.h"
+
+/*
+ * Binary exponent and size of the hash table.
+ */
+#define PARKING_HTABLE_BITS 6
+#define PARKING_HTABLE_SIZE (1 << PARKING_HTABLE_BITS)
+
+/*
+ * Wait queue.
+ *
+ * Preemption must be disabled when accessing a bucket.
+ */
+struct parking_bucket {
+    struct list waiters;
+};
+
+/*
+ * Structure used to bind a parked thread and an address.
+ *
+ * As with mutex and condition variable waiters before the parking lot,
+ * this structure is allocated from the stack of the parked thread, and
+ * only exists while the thread is parked.
+ *
+ * The awaken member records whether the parked thread has actually been
+ * unparked, to guard against spurious wake-ups.
+ */
+struct parking_waiter {
+    struct list node;
+    const void *addr;
+    struct thread *thread;
+    bool awaken;
+};
+
+static struct parking_bucket parking_htable[PARKING_HTABLE_SIZE];
+
+static void
+parking_waiter_init(struct parking_waiter *waiter, const void *addr,
+                    struct thread *thread)
+{
+    waiter->addr = addr;
+    waiter->thread = thread;
+    waiter->awaken = false;
+}
+
+static bool
+parking_waiter_awaken(const struct parking_waiter *waiter)
+{
+    return waiter->awaken;
+}
+
+static void
+parking_waiter_wakeup(struct parking_waiter *waiter)
+{
+    /*
+     * Removing the waiter from its bucket here, instead of letting the
+     * waiter remove itself when it resumes, makes the content of buckets
+     * exactly reflect the set of threads that still need to be unparked.
+     */
+    list_remove(&waiter->node);
+    waiter->awaken = true;
+    thread_wakeup(waiter->thread);
+}
+
+static void
+parking_bucket_init(struct parking_bucket *bucket)
+{
+    list_init(&bucket->waiters);
+}
+
+static struct parking_bucket *
+parking_bucket_get(const void *addr)
+{
+    return &parking_htable[hash_ptr(addr, PARKING_HTABLE_BITS)];
+}
+
+void
+parking_setup(void)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(parking_htable); i++) {
+        parking_bucket_init(&parking_htable[i]);
+    }
+}
+
+void
+parking_park(const void *addr)
+{
+    struct parking_bucket *bucket;
+    struct parking_waiter waiter;
+
+    assert(!thread_preempt_enabled());
+
+    bucket = parking_bucket_get(addr);
+    parking_waiter_init(&waiter, addr, thread_self());
+    list_insert_tail(&bucket->waiters, &waiter.node);
+
+    do {
+        thread_sleep();
+    } while (!parking_waiter_awaken(&waiter));
+}
+
+bool
+parking_unpark_one(const void *addr)
+{
+    struct parking_bucket *bucket;
+    struct parking_waiter *waiter;
+    bool unparked;
+
+    bucket = parking_bucket_get(addr);
+    unparked = false;
+
+    thread_preempt_disable();
+
+    list_for_each_entry(&bucket->waiters, waiter, node) {
+        if (waiter->addr == addr) {
+            parking_waiter_wakeup(waiter);
+            unparked = true;
+            break;
+        }
+    }
+
+    thread_preempt_enable();
+
+    return unparked;
+}
+
+void
+parking_unpark_all(const void *addr)
+{
+    struct parking_bucket *bucket;
+    struct parking_waiter *waiter, *tmp;
+
+    bucket = parking_bucket_get(addr);
+
+    thread_preempt_disable();
+
+    list_for_each_entry_safe(&bucket->waiters, waiter, tmp, node) {
+        if (waiter->addr == addr) {
+            parking_waiter_wakeup(waiter);
+        }
+    }
+
+    thread_preempt_enable();
+}
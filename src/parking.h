@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2017 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ *
+ * Parking lot module.
+ *
+ * A parking lot is a global hash table of wait queues, keyed by the
+ * address of a synchronization object. Instead of embedding a list of
+ * waiters in every mutex or condition variable, threads "park" on the
+ * address of the object they're waiting for, and are "unparked" by
+ * other threads using the same address. Synchronization objects built
+ * on top of the parking lot only need a single word of state, and the
+ * cost of a wait queue is only paid while threads are actually waiting.
+ *
+ * This technique is used by e.g. the WebKit locking primitives [1], and
+ * is very close to what Linux futexes [2] provide for user space.
+ *
+ * Multiple addresses may share the same bucket in the hash table. This
+ * is normally harmless, since buckets are expected to remain short, and
+ * waiters always check the address they're parked on.
+ *
+ * [1] https://webkit.org/blog/6161/locking-in-webkit/
+ * [2] https://www.kernel.org/doc/ols/2002/ols2002-pages-479-495.pdf
+ */
+
+#ifndef _PARKING_H
+#define _PARKING_H
+
+#include <stdbool.h>
+
+/*
+ * Initialize the parking module.
+ */
+void parking_setup(void);
+
+/*
+ * Park the calling thread on the given address.
+ *
+ * The calling thread sleeps until another thread unparks it using the
+ * same address. Spurious wake-ups are filtered, i.e. this function only
+ * returns once the calling thread has actually been unparked.
+ *
+ * Preemption must be disabled when calling this function, so that
+ * checking the state of the synchronization object and parking is atomic
+ * with respect to unparking.
+ */
+void parking_park(const void *addr);
+
+/*
+ * Unpark the oldest thread parked on the given address.
+ *
+ * Return true if a thread was unparked, false if no thread was parked
+ * on the given address.
+ */
+bool parking_unpark_one(const void *addr);
+
+/*
+ * Unpark all the threads parked on the given address.
+ */
+void parking_unpark_all(const void *addr);
+
+#endif /* _PARKING_H */
@@ -0,0 +1,367 @@
+/*
+ * Copyright (c) 2017 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <lib/list.h>
+#include <lib/macros.h>
+
+#include "error.h"
+#include "parking.h"
+#include "port.h"
+#include "thread.h"
+
+/*
+ * Synchronous call.
+ *
+ * This structure is allocated from the stack of the client, and only
+ * exists while the client is waiting for the reply. The request and
+ * reply buffers are also provided by the client. Since the client
+ * sleeps until the server replies, they remain valid for the whole call.
+ *
+ * Preemption must be disabled when accessing a call.
+ */
+struct port_call {
+    struct list node;
+    struct thread *client;
+    const void *request;
+    void *reply;
+    bool replied;
+};
+
+/*
+ * Server waiting for a call.
+ *
+ * This structure is allocated from the stack of the server, and only
+ * exists while the server is waiting for a call.
+ *
+ * Preemption must be disabled when accessing a server.
+ */
+struct port_server {
+    struct list node;
+    struct thread *thread;
+    struct port_call *call;
+};
+
+static void
+port_call_init(struct port_call *call, const void *request, void *reply)
+{
+    call->client = thread_self();
+    call->request = request;
+    call->reply = reply;
+    call->replied = false;
+}
+
+static void
+port_server_init(struct port_server *server)
+{
+    server->thread = thread_self();
+    server->call = NULL;
+}
+
+void
+port_init(struct port *port, void *buf, size_t msg_size, size_t capacity)
+{
+    assert(msg_size != 0);
+    assert((capacity == 0) || ISP2(capacity));
+    assert((capacity == 0) || buf);
+
+    port->buf = buf;
+    port->msg_size = msg_size;
+    port->capacity = capacity;
+    port->start = 0;
+    port->end = 0;
+    port->nr_senders = 0;
+    port->nr_receivers = 0;
+    list_init(&port->calls);
+    list_init(&port->servers);
+}
+
+static size_t
+port_size(const struct port *port)
+{
+    return port->end - port->start;
+}
+
+static bool
+port_empty(const struct port *port)
+{
+    return port_size(port) == 0;
+}
+
+static bool
+port_full(const struct port *port)
+{
+    return port_size(port) == port->capacity;
+}
+
+static void *
+port_slot(const struct port *port, size_t index)
+{
+    return &port->buf[(index & (port->capacity - 1)) * port->msg_size];
+}
+
+/*
+ * Preemption must be disabled when calling the functions below.
+ */
+
+static void
+port_push(struct port *port, const void *msg)
+{
+    assert(!port_full(port));
+
+    memcpy(port_slot(port, port->end), msg, port->msg_size);
+    port->end++;
+
+    if (port->nr_receivers != 0) {
+        parking_unpark_one(&port->nr_receivers);
+    }
+}
+
+static void
+port_pop(struct port *port, void *msg)
+{
+    assert(!port_empty(port));
+
+    memcpy(msg, port_slot(port, port->start), port->msg_size);
+    port->start++;
+
+    if (port->nr_senders != 0) {
+        parking_unpark_one(&port->nr_senders);
+    }
+}
+
+void
+port_send(struct port *port, const void *msg)
+{
+    assert(port->capacity != 0);
+
+    thread_preempt_disable();
+
+    while (port_full(port)) {
+        port->nr_senders++;
+        parking_park(&port->nr_senders);
+        port->nr_senders--;
+    }
+
+    port_push(port, msg);
+
+    thread_preempt_enable();
+}
+
+int
+port_trysend(struct port *port, const void *msg)
+{
+    int error;
+
+    thread_preempt_disable();
+
+    if (port_full(port)) {
+        error = ERROR_AGAIN;
+    } else {
+        port_push(port, msg);
+        error = 0;
+    }
+
+    thread_preempt_enable();
+
+    return error;
+}
+
+void
+port_receive(struct port *port, void *msg)
+{
+    assert(port->capacity != 0);
+
+    thread_preempt_disable();
+
+    while (port_empty(port)) {
+        port->nr_receivers++;
+        parking_park(&port->nr_receivers);
+        port->nr_receivers--;
+    }
+
+    port_pop(port, msg);
+
+    thread_preempt_enable();
+}
+
+int
+port_tryreceive(struct port *port, void *msg)
+{
+    int error;
+
+    thread_preempt_disable();
+
+    if (port_empty(port)) {
+        error = ERROR_AGAIN;
+    } else {
+        port_pop(port, msg);
+        error = 0;
+    }
+
+    thread_preempt_enable();
+
+    return error;
+}
+
+void
+port_call(struct port *port, const void *request, void *reply)
+{
+    struct port_server *server;
+    struct port_call call;
+
+    port_call_init(&call, request, reply);
+
+    thread_preempt_disable();
+
+    if (list_empty(&port->servers)) {
+        list_insert_tail(&port->calls, &call.node);
+    } else {
+        server = list_first_entry(&port->servers, struct port_server, node);
+        list_remove(&server->node);
+        server->call = &call;
+        thread_handoff(server->thread);
+    }
+
+    while (!call.replied) {
+        thread_sleep();
+    }
+
+    thread_preempt_enable();
+}
+
+/*
+ * Return a pending call, or NULL if there is none.
+ *
+ * Preemption must be disabled when calling this function.
+ */
+static struct port_call *
+port_get_call(struct port *port)
+{
+    struct port_call *call;
+
+    if (list_empty(&port->calls)) {
+        return NULL;
+    }
+
+    call = list_first_entry(&port->calls, struct port_call, node);
+    list_remove(&call->node);
+    return call;
+}
+
+/*
+ * Copy the reply and mark the call replied.
+ *
+ * The client may not resume before preemption is enabled again, which
+ * is why it's safe to access the call after this function returns.
+ *
+ * Preemption must be disabled when calling this function.
+ */
+static void
+port_complete(struct port *port, struct port_call *call, const void *reply)
+{
+    assert(!call->replied);
+
+    memcpy(call->reply, reply, port->msg_size);
+    call->replied = true;
+}
+
+/*
+ * Wait for a call, switching to the given thread if not NULL.
+ *
+ * Preemption must be disabled when calling this function.
+ */
+static struct port_call *
+port_wait_call(struct port *port, struct thread *next)
+{
+    struct port_server server;
+
+    port_server_init(&server);
+    list_insert_tail(&port->servers, &server.node);
+
+    if (next) {
+        thread_handoff(next);
+    }
+
+    while (!server.call) {
+        thread_sleep();
+    }
+
+    return server.call;
+}
+
+struct port_call *
+port_accept(struct port *port, void *request)
+{
+    struct port_call *call;
+
+    thread_preempt_disable();
+
+    call = port_get_call(port);
+
+    if (!call) {
+        call = port_wait_call(port, NULL);
+    }
+
+    memcpy(request, call->request, port->msg_size);
+
+    thread_preempt_enable();
+
+    return call;
+}
+
+void
+port_reply(struct port *port, struct port_call *call, const void *reply)
+{
+    thread_preempt_disable();
+    port_complete(port, call, reply);
+    thread_wakeup(call->client);
+    thread_preempt_enable();
+}
+
+struct port_call *
+port_reply_accept(struct port *port, struct port_call *call,
+                  const void *reply, void *request)
+{
+    struct port_call *next;
+
+    thread_preempt_disable();
+
+    port_complete(port, call, reply);
+    next = port_get_call(port);
+
+    if (next) {
+        thread_wakeup(call->client);
+    } else {
+        next = port_wait_call(port, call->client);
+    }
+
+    memcpy(request, next->request, port->msg_size);
+
+    thread_preempt_enable();
+
+    return next;
+}
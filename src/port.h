@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2017 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ *
+ * IPC port module.
+ *
+ * A port is a communication endpoint between threads, based on message
+ * passing. It supports two styles of communication :
+ *  - asynchronous, where messages are queued in a bounded buffer, so that
+ *    senders only block when the buffer is full, and receivers when it's
+ *    empty
+ *  - synchronous, where a client calls a server, and sleeps until the
+ *    server replies, much like a function call across threads
+ *
+ * All the messages of a port have the same, fixed size, chosen when the
+ * port is initialized. Messages are copied, which is why they should
+ * remain small. Larger data are best passed by reference, by using
+ * pointers as messages, i.e. a message size of sizeof(void *).
+ *
+ * Synchronous calls are optimized for the common case where a server
+ * thread is waiting for requests when a client calls. Instead of waking
+ * up the server and letting the scheduler select it, the client directly
+ * switches to the server (see thread_handoff()). When replying, a server
+ * that immediately waits for the next request switches directly back to
+ * the client. This is how L4 microkernels implement IPC [1], and it
+ * saves both run queue operations and a full scheduling decision on each
+ * message.
+ *
+ * Here is an example of a server loop :
+ *
+ * struct port_call *call;
+ * uint32_t request, reply;
+ *
+ * call = port_accept(&port, &request);
+ *
+ * for (;;) {
+ *     reply = process(request);
+ *     call = port_reply_accept(&port, call, &reply, &request);
+ * }
+ *
+ * [1] https://dl.acm.org/citation.cfm?id=168633
+ */
+
+#ifndef _PORT_H
+#define _PORT_H
+
+#include <stddef.h>
+
+#include <lib/list.h>
+
+/*
+ * Synchronous call.
+ *
+ * Calls are allocated by clients, and only exist until the call is
+ * replied. They are used by servers as reply handles.
+ *
+ * All members are private.
+ */
+struct port_call;
+
+/*
+ * Port type.
+ *
+ * All members are private.
+ */
+struct port {
+    char *buf;
+    size_t msg_size;
+    size_t capacity;
+    size_t start;
+    size_t end;
+    unsigned long nr_senders;
+    unsigned long nr_receivers;
+    struct list calls;
+    struct list servers;
+};
+
+/*
+ * Initialize a port.
+ *
+ * The given buffer is used to queue asynchronous messages. It must be
+ * large enough for the given number of messages, which must be a
+ * power-of-two. A port only used for synchronous calls may be initialized
+ * without a buffer, and a capacity of 0.
+ */
+void port_init(struct port *port, void *buf, size_t msg_size, size_t capacity);
+
+/*
+ * Send an asynchronous message.
+ *
+ * If the port buffer is full, the calling thread sleeps until a message
+ * is received.
+ */
+void port_send(struct port *port, const void *msg);
+
+/*
+ * Try to send an asynchronous message.
+ *
+ * This is the non-blocking variant of port_send().
+ *
+ * Return 0 on success, ERROR_AGAIN if the port buffer is full.
+ */
+int port_trysend(struct port *port, const void *msg);
+
+/*
+ * Receive an asynchronous message.
+ *
+ * If the port buffer is empty, the calling thread sleeps until a message
+ * is sent.
+ */
+void port_receive(struct port *port, void *msg);
+
+/*
+ * Try to receive an asynchronous message.
+ *
+ * This is the non-blocking variant of port_receive().
+ *
+ * Return 0 on success, ERROR_AGAIN if the port buffer is empty.
+ */
+int port_tryreceive(struct port *port, void *msg);
+
+/*
+ * Call a server.
+ *
+ * The request is passed to a server thread waiting on the port, and the
+ * calling thread sleeps until the server replies. On return, the reply
+ * is stored in the given reply buffer.
+ */
+void port_call(struct port *port, const void *request, void *reply);
+
+/*
+ * Accept a call.
+ *
+ * The calling thread sleeps until a client calls. On return, the request
+ * is stored in the given request buffer, and the returned call must be
+ * passed to port_reply() or port_reply_accept().
+ */
+struct port_call * port_accept(struct port *port, void *request);
+
+/*
+ * Reply to a call.
+ *
+ * The client is awaken, and the server keeps running.
+ */
+void port_reply(struct port *port, struct port_call *call, const void *reply);
+
+/*
+ * Reply to a call and accept the next one.
+ *
+ * This function is equivalent to port_reply() followed by port_accept(),
+ * but if no other call is pending, the server directly switches to the
+ * client.
+ */
+struct port_call * port_reply_accept(struct port *port, struct port_call *call,
+                                     const void *reply, void *request);
+
+#endif /* _PORT_H */
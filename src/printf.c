@@ -24,15 +24,26 @@
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "cpu.h"
+#include "mutex.h"
+#include "printf.h"
 #include "thread.h"
 #include "uart.h"
 
 /* TODO Discuss stack vs static and size */
 #define PRINTF_BUFFER_SIZE 1024
 
+/*
+ * Threads format into a buffer protected by a mutex, so that they may
+ * sleep while their output is queued. Other contexts, i.e. interrupt
+ * handlers and code running with preemption or interrupts disabled,
+ * format into a separate buffer with interrupts disabled.
+ */
+static struct mutex printf_mutex;
 static char printf_buffer[PRINTF_BUFFER_SIZE];
+static char printf_atomic_buffer[PRINTF_BUFFER_SIZE];
 
 int
 printf(const char *format, ...)
@@ -53,18 +64,25 @@ vprintf(const char *format, va_list ap)
     uint32_t eflags;
     int length;
 
-    thread_preempt_disable();
-    eflags = cpu_intr_save();
-
-    length = vsnprintf(printf_buffer, sizeof(printf_buffer), format, ap);
-
-    for (const char *ptr = printf_buffer; *ptr != '\0'; ptr++) {
-        /* TODO Discuss cast */
-        uart_write((uint8_t)*ptr);
+    if (thread_preempt_enabled() && cpu_intr_enabled()) {
+        mutex_lock(&printf_mutex);
+        length = vsnprintf(printf_buffer, sizeof(printf_buffer), format, ap);
+        uart_write_buf(printf_buffer, strlen(printf_buffer));
+        mutex_unlock(&printf_mutex);
+    } else {
+        eflags = cpu_intr_save();
+        length = vsnprintf(printf_atomic_buffer, sizeof(printf_atomic_buffer),
+                           format, ap);
+        uart_write_buf(printf_atomic_buffer, strlen(printf_atomic_buffer));
+        cpu_intr_restore(eflags);
     }
 
-    cpu_intr_restore(eflags);
-    thread_preempt_enable();
-
     return length;
 }
+
+void
+printf_setup(void)
+{
+    mutex_init(&printf_mutex);
+    mutex_set_name(&printf_mutex, "printf");
+}
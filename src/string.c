@@ -75,6 +75,21 @@ memmove(void *dest, const void *src, size_t n)
     return dest;
 }
 
+void *
+memset(void *s, int c, size_t n)
+{
+    unsigned char *ptr;
+    size_t i;
+
+    ptr = s;
+
+    for (i = 0; i < n; i++) {
+        ptr[i] = c;
+    }
+
+    return s;
+}
+
 char *
 strcpy(char *dest, const char *src)
 {
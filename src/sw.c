@@ -22,12 +22,16 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <lib/macros.h>
 #include <lib/shell.h>
 
+#include "clock.h"
 #include "condvar.h"
+#include "hrtimer.h"
 #include "mutex.h"
 #include "panic.h"
 #include "sw.h"
@@ -44,60 +48,242 @@
  */
 #define SW_MAX_WAIT 30
 
+#define SW_MAX_STOPWATCHES  8
+#define SW_NAME_SIZE        16
+
+/*
+ * Name of the stopwatch used when commands are given no name.
+ */
+#define SW_DEFAULT_NAME "sw"
+
+#define SW_NS_PER_US 1000
+
+/*
+ * Stopwatch.
+ *
+ * Time isn't counted, but computed from the clock when needed. The start
+ * time is the clock time at which the stopwatch was last started or
+ * resumed, and the elapsed time is the time the stopwatch had counted
+ * when it was last stopped. Timers are only armed to display the time
+ * periodically, and to wake up the shell when waiting.
+ */
+struct sw {
+    char name[SW_NAME_SIZE];
+    bool used;
+    bool running;
+    bool waiting;
+    uint64_t start_time;
+    uint64_t elapsed;
+    uint64_t lap;
+    uint64_t wait_target;
+    struct timer display_timer;
+    struct hrtimer wait_timer;
+};
+
 static struct mutex sw_mutex;
 static struct condvar sw_cv;
-static struct timer sw_timer;
-static unsigned long sw_ticks;
-static bool sw_timer_scheduled;
-static bool sw_shell_waiting;
-static unsigned long sw_wait_ticks;
+static struct sw sw_stopwatches[SW_MAX_STOPWATCHES];
+static struct timer_stats sw_timer_stats;
+
+/*
+ * The functions below must be called with the stopwatch mutex locked.
+ */
+
+static uint64_t
+sw_get_elapsed(const struct sw *sw)
+{
+    if (!sw->running) {
+        return sw->elapsed;
+    }
+
+    return sw->elapsed + (clock_now_ns() - sw->start_time);
+}
 
 static void
-sw_timer_run(void *arg)
+sw_print_time(const struct sw *sw, const char *label, uint64_t ns)
 {
-    (void)arg;
+    unsigned long long us;
+
+    us = ns / SW_NS_PER_US;
+    printf("%s: %s%llu.%06llu\n", sw->name, label,
+           us / 1000000, us % 1000000);
+}
+
+static void
+sw_arm_wait_timer(struct sw *sw)
+{
+    hrtimer_schedule(&sw->wait_timer,
+                     clock_now_ns() + (sw->wait_target - sw_get_elapsed(sw)));
+}
+
+static void
+sw_display_run(void *arg)
+{
+    struct sw *sw;
+
+    sw = arg;
 
     mutex_lock(&sw_mutex);
 
-    if (!sw_timer_scheduled) {
-        goto out;
+    /*
+     * The stopwatch may have been stopped while this function was waiting
+     * for the mutex, too late to cancel the timer.
+     */
+    if (sw->running) {
+        sw_print_time(sw, "", sw_get_elapsed(sw));
     }
 
-    sw_ticks++;
+    mutex_unlock(&sw_mutex);
+}
+
+static void
+sw_wait_run(void *arg)
+{
+    struct sw *sw;
+
+    sw = arg;
 
-    if ((sw_ticks % (THREAD_SCHED_FREQ * SW_DISPLAY_INTERVAL)) == 0) {
-        printf("%lu\n", sw_ticks);
+    mutex_lock(&sw_mutex);
+
+    if (!sw->waiting || !sw->running) {
+        goto out;
     }
 
-    if (sw_shell_waiting && timer_ticks_occurred(sw_wait_ticks, sw_ticks)) {
-        sw_shell_waiting = false;
-        condvar_signal(&sw_cv);
+    /*
+     * The stopwatch may have been stopped and resumed, in which case the
+     * timer was rearmed, and this expiration is stale.
+     */
+    if (sw_get_elapsed(sw) < sw->wait_target) {
+        goto out;
     }
 
-    /* TODO Discuss drift */
-    timer_schedule(&sw_timer, timer_get_time(&sw_timer) + 1);
+    sw->waiting = false;
+    condvar_broadcast(&sw_cv);
 
 out:
     mutex_unlock(&sw_mutex);
 }
 
+static struct sw *
+sw_lookup(const char *name)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(sw_stopwatches); i++) {
+        if (sw_stopwatches[i].used
+            && (strcmp(sw_stopwatches[i].name, name) == 0)) {
+            return &sw_stopwatches[i];
+        }
+    }
+
+    return NULL;
+}
+
+static struct sw *
+sw_create(const char *name)
+{
+    struct sw *sw;
+
+    if (strlen(name) >= SW_NAME_SIZE) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < ARRAY_SIZE(sw_stopwatches); i++) {
+        sw = &sw_stopwatches[i];
+
+        if (!sw->used) {
+            strcpy(sw->name, name);
+            sw->used = true;
+            sw->running = false;
+            sw->waiting = false;
+            sw->elapsed = 0;
+            sw->lap = 0;
+            return sw;
+        }
+    }
+
+    return NULL;
+}
+
+static void
+sw_start_timers(struct sw *sw)
+{
+    unsigned long period;
+
+    period = THREAD_SCHED_FREQ * SW_DISPLAY_INTERVAL;
+    timer_schedule_periodic(&sw->display_timer, timer_now() + period, period);
+
+    if (sw->waiting) {
+        sw_arm_wait_timer(sw);
+    }
+}
+
+static void
+sw_stop_timers(struct sw *sw)
+{
+    timer_cancel(&sw->display_timer);
+    hrtimer_cancel(&sw->wait_timer);
+}
+
+/*
+ * Return the name given as the argument at the given index, or the
+ * default name if there is no such argument.
+ */
+static const char *
+sw_get_name(int argc, char **argv, int index)
+{
+    return (argc > index) ? argv[index] : SW_DEFAULT_NAME;
+}
+
+/*
+ * Return the stopwatch named by the argument at the given index.
+ *
+ * The stopwatch mutex must be locked.
+ */
+static struct sw *
+sw_get(const char *cmd, int argc, char **argv, int index)
+{
+    const char *name;
+    struct sw *sw;
+
+    name = sw_get_name(argc, argv, index);
+    sw = sw_lookup(name);
+
+    if (!sw) {
+        printf("%s: error: no stopwatch named %s\n", cmd, name);
+    }
+
+    return sw;
+}
+
 static void
 sw_shell_start(int argc, char **argv)
 {
-    (void)argc;
-    (void)argv;
+    const char *name;
+    struct sw *sw;
+
+    name = sw_get_name(argc, argv, 1);
 
     mutex_lock(&sw_mutex);
 
-    if (sw_timer_scheduled) {
-        goto out;
+    sw = sw_lookup(name);
+
+    if (!sw) {
+        sw = sw_create(name);
+
+        if (!sw) {
+            printf("sw_start: error: unable to create stopwatch\n");
+            goto out;
+        }
     }
 
-    sw_ticks = 0;
-    sw_timer_scheduled = true;
+    if (sw->running) {
+        goto out;
+    }
 
-    /* TODO Discuss resolution */
-    timer_schedule(&sw_timer, timer_now() + 1);
+    sw->elapsed = 0;
+    sw->lap = 0;
+    sw->running = true;
+    sw->start_time = clock_now_ns();
+    sw_start_timers(sw);
 
 out:
     mutex_unlock(&sw_mutex);
@@ -106,34 +292,100 @@ out:
 static void
 sw_shell_stop(int argc, char **argv)
 {
-    (void)argc;
-    (void)argv;
+    struct sw *sw;
 
     mutex_lock(&sw_mutex);
-    sw_timer_scheduled = false;
+
+    sw = sw_get("sw_stop", argc, argv, 1);
+
+    if (!sw || !sw->running) {
+        goto out;
+    }
+
+    sw->elapsed = sw_get_elapsed(sw);
+    sw->running = false;
+    sw_stop_timers(sw);
+
+out:
     mutex_unlock(&sw_mutex);
 }
 
 static void
 sw_shell_resume(int argc, char **argv)
 {
-    (void)argc;
-    (void)argv;
+    struct sw *sw;
 
     mutex_lock(&sw_mutex);
-    sw_timer_scheduled = true;
-    timer_schedule(&sw_timer, timer_now() + 1);
+
+    sw = sw_get("sw_resume", argc, argv, 1);
+
+    if (!sw || sw->running) {
+        goto out;
+    }
+
+    sw->running = true;
+    sw->start_time = clock_now_ns();
+    sw_start_timers(sw);
+
+out:
     mutex_unlock(&sw_mutex);
 }
 
 static void
 sw_shell_read(int argc, char **argv)
 {
+    struct sw *sw;
+
+    mutex_lock(&sw_mutex);
+
+    sw = sw_get("sw_read", argc, argv, 1);
+
+    if (sw) {
+        sw_print_time(sw, "", sw_get_elapsed(sw));
+    }
+
+    mutex_unlock(&sw_mutex);
+}
+
+static void
+sw_shell_lap(int argc, char **argv)
+{
+    uint64_t elapsed;
+    struct sw *sw;
+
+    mutex_lock(&sw_mutex);
+
+    sw = sw_get("sw_lap", argc, argv, 1);
+
+    if (sw) {
+        elapsed = sw_get_elapsed(sw);
+        sw_print_time(sw, "lap: ", elapsed - sw->lap);
+        sw_print_time(sw, "total: ", elapsed);
+        sw->lap = elapsed;
+    }
+
+    mutex_unlock(&sw_mutex);
+}
+
+static void
+sw_shell_list(int argc, char **argv)
+{
+    struct sw *sw;
+
     (void)argc;
     (void)argv;
 
     mutex_lock(&sw_mutex);
-    printf("%lu\n", sw_ticks);
+
+    for (size_t i = 0; i < ARRAY_SIZE(sw_stopwatches); i++) {
+        sw = &sw_stopwatches[i];
+
+        if (sw->used) {
+            sw_print_time(sw, sw->running ? "running: " : "stopped: ",
+                          sw_get_elapsed(sw));
+        }
+    }
+
     mutex_unlock(&sw_mutex);
 }
 
@@ -141,9 +393,10 @@ static void
 sw_shell_wait(int argc, char **argv)
 {
     unsigned long seconds;
+    struct sw *sw;
     int ret;
 
-    if (argc != 2) {
+    if ((argc < 2) || (argc > 3)) {
         goto error;
     }
 
@@ -155,17 +408,24 @@ sw_shell_wait(int argc, char **argv)
 
     mutex_lock(&sw_mutex);
 
-    if (!sw_timer_scheduled) {
+    sw = sw_get("sw_wait", argc, argv, 2);
+
+    if (!sw) {
+        goto out;
+    }
+
+    if (!sw->running) {
         printf("sw_wait: error: stopwatch disabled\n");
         goto out;
     }
 
-    sw_shell_waiting = true;
-    sw_wait_ticks = sw_ticks + (seconds * THREAD_SCHED_FREQ);
+    sw->waiting = true;
+    sw->wait_target = sw_get_elapsed(sw) + (seconds * CLOCK_NS_PER_SEC);
+    sw_arm_wait_timer(sw);
 
     do {
         condvar_wait(&sw_cv, &sw_mutex);
-    } while (sw_shell_waiting);
+    } while (sw->waiting);
 
 out:
     mutex_unlock(&sw_mutex);
@@ -178,32 +438,46 @@ error:
 
 static struct shell_cmd shell_cmds[] = {
     SHELL_CMD_INITIALIZER("sw_start", sw_shell_start,
-        "sw_start",
-        "start the stopwatch"),
+        "sw_start [name]",
+        "start a stopwatch, creating it if needed"),
     SHELL_CMD_INITIALIZER("sw_stop", sw_shell_stop,
-        "sw_stop",
-        "stop the stopwatch"),
+        "sw_stop [name]",
+        "stop a stopwatch"),
     SHELL_CMD_INITIALIZER("sw_resume", sw_shell_resume,
-        "sw_resume",
-        "resume the stopwatch"),
+        "sw_resume [name]",
+        "resume a stopwatch"),
     SHELL_CMD_INITIALIZER("sw_read", sw_shell_read,
-        "sw_read",
-        "read the stopwatch time"),
+        "sw_read [name]",
+        "read the time of a stopwatch"),
+    SHELL_CMD_INITIALIZER("sw_lap", sw_shell_lap,
+        "sw_lap [name]",
+        "read the time of a stopwatch since the last lap, and start a new lap"),
+    SHELL_CMD_INITIALIZER("sw_list", sw_shell_list,
+        "sw_list",
+        "list stopwatches"),
     SHELL_CMD_INITIALIZER("sw_wait", sw_shell_wait,
-        "sw_wait <seconds>",
-        "wait for up to " QUOTE(SW_MAX_WAIT) " seconds"),
+        "sw_wait <seconds> [name]",
+        "wait for up to " QUOTE(SW_MAX_WAIT) " seconds of stopwatch time"),
 };
 
 void
 sw_setup(void)
 {
+    struct sw *sw;
     int error;
 
     mutex_init(&sw_mutex);
+    mutex_set_name(&sw_mutex, "sw");
     condvar_init(&sw_cv);
-    timer_init(&sw_timer, sw_timer_run, NULL);
-    sw_timer_scheduled = false;
-    sw_shell_waiting = false;
+    timer_stats_init(&sw_timer_stats, "sw");
+
+    for (size_t i = 0; i < ARRAY_SIZE(sw_stopwatches); i++) {
+        sw = &sw_stopwatches[i];
+        sw->used = false;
+        timer_init(&sw->display_timer, sw_display_run, sw, 0);
+        timer_set_stats(&sw->display_timer, &sw_timer_stats);
+        hrtimer_init(&sw->wait_timer, sw_wait_run, sw, 0);
+    }
 
     for (size_t i = 0; i < ARRAY_SIZE(shell_cmds); i++) {
         error = shell_cmd_register(&shell_cmds[i]);
@@ -26,16 +26,18 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
-#include <stdlib.h>
 
 #include <lib/macros.h>
 #include <lib/list.h>
 
 #include "cpu.h"
 #include "error.h"
+#include "idle.h"
+#include "kmem.h"
 #include "panic.h"
 #include "thread.h"
 #include "timer.h"
+#include "vm.h"
 
 struct thread_list {
     struct list threads;
@@ -70,6 +72,11 @@ static struct thread_runq thread_runq;
 
 static struct thread thread_dummy;
 
+/*
+ * Cache of thread structures.
+ */
+static struct kmem_cache thread_cache;
+
 void thread_load_context(struct thread *thread) __attribute__((noreturn));
 void thread_switch_context(struct thread *prev, struct thread *next);
 void thread_start(void);
@@ -81,7 +88,9 @@ thread_idle(void *arg)
     (void)arg;
 
     for (;;) {
-        cpu_idle();
+        if (!idle_run()) {
+            cpu_idle();
+        }
     }
 }
 
@@ -309,6 +318,52 @@ thread_runq_schedule(struct thread_runq *runq)
     }
 }
 
+static bool
+thread_runq_has_higher(struct thread_runq *runq, unsigned int priority)
+{
+    for (size_t i = priority + 1; i < ARRAY_SIZE(runq->lists); i++) {
+        if (!thread_list_empty(thread_runq_get_list(runq, i))) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void
+thread_runq_handoff(struct thread_runq *runq, struct thread *next)
+{
+    struct thread *prev;
+
+    prev = thread_runq_get_current(runq);
+
+    assert(thread_scheduler_locked());
+    assert(prev->preempt_level == 1);
+    assert(prev != next);
+    assert(!thread_is_running(prev));
+
+    if (thread_is_running(next)) {
+        thread_runq_schedule(runq);
+        return;
+    }
+
+    /*
+     * The previous thread leaves the run queue and the next thread
+     * enters it, so the number of threads doesn't change. Since both
+     * threads are either current or sleeping, none of them is in a
+     * run queue list.
+     */
+    assert(!thread_is_dead(next));
+    thread_set_running(next);
+    runq->current = next;
+
+    if (thread_runq_has_higher(runq, thread_get_priority(next))) {
+        thread_set_yield(next);
+    }
+
+    thread_switch_context(prev, next);
+}
+
 void
 thread_enable_scheduler(void)
 {
@@ -414,18 +469,24 @@ thread_create(struct thread **threadp, thread_fn_t fn, void *arg,
 
     assert(fn);
 
-    /* TODO Check stack size & alignment */
+    if (stack_size > VM_STACK_MAX_SIZE) {
+        return ERROR_INVAL;
+    }
 
-    thread = malloc(sizeof(*thread));
+    thread = kmem_cache_alloc(&thread_cache);
 
     if (!thread) {
         return ERROR_NOMEM;
     }
 
-    stack = malloc(stack_size);
+    /*
+     * Stack pages are zeroed so that threads never see what previous users
+     * left in memory, and only mapped once touched.
+     */
+    stack = vm_stack_alloc(stack_size);
 
     if (!stack) {
-        free(thread);
+        kmem_cache_free(&thread_cache, thread);
         return ERROR_NOMEM;
     }
 
@@ -447,8 +508,8 @@ thread_destroy(struct thread *thread)
 {
     assert(thread_is_dead(thread));
 
-    free(thread->stack);
-    free(thread);
+    vm_stack_free(thread->stack);
+    kmem_cache_free(&thread_cache, thread);
 }
 
 void
@@ -499,13 +560,13 @@ thread_create_idle(void)
     struct thread *idle;
     void *stack;
 
-    idle = malloc(sizeof(*idle));
+    idle = kmem_cache_alloc(&thread_cache);
 
     if (!idle) {
         panic("thread: unable to allocate idle thread");
     }
 
-    stack = malloc(THREAD_STACK_MIN_SIZE);
+    stack = vm_stack_alloc(THREAD_STACK_MIN_SIZE);
 
     if (!stack) {
         panic("thread: unable to allocate idle thread stack");
@@ -544,6 +605,7 @@ thread_bootstrap(void)
 void
 thread_setup(void)
 {
+    kmem_cache_init(&thread_cache, "thread", sizeof(struct thread), 0, NULL);
     thread_runq_init(&thread_runq);
 }
 
@@ -586,6 +648,22 @@ thread_sleep(void)
     cpu_intr_restore(eflags);
 }
 
+void
+thread_handoff(struct thread *thread)
+{
+    struct thread *self;
+    uint32_t eflags;
+
+    self = thread_self();
+
+    eflags = cpu_intr_save();
+    assert(thread_is_running(self));
+    thread_set_sleeping(self);
+    thread_runq_handoff(&thread_runq, thread);
+    assert(thread_is_running(self));
+    cpu_intr_restore(eflags);
+}
+
 void
 thread_wakeup(struct thread *thread)
 {
@@ -59,6 +59,23 @@ void thread_yield_if_needed(void);
 void thread_sleep(void);
 void thread_wakeup(struct thread *thread);
 
+/*
+ * Make the calling thread sleep, and directly switch to the given thread.
+ *
+ * This function is meant for synchronous communication, where a thread
+ * wakes up another thread only to immediately wait for it. Instead of
+ * adding the target thread to the run queue and looking for the next
+ * thread to run, the processor is handed directly to the target thread.
+ * Note that this bypasses the priority ordering of the run queue, which
+ * is checked only after the switch, when the target thread first
+ * enables preemption.
+ *
+ * The given thread should be sleeping. If it's not, this function is
+ * equivalent to thread_sleep(). As with thread_sleep(), preemption must
+ * be disabled when calling this function.
+ */
+void thread_handoff(struct thread *thread);
+
 void thread_preempt_enable_no_yield(void);
 void thread_preempt_enable(void);
 void thread_preempt_disable(void);
@@ -22,15 +22,20 @@
  */
 
 #include <assert.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #include <lib/list.h>
 #include <lib/macros.h>
+#include <lib/shell.h>
 
+#include "clock.h"
 #include "cpu.h"
-#include "mutex.h"
+#include "error.h"
+#include "hrtimer.h"
 #include "panic.h"
 #include "thread.h"
 #include "timer.h"
@@ -39,16 +44,278 @@
 
 #define TIMER_THRESHOLD (((unsigned long)-1) / 2)
 
+/*
+ * Timing wheel geometry.
+ *
+ * The wheel is made of levels of slots, each slot being a list of timers.
+ * Level 0 has one slot per tick, and each slot of the upper levels covers
+ * all the slots of the level below. When the time reaches the range of
+ * a slot in an upper level, the slot is "cascaded", i.e. its timers are
+ * moved to the lower levels, until they end up in level 0, where they
+ * expire. This layout is the same as the classic Linux timer wheel, and
+ * covers exactly the 32-bits range of ticks.
+ */
+#define TIMER_WHEEL_NR_LEVELS       5
+#define TIMER_WHEEL_BITS0           8
+#define TIMER_WHEEL_BITS            6
+#define TIMER_WHEEL_MAX_SLOTS       (1 << TIMER_WHEEL_BITS0)
+#define TIMER_WHEEL_BITMAP_SIZE     (TIMER_WHEEL_MAX_SLOTS / 32)
+
+/*
+ * Level value for timers that are not in the wheel.
+ */
+#define TIMER_LEVEL_NONE            ((unsigned short)-1)
+
+/*
+ * Level value for expired timers waiting to be processed.
+ */
+#define TIMER_LEVEL_EXPIRED         ((unsigned short)-2)
+
+/*
+ * Wheel level.
+ *
+ * The bitmap records which slots are non-empty, so that finding the next
+ * timer to expire doesn't require scanning slots.
+ */
+struct timer_level {
+    struct list slots[TIMER_WHEEL_MAX_SLOTS];
+    uint32_t bitmap[TIMER_WHEEL_BITMAP_SIZE];
+    unsigned int shift;
+    unsigned int nr_slots;
+};
+
 static unsigned long timer_ticks;
 
 static bool timer_list_empty;
 static unsigned long timer_wakeup_ticks;
 
-static struct list timer_list;
-static struct mutex timer_mutex;
+/*
+ * The timing wheel.
+ *
+ * The wheel time is the next tick to process. It may lag behind the
+ * current time while the timer thread is catching up.
+ */
+static struct timer_level timer_wheel[TIMER_WHEEL_NR_LEVELS];
+static unsigned long timer_wheel_time;
+static unsigned long timer_wheel_nr_timers;
+
+/*
+ * Lists of expired timers, in the order they are processed.
+ *
+ * Timers run in interrupt context are processed directly on timer ticks,
+ * while others are processed by the timer thread.
+ */
+static struct list timer_expired_list;
+static struct list timer_intr_expired_list;
+
+/*
+ * Timers the functions of which are currently running, in the timer
+ * thread and in interrupt context respectively.
+ */
+static struct timer *timer_running;
+static struct timer *timer_intr_running;
 
 static struct thread *timer_thread;
 
+/*
+ * Number of expirations processed along with others, in the same pass.
+ */
+static unsigned long timer_nr_coalesced;
+
+/*
+ * Default threshold above which timer functions are considered slow, in
+ * microseconds.
+ */
+#define TIMER_STATS_SLOW_THRESHOLD 1000
+
+#ifdef TIMERSTAT
+
+/*
+ * Registry of statistics objects.
+ *
+ * Statistics are recorded from interrupt context, which is why they're
+ * accessed with interrupts disabled.
+ */
+static struct list timer_stats_list = LIST_INITIALIZER(timer_stats_list);
+static struct timer_stats timer_global_stats;
+static unsigned long timer_stats_slow_threshold = TIMER_STATS_SLOW_THRESHOLD;
+
+/*
+ * Slowest function run so far, among those counted as slow.
+ *
+ * Per-timer statistics are only available for timers that have a
+ * statistics object attached, which is why slow functions are also
+ * identified globally, by address.
+ */
+static timer_fn_t timer_stats_slowest_fn;
+static unsigned long timer_stats_slowest_duration;
+
+static void
+timer_stats_reset(struct timer_stats *stats, const char *name)
+{
+    stats->name = name;
+    stats->nr_runs = 0;
+    stats->nr_slow = 0;
+    stats->max_lateness = 0;
+    stats->max_duration = 0;
+
+    for (size_t i = 0; i < ARRAY_SIZE(stats->lateness); i++) {
+        stats->lateness[i] = 0;
+        stats->duration[i] = 0;
+    }
+}
+
+static unsigned int
+timer_stats_bucket(unsigned long value)
+{
+    unsigned int bucket;
+
+    if (value == 0) {
+        return 0;
+    }
+
+    bucket = (sizeof(value) * CHAR_BIT) - __builtin_clzl(value);
+    return MIN(bucket, TIMER_STATS_NR_BUCKETS - 1);
+}
+
+static uint64_t
+timer_stats_now(void)
+{
+    return clock_now_ns();
+}
+
+static void
+timer_stats_update(struct timer_stats *stats, unsigned long lateness,
+                   unsigned long duration)
+{
+    stats->nr_runs++;
+
+    if (duration >= timer_stats_slow_threshold) {
+        stats->nr_slow++;
+    }
+
+    if (lateness > stats->max_lateness) {
+        stats->max_lateness = lateness;
+    }
+
+    if (duration > stats->max_duration) {
+        stats->max_duration = duration;
+    }
+
+    stats->lateness[timer_stats_bucket(lateness)]++;
+    stats->duration[timer_stats_bucket(duration)]++;
+}
+
+/*
+ * Record a run of a timer function.
+ *
+ * The timer may have been released by its function, which is why its
+ * statistics object and function are passed instead.
+ */
+static void
+timer_stats_record(struct timer_stats *stats, timer_fn_t fn,
+                   unsigned long lateness, uint64_t start)
+{
+    unsigned long duration;
+    uint32_t eflags;
+
+    duration = (timer_stats_now() - start) / 1000;
+
+    eflags = cpu_intr_save();
+
+    timer_stats_update(&timer_global_stats, lateness, duration);
+
+    if ((duration >= timer_stats_slow_threshold)
+        && (duration > timer_stats_slowest_duration)) {
+        timer_stats_slowest_fn = fn;
+        timer_stats_slowest_duration = duration;
+    }
+
+    if (stats) {
+        timer_stats_update(stats, lateness, duration);
+    }
+
+    cpu_intr_restore(eflags);
+}
+
+static void
+timer_stats_print_hist(const char *label, const unsigned long *buckets)
+{
+    printf("timer_stats:   %-8s", label);
+
+    for (size_t i = 0; i < TIMER_STATS_NR_BUCKETS; i++) {
+        printf(" %6lu", buckets[i]);
+    }
+
+    printf("\n");
+}
+
+static void
+timer_stats_print(const struct timer_stats *stats)
+{
+    struct timer_stats snapshot;
+    uint32_t eflags;
+
+    eflags = cpu_intr_save();
+    snapshot = *stats;
+    cpu_intr_restore(eflags);
+
+    printf("timer_stats: %-16s runs: %lu slow: %lu max_late: %lu"
+           " max_run: %lu\n", snapshot.name, snapshot.nr_runs,
+           snapshot.nr_slow, snapshot.max_lateness, snapshot.max_duration);
+    timer_stats_print_hist("late", snapshot.lateness);
+    timer_stats_print_hist("run", snapshot.duration);
+}
+
+static void
+timer_stats_print_all(void)
+{
+    unsigned long slowest_duration;
+    struct timer_stats *stats;
+    timer_fn_t slowest_fn;
+    uint32_t eflags;
+
+    eflags = cpu_intr_save();
+    slowest_fn = timer_stats_slowest_fn;
+    slowest_duration = timer_stats_slowest_duration;
+    cpu_intr_restore(eflags);
+
+    printf("timer_stats: slow threshold: %lu us\n",
+           timer_stats_slow_threshold);
+
+    if (slowest_fn) {
+        printf("timer_stats: slowest function: %p, run: %lu us\n",
+               slowest_fn, slowest_duration);
+    }
+
+    printf("timer_stats:   %-8s", "bucket");
+
+    for (size_t i = 0; i < TIMER_STATS_NR_BUCKETS; i++) {
+        printf(" %6lu", (i == 0) ? 0 : (1UL << (i - 1)));
+    }
+
+    printf("\n");
+
+    timer_stats_print(&timer_global_stats);
+
+    list_for_each_entry(&timer_stats_list, stats, node) {
+        timer_stats_print(stats);
+    }
+}
+
+#define timer_get_stats(timer) ((timer)->stats)
+
+#else /* TIMERSTAT */
+
+/*
+ * Statistics are disabled, turn the probes into no-ops.
+ */
+#define timer_stats_now() 0
+#define timer_stats_record(stats, fn, lateness, start)
+#define timer_get_stats(timer) NULL
+
+#endif /* TIMERSTAT */
+
 bool
 timer_ticks_expired(unsigned long ticks, unsigned long ref)
 {
@@ -70,66 +337,519 @@ timer_work_pending(void)
            && timer_ticks_occurred(timer_wakeup_ticks, timer_ticks);
 }
 
+/*
+ * Return the time at which a timer is placed in the wheel.
+ *
+ * The slack of a timer allows it to expire anywhere in the range
+ * [ticks, ticks + slack]. The time with the most trailing zero bits in
+ * that range is chosen, so that timers with overlapping ranges tend to
+ * expire at the same time, and are processed in a single pass.
+ */
+static unsigned long
+timer_wheel_ticks(const struct timer *timer)
+{
+    unsigned long limit, mask;
+    unsigned int bit;
+
+    if (timer->slack == 0) {
+        return timer->ticks;
+    }
+
+    limit = timer->ticks + timer->slack;
+    mask = limit ^ timer->ticks;
+    bit = (sizeof(mask) * CHAR_BIT) - 1 - __builtin_clzl(mask);
+    limit &= ~((1UL << bit) - 1);
+
+    /*
+     * The range may wrap around, in which case rounding could move the
+     * time before the deadline.
+     */
+    if (timer_ticks_expired(limit, timer->ticks)) {
+        return timer->ticks;
+    }
+
+    return limit;
+}
+
+static bool
+timer_scheduled(const struct timer *timer)
+{
+    return timer->level != TIMER_LEVEL_NONE;
+}
+
 static bool
-timer_expired(const struct timer *timer, unsigned long ref)
+timer_is_running(const struct timer *timer)
+{
+    return (timer == timer_running) || (timer == timer_intr_running);
+}
+
+static void
+timer_level_init(struct timer_level *level, unsigned int shift,
+                 unsigned int bits)
+{
+    level->shift = shift;
+    level->nr_slots = 1 << bits;
+
+    for (size_t i = 0; i < ARRAY_SIZE(level->slots); i++) {
+        list_init(&level->slots[i]);
+    }
+
+    for (size_t i = 0; i < ARRAY_SIZE(level->bitmap); i++) {
+        level->bitmap[i] = 0;
+    }
+}
+
+static unsigned int
+timer_level_index(const struct timer_level *level, unsigned long ticks)
 {
-    return timer_ticks_expired(timer->ticks, ref);
+    return (ticks >> level->shift) & (level->nr_slots - 1);
+}
+
+static void
+timer_level_set(struct timer_level *level, unsigned int index)
+{
+    level->bitmap[index / 32] |= (1U << (index % 32));
+}
+
+static void
+timer_level_clear(struct timer_level *level, unsigned int index)
+{
+    level->bitmap[index / 32] &= ~(1U << (index % 32));
 }
 
 static bool
-timer_occurred(const struct timer *timer, unsigned long ref)
+timer_level_empty(const struct timer_level *level)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(level->bitmap); i++) {
+        if (level->bitmap[i] != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Return the distance from the given index to the next non-empty slot,
+ * wrapping around if needed.
+ *
+ * The level must not be empty.
+ */
+static unsigned int
+timer_level_find(const struct timer_level *level, unsigned int index)
+{
+    unsigned int i, word, nr_words;
+    uint32_t bits;
+
+    nr_words = DIV_CEIL(level->nr_slots, 32);
+
+    for (i = 0; i <= nr_words; i++) {
+        word = ((index / 32) + i) % nr_words;
+        bits = level->bitmap[word];
+
+        if (i == 0) {
+            bits &= ~((1U << (index % 32)) - 1);
+        }
+
+        if (bits != 0) {
+            return ((word * 32) + __builtin_ctz(bits) - index)
+                   & (level->nr_slots - 1);
+        }
+    }
+
+    panic("timer: error: no timer found in wheel level");
+}
+
+/*
+ * Return the time at which a slot is processed.
+ *
+ * For level 0, it's the time at which timers in the slot expire. For
+ * upper levels, it's the time at which the slot is cascaded.
+ */
+static unsigned long
+timer_level_slot_time(const struct timer_level *level, unsigned int index,
+                      unsigned long now)
+{
+    unsigned long base;
+
+    base = now >> level->shift;
+
+    if ((now & ((1UL << level->shift) - 1)) != 0) {
+        base++;
+    }
+
+    return (base + ((index - base) & (level->nr_slots - 1))) << level->shift;
+}
+
+/*
+ * Return the time of the next event to process in the wheel.
+ *
+ * The wheel must not be empty.
+ */
+static unsigned long
+timer_wheel_next(void)
 {
-    return timer_ticks_occurred(timer->ticks, ref);
+    struct timer_level *level;
+    unsigned long next, time;
+    unsigned int index;
+    bool found;
+
+    assert(timer_wheel_nr_timers != 0);
+
+    next = 0;
+    found = false;
+
+    for (size_t i = 0; i < ARRAY_SIZE(timer_wheel); i++) {
+        level = &timer_wheel[i];
+
+        if (timer_level_empty(level)) {
+            continue;
+        }
+
+        if (i == 0) {
+            index = timer_level_index(level, timer_wheel_time);
+            time = timer_wheel_time + timer_level_find(level, index);
+        } else {
+            index = timer_level_index(level, timer_wheel_time);
+
+            if ((timer_wheel_time & ((1UL << level->shift) - 1)) != 0) {
+                index = (index + 1) & (level->nr_slots - 1);
+            }
+
+            index = (index + timer_level_find(level, index))
+                    & (level->nr_slots - 1);
+            time = timer_level_slot_time(level, index, timer_wheel_time);
+        }
+
+        if (!found || ((time - timer_wheel_time) < (next - timer_wheel_time))) {
+            next = time;
+            found = true;
+        }
+    }
+
+    assert(found);
+    return next;
 }
 
 static void
-timer_process(struct timer *timer)
+timer_wheel_add(struct timer *timer)
 {
-    timer->fn(timer->arg);
+    struct timer_level *level;
+    unsigned long ticks, delta;
+    unsigned int i, index;
+
+    ticks = timer_wheel_ticks(timer);
+
+    /*
+     * Timers that have already expired are processed on the next tick.
+     */
+    if (timer_ticks_expired(ticks, timer_wheel_time)) {
+        ticks = timer_wheel_time;
+    }
+
+    delta = ticks - timer_wheel_time;
+
+    for (i = 0; i < (ARRAY_SIZE(timer_wheel) - 1); i++) {
+        if (delta < (1UL << timer_wheel[i + 1].shift)) {
+            break;
+        }
+    }
+
+    level = &timer_wheel[i];
+    index = timer_level_index(level, ticks);
+
+    list_insert_tail(&level->slots[index], &timer->node);
+    timer_level_set(level, index);
+    timer->level = i;
+    timer->index = index;
+    timer_wheel_nr_timers++;
 }
 
 static void
-timer_process_list(unsigned long now)
+timer_wheel_remove(struct timer *timer)
+{
+    struct timer_level *level;
+    struct list *slot;
+
+    assert(timer_scheduled(timer));
+
+    list_remove(&timer->node);
+
+    if (timer->level != TIMER_LEVEL_EXPIRED) {
+        level = &timer_wheel[timer->level];
+        slot = &level->slots[timer->index];
+
+        if (list_empty(slot)) {
+            timer_level_clear(level, timer->index);
+        }
+
+        assert(timer_wheel_nr_timers != 0);
+        timer_wheel_nr_timers--;
+    }
+
+    timer->level = TIMER_LEVEL_NONE;
+}
+
+/*
+ * Queue a timer for processing.
+ */
+static void
+timer_expire(struct timer *timer)
+{
+    assert(!timer_scheduled(timer));
+
+    if (timer->flags & TIMER_INTR) {
+        list_insert_tail(&timer_intr_expired_list, &timer->node);
+    } else {
+        list_insert_tail(&timer_expired_list, &timer->node);
+    }
+
+    timer->level = TIMER_LEVEL_EXPIRED;
+}
+
+/*
+ * Move all the timers of a slot to the lower levels.
+ *
+ * Return the index of the cascaded slot.
+ */
+static unsigned int
+timer_wheel_cascade(struct timer_level *level)
 {
     struct timer *timer;
-    uint32_t eflags;
+    struct list *slot;
+    unsigned int index;
+
+    index = timer_level_index(level, timer_wheel_time);
+    slot = &level->slots[index];
+
+    while (!list_empty(slot)) {
+        timer = list_first_entry(slot, struct timer, node);
+        timer_wheel_remove(timer);
+        timer_wheel_add(timer);
+    }
+
+    return index;
+}
 
-    mutex_lock(&timer_mutex);
+/*
+ * Process the current tick of the wheel.
+ *
+ * Slots of upper levels are cascaded if needed, and the timers of the
+ * current slot of level 0 are moved to the list of expired timers.
+ *
+ * Return the number of expired timers.
+ */
+static unsigned long
+timer_wheel_process_tick(void)
+{
+    struct timer_level *level;
+    struct timer *timer;
+    unsigned long nr_expired;
+    struct list *slot;
+    unsigned int index;
+
+    index = timer_level_index(&timer_wheel[0], timer_wheel_time);
 
-    while (!list_empty(&timer_list)) {
-        timer = list_first_entry(&timer_list, typeof(*timer), node);
+    for (size_t i = 1; (index == 0) && (i < ARRAY_SIZE(timer_wheel)); i++) {
+        index = timer_wheel_cascade(&timer_wheel[i]);
+    }
+
+    level = &timer_wheel[0];
+    index = timer_level_index(level, timer_wheel_time);
+    slot = &level->slots[index];
+    nr_expired = 0;
+
+    while (!list_empty(slot)) {
+        timer = list_first_entry(slot, struct timer, node);
+        timer_wheel_remove(timer);
+        timer_expire(timer);
+        nr_expired++;
+    }
 
-        if (!timer_occurred(timer, now)) {
+    return nr_expired;
+}
+
+/*
+ * Advance the wheel up to the given time.
+ *
+ * Ticks where nothing happens are skipped, so that catching up after a
+ * long period of inactivity is cheap.
+ *
+ * Return the number of expired timers.
+ */
+static unsigned long
+timer_wheel_advance(unsigned long now)
+{
+    unsigned long next, nr_expired;
+
+    nr_expired = 0;
+
+    while (timer_ticks_occurred(timer_wheel_time, now)) {
+        if (timer_wheel_nr_timers == 0) {
             break;
         }
 
-        list_remove(&timer->node);
-        mutex_unlock(&timer_mutex);
+        next = timer_wheel_next();
 
-        timer_process(timer);
+        if (timer_ticks_expired(now, next)) {
+            break;
+        }
 
-        mutex_lock(&timer_mutex);
+        timer_wheel_time = next;
+        nr_expired += timer_wheel_process_tick();
+        timer_wheel_time++;
     }
 
-    eflags = cpu_intr_save();
+    timer_wheel_time = now + 1;
+    return nr_expired;
+}
+
+/*
+ * Update the time at which timers must be processed.
+ *
+ * Interrupts must be disabled when calling this function.
+ */
+static void
+timer_update_wakeup(void)
+{
+    assert(!cpu_intr_enabled());
+
+    timer_list_empty = (timer_wheel_nr_timers == 0);
+    timer_wakeup_ticks = timer_list_empty ? 0 : timer_wheel_next();
+}
+
+/*
+ * Make sure timers are processed when the given timer, which has just
+ * been added to the wheel, must be processed.
+ *
+ * Interrupts must be disabled when calling this function.
+ */
+static void
+timer_lower_wakeup(const struct timer *timer)
+{
+    unsigned long next;
 
-    timer_list_empty = list_empty(&timer_list);
+    assert(!cpu_intr_enabled());
 
-    if (!timer_list_empty) {
-        timer = list_first_entry(&timer_list, typeof(*timer), node);
-        timer_wakeup_ticks = timer->ticks;
+    if (timer->level == 0) {
+        next = timer_wheel_time
+               + ((timer->index - timer_wheel_time)
+                  & (timer_wheel[0].nr_slots - 1));
+    } else {
+        next = timer_level_slot_time(&timer_wheel[timer->level],
+                                     timer->index, timer_wheel_time);
     }
 
-    cpu_intr_restore(eflags);
+    if (timer_list_empty
+        || ((next - timer_wheel_time)
+            < (timer_wakeup_ticks - timer_wheel_time))) {
+        timer_list_empty = false;
+        timer_wakeup_ticks = next;
+    }
+}
+
+/*
+ * Prepare a timer for running its function.
+ *
+ * The timer is removed from its expired list. Periodic timers are
+ * rescheduled at their original cadence, and their overruns updated,
+ * according to their policy.
+ *
+ * Interrupts must be disabled when calling this function.
+ */
+static void
+timer_dequeue(struct timer *timer)
+{
+    unsigned long missed;
+
+    assert(!cpu_intr_enabled());
+    assert(timer->level == TIMER_LEVEL_EXPIRED);
+
+    timer_wheel_remove(timer);
+
+    if (timer->period == 0) {
+        return;
+    }
+
+    missed = timer_ticks_occurred(timer->ticks, timer_ticks)
+             ? ((timer_ticks - timer->ticks) / timer->period)
+             : 0;
+    timer->overruns = missed;
 
-    mutex_unlock(&timer_mutex);
+    if (timer->flags & TIMER_CATCHUP) {
+        timer->ticks += timer->period;
+
+        if (missed != 0) {
+            timer_expire(timer);
+            return;
+        }
+    } else {
+        timer->ticks += (missed + 1) * timer->period;
+    }
+
+    timer_wheel_add(timer);
+    timer_lower_wakeup(timer);
+}
+
+/*
+ * Process expired timers.
+ *
+ * This function is called on timer ticks, in interrupt context. Timers
+ * run in interrupt context are processed immediately, and the timer
+ * thread is awaken if other timers have expired.
+ */
+static void
+timer_process_tick(unsigned long now)
+{
+    struct timer_stats *stats __unused;
+    unsigned long lateness __unused;
+    uint64_t start __unused;
+    unsigned long nr_expired;
+    struct timer *timer;
+    timer_fn_t fn;
+
+    assert(!cpu_intr_enabled());
+
+    nr_expired = timer_wheel_advance(now);
+
+    /*
+     * All the timers expiring in this pass share a single interrupt,
+     * and a single wakeup of the timer thread.
+     */
+    if (nr_expired > 1) {
+        timer_nr_coalesced += nr_expired - 1;
+    }
+
+    while (!list_empty(&timer_intr_expired_list)) {
+        timer = list_first_entry(&timer_intr_expired_list, struct timer, node);
+        stats = timer_get_stats(timer);
+        lateness = now - timer->ticks;
+        timer_dequeue(timer);
+
+        timer_intr_running = timer;
+        fn = timer->fn;
+        start = timer_stats_now();
+        fn(timer->arg);
+        timer_stats_record(stats, fn, lateness, start);
+        timer_intr_running = NULL;
+    }
+
+    timer_update_wakeup();
+
+    if (!list_empty(&timer_expired_list)) {
+        thread_wakeup(timer_thread);
+    }
 }
 
 static void
 timer_run(void *arg)
 {
-    unsigned long now;
+    struct timer_stats *stats __unused;
+    unsigned long lateness __unused;
+    uint64_t start __unused;
+    struct timer *timer;
     uint32_t eflags;
+    timer_fn_t fn;
 
     (void)arg;
 
@@ -137,23 +857,74 @@ timer_run(void *arg)
         thread_preempt_disable();
         eflags = cpu_intr_save();
 
-        for (;;) {
-            now = timer_ticks;
-
-            if (timer_work_pending()) {
-                break;
-            }
-
+        while (list_empty(&timer_expired_list)) {
             thread_sleep();
         }
 
+        timer = list_first_entry(&timer_expired_list, struct timer, node);
+        stats = timer_get_stats(timer);
+        lateness = timer_ticks - timer->ticks;
+        timer_dequeue(timer);
+        timer_running = timer;
+
         cpu_intr_restore(eflags);
         thread_preempt_enable();
 
-        timer_process_list(now);
+        fn = timer->fn;
+        start = timer_stats_now();
+        fn(timer->arg);
+
+        eflags = cpu_intr_save();
+        timer_running = NULL;
+        cpu_intr_restore(eflags);
+
+        timer_stats_record(stats, fn, lateness, start);
     }
 }
 
+static void
+timer_shell_stats(int argc, char **argv)
+{
+    unsigned long threshold __unused;
+    int ret;
+
+    if (argc > 2) {
+        goto error;
+    }
+
+    if (argc == 2) {
+        ret = sscanf(argv[1], "%lu", &threshold);
+
+        if (ret != 1) {
+            goto error;
+        }
+
+#ifdef TIMERSTAT
+        timer_stats_slow_threshold = threshold;
+#endif /* TIMERSTAT */
+    }
+
+    printf("timer_stats: coalesced: %lu, hrtimer coalesced: %lu\n",
+           timer_get_nr_coalesced(), hrtimer_get_nr_coalesced());
+
+#ifdef TIMERSTAT
+    timer_stats_print_all();
+#else /* TIMERSTAT */
+    printf("timer_stats: statistics disabled\n");
+#endif /* TIMERSTAT */
+
+    return;
+
+error:
+    printf("timer_stats: error: invalid arguments\n");
+}
+
+static struct shell_cmd timer_shell_cmds[] = {
+    SHELL_CMD_INITIALIZER("timer_stats", timer_shell_stats,
+        "timer_stats [slow_threshold_us]",
+        "display timer statistics"),
+};
+
 void
 timer_setup(void)
 {
@@ -162,8 +933,21 @@ timer_setup(void)
     timer_ticks = 0;
     timer_list_empty = true;
 
-    list_init(&timer_list);
-    mutex_init(&timer_mutex);
+    timer_level_init(&timer_wheel[0], 0, TIMER_WHEEL_BITS0);
+
+    for (size_t i = 1; i < ARRAY_SIZE(timer_wheel); i++) {
+        timer_level_init(&timer_wheel[i],
+                         TIMER_WHEEL_BITS0 + ((i - 1) * TIMER_WHEEL_BITS),
+                         TIMER_WHEEL_BITS);
+    }
+
+    timer_wheel_time = 0;
+    timer_wheel_nr_timers = 0;
+    list_init(&timer_expired_list);
+    list_init(&timer_intr_expired_list);
+    timer_running = NULL;
+    timer_intr_running = NULL;
+    timer_nr_coalesced = 0;
 
     error = thread_create(&timer_thread, timer_run, NULL,
                           "timer", TIMER_STACK_SIZE, THREAD_MAX_PRIORITY);
@@ -171,6 +955,20 @@ timer_setup(void)
     if (error) {
         panic("timer: unable to create thread");
     }
+
+#ifdef TIMERSTAT
+    timer_stats_reset(&timer_global_stats, "all");
+    timer_stats_slowest_fn = NULL;
+    timer_stats_slowest_duration = 0;
+#endif /* TIMERSTAT */
+
+    for (size_t i = 0; i < ARRAY_SIZE(timer_shell_cmds); i++) {
+        error = shell_cmd_register(&timer_shell_cmds[i]);
+
+        if (error) {
+            panic("timer: unable to register shell command");
+        }
+    }
 }
 
 unsigned long
@@ -187,51 +985,173 @@ timer_now(void)
 }
 
 void
-timer_init(struct timer *timer, timer_fn_t fn, void *arg)
+timer_init(struct timer *timer, timer_fn_t fn, void *arg, int flags)
 {
     timer->fn = fn;
     timer->arg = arg;
+    timer->flags = flags;
+    timer->period = 0;
+    timer->overruns = 0;
+    timer->slack = 0;
+#ifdef TIMERSTAT
+    timer->stats = NULL;
+#endif /* TIMERSTAT */
+    timer->level = TIMER_LEVEL_NONE;
+}
+
+void
+timer_stats_init(struct timer_stats *stats, const char *name)
+{
+#ifdef TIMERSTAT
+    uint32_t eflags;
+
+    assert(name);
+
+    timer_stats_reset(stats, name);
+
+    eflags = cpu_intr_save();
+    list_insert_tail(&timer_stats_list, &stats->node);
+    cpu_intr_restore(eflags);
+#else /* TIMERSTAT */
+    (void)stats;
+    (void)name;
+#endif /* TIMERSTAT */
+}
+
+void
+timer_set_stats(struct timer *timer, struct timer_stats *stats)
+{
+#ifdef TIMERSTAT
+    uint32_t eflags;
+
+    eflags = cpu_intr_save();
+    timer->stats = stats;
+    cpu_intr_restore(eflags);
+#else /* TIMERSTAT */
+    (void)timer;
+    (void)stats;
+#endif /* TIMERSTAT */
+}
+
+void
+timer_set_slack(struct timer *timer, unsigned long slack)
+{
+    uint32_t eflags;
+
+    eflags = cpu_intr_save();
+    timer->slack = slack;
+    cpu_intr_restore(eflags);
 }
 
 unsigned long
 timer_get_time(const struct timer *timer)
 {
     unsigned long ticks;
+    uint32_t eflags;
 
-    mutex_lock(&timer_mutex);
+    eflags = cpu_intr_save();
     ticks = timer->ticks;
-    mutex_unlock(&timer_mutex);
+    cpu_intr_restore(eflags);
 
     return ticks;
 }
 
+static void
+timer_schedule_common(struct timer *timer, unsigned long ticks,
+                      unsigned long period)
+{
+    uint32_t eflags;
+
+    eflags = cpu_intr_save();
+
+    if (timer_scheduled(timer)) {
+        timer_wheel_remove(timer);
+    }
+
+    /*
+     * The wheel time only advances when timers are processed. If the
+     * wheel is empty, it may be far behind, so bring it up to date,
+     * which is cheap since there is nothing to process.
+     */
+    if (timer_wheel_nr_timers == 0) {
+        timer_wheel_time = timer_ticks;
+    }
+
+    timer->ticks = ticks;
+    timer->period = period;
+    timer->overruns = 0;
+    timer_wheel_add(timer);
+    timer_lower_wakeup(timer);
+
+    cpu_intr_restore(eflags);
+}
+
 void
 timer_schedule(struct timer *timer, unsigned long ticks)
 {
-    struct timer *tmp;
+    timer_schedule_common(timer, ticks, 0);
+}
+
+void
+timer_schedule_periodic(struct timer *timer, unsigned long first,
+                        unsigned long period)
+{
+    assert(period != 0);
+    timer_schedule_common(timer, first, period);
+}
+
+unsigned long
+timer_get_overruns(const struct timer *timer)
+{
+    unsigned long overruns;
     uint32_t eflags;
 
-    mutex_lock(&timer_mutex);
+    eflags = cpu_intr_save();
+    overruns = timer->overruns;
+    cpu_intr_restore(eflags);
 
-    timer->ticks = ticks;
+    return overruns;
+}
 
-    list_for_each_entry(&timer_list, tmp, node) {
-        if (!timer_expired(tmp, ticks)) {
-            break;
-        }
-    }
+unsigned long
+timer_get_nr_coalesced(void)
+{
+    unsigned long nr_coalesced;
+    uint32_t eflags;
 
-    list_insert_before(&tmp->node, &timer->node);
+    eflags = cpu_intr_save();
+    nr_coalesced = timer_nr_coalesced;
+    cpu_intr_restore(eflags);
 
-    timer = list_first_entry(&timer_list, typeof(*timer), node);
+    return nr_coalesced;
+}
+
+int
+timer_cancel(struct timer *timer)
+{
+    uint32_t eflags;
+    bool cancelled;
+    int error;
 
     eflags = cpu_intr_save();
-    timer_list_empty = false;
-    timer_wakeup_ticks = timer->ticks;
+
+    cancelled = timer_scheduled(timer);
+
+    if (cancelled) {
+        timer_wheel_remove(timer);
+    }
+
+    if (timer_is_running(timer)) {
+        error = ERROR_BUSY;
+    } else if (cancelled) {
+        error = 0;
+    } else {
+        error = ERROR_AGAIN;
+    }
+
     cpu_intr_restore(eflags);
 
-    /* TODO Explain how unlocking here avoids a spurious wake-up */
-    mutex_unlock(&timer_mutex);
+    return error;
 }
 
 void
@@ -240,6 +1160,6 @@ timer_report_tick(void)
     timer_ticks++;
 
     if (timer_work_pending()) {
-        thread_wakeup(timer_thread);
+        timer_process_tick(timer_ticks);
     }
 }
@@ -22,27 +22,102 @@
  *
  *
  * Software timer module.
+ *
+ * Timers are stored in a hierarchical timing wheel [1], which makes
+ * scheduling and cancelling constant time operations, regardless of the
+ * number of timers. The wheel is protected by disabling interrupts, so
+ * that timers may be scheduled and cancelled from interrupt context.
+ *
+ * By default, timer functions are run by a dedicated thread at the
+ * maximum priority. Timers initialized with the TIMER_INTR flag instead
+ * run their function directly from the timer interrupt handler, which
+ * avoids waking up the timer thread. Such functions must be short, and
+ * must not block.
+ *
+ * Timer statistics
+ * ----------------
+ * When built with the TIMERSTAT macro defined, e.g. with
+ * $ make CPPFLAGS=-DTIMERSTAT
+ * the lateness of timer functions, i.e. the number of ticks between the
+ * scheduled time and the time the function actually starts, and their
+ * run time, are recorded in histograms. Statistics are global, and may
+ * also be recorded in named statistics objects attached to timers, which
+ * several timers may share. Functions running longer than a threshold
+ * are counted as slow, and the address of the slowest one is recorded,
+ * so that it can be resolved with addr2line(1) on the kernel image. The
+ * timer_stats shell command prints all this, along with the number of
+ * coalesced expirations, which is always available.
+ *
+ * [1] http://www.cs.columbia.edu/~nahum/w6998/papers/sosp87-timing-wheels.pdf
  */
 
 #ifndef _TIMER_H
 #define _TIMER_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include <lib/list.h>
 
 struct timer;
 
+/*
+ * Timer flags.
+ */
+#define TIMER_INTR      0x1 /* Run the timer function in interrupt context */
+#define TIMER_CATCHUP   0x2 /* Run periodic timers once per missed period */
+
 /*
  * Type for timer functions.
  */
 typedef void (*timer_fn_t)(void *arg);
 
+/*
+ * Number of buckets in statistics histograms.
+ *
+ * Bucket 0 counts null values, and bucket i, for i > 0, counts values in
+ * the range [2^(i - 1), 2^i), except for the last bucket, which counts
+ * all larger values too.
+ */
+#define TIMER_STATS_NR_BUCKETS 16
+
+/*
+ * Timer statistics.
+ *
+ * Lateness is in ticks, run time in microseconds.
+ *
+ * All members are private.
+ */
+struct timer_stats {
+    struct list node;
+    const char *name;
+    unsigned long nr_runs;
+    unsigned long nr_slow;
+    unsigned long max_lateness;
+    unsigned long max_duration;
+    unsigned long lateness[TIMER_STATS_NR_BUCKETS];
+    unsigned long duration[TIMER_STATS_NR_BUCKETS];
+};
+
+/*
+ * Timer type.
+ *
+ * All members are private.
+ */
 struct timer {
     struct list node;
     unsigned long ticks;
     timer_fn_t fn;
     void *arg;
+    int flags;
+    unsigned long period;
+    unsigned long overruns;
+    unsigned long slack;
+#ifdef TIMERSTAT
+    struct timer_stats *stats;
+#endif /* TIMERSTAT */
+    unsigned short level;
+    unsigned short index;
 };
 
 bool timer_ticks_expired(unsigned long ticks, unsigned long ref);
@@ -50,17 +125,121 @@ bool timer_ticks_occurred(unsigned long ticks, unsigned long ref);
 
 /*
  * Initialize the timer module.
+ *
+ * This function registers the timer_stats shell command, and must be
+ * called after the shell module is initialized.
  */
 void timer_setup(void);
 
 unsigned long timer_now(void);
 
-void timer_init(struct timer *timer, timer_fn_t fn, void *arg);
+/*
+ * Initialize a timer.
+ *
+ * The flags are a combination of the TIMER_xxx flags.
+ */
+void timer_init(struct timer *timer, timer_fn_t fn, void *arg, int flags);
+
+/*
+ * Initialize a statistics object and add it to the registry.
+ *
+ * The name isn't copied, and the statistics object must persist in
+ * memory once initialized. This function has no effect if timer
+ * statistics are disabled.
+ */
+void timer_stats_init(struct timer_stats *stats, const char *name);
+
+/*
+ * Attach a statistics object to a timer.
+ *
+ * This function has no effect if timer statistics are disabled.
+ */
+void timer_set_stats(struct timer *timer, struct timer_stats *stats);
+
+/*
+ * Set the slack of a timer, in ticks.
+ *
+ * The slack allows a timer to expire anywhere between its scheduled time
+ * and that time plus the slack, so that it may be processed along with
+ * other timers, in a single pass, which reduces the number of wakeups
+ * of the timer thread. The slack is 0 by default, and only applies to
+ * later scheduling. The cadence of periodic timers isn't affected.
+ */
+void timer_set_slack(struct timer *timer, unsigned long slack);
 
 unsigned long timer_get_time(const struct timer *timer);
 
+/*
+ * Schedule a timer.
+ *
+ * The timer function is run once the given absolute time, in ticks, has
+ * been reached. Scheduling a timer that is already scheduled reschedules
+ * it. A timer may be rescheduled from its own function.
+ *
+ * This function may be called from interrupt context.
+ */
 void timer_schedule(struct timer *timer, unsigned long ticks);
 
+/*
+ * Schedule a periodic timer.
+ *
+ * The timer first expires at the given absolute time, in ticks, and then
+ * every period ticks, at the original cadence, i.e. without drifting,
+ * regardless of when its function actually runs. The timer is rearmed
+ * before its function is run, and keeps running until cancelled, or
+ * scheduled with timer_schedule().
+ *
+ * If the function runs late enough that later periods have also elapsed,
+ * these periods are overruns. By default, overruns are coalesced, i.e.
+ * the function runs once and the timer is rearmed at the next period in
+ * the future. With the TIMER_CATCHUP flag, the function runs once for
+ * each missed period, as soon as possible, until the timer catches up.
+ */
+void timer_schedule_periodic(struct timer *timer, unsigned long first,
+                             unsigned long period);
+
+/*
+ * Return the number of overruns of a periodic timer.
+ *
+ * This function is meant to be called from the timer function, and
+ * returns the number of periods that had elapsed, in addition to the
+ * current one, when the function started running. With the TIMER_CATCHUP
+ * flag, these are the periods the function will run again for.
+ */
+unsigned long timer_get_overruns(const struct timer *timer);
+
+/*
+ * Return the number of coalesced expirations.
+ *
+ * An expiration is coalesced when it's processed in the same pass as
+ * other expirations, sharing a single wakeup of the timer thread.
+ */
+unsigned long timer_get_nr_coalesced(void);
+
+/*
+ * Cancel a timer.
+ *
+ * If the timer is scheduled, it's cancelled, and its function won't run
+ * for that expiry.
+ *
+ * Return ERROR_BUSY if the timer function is currently running, whether
+ * a later expiry was cancelled or not, in which case the timer must not
+ * be released until its function returns. Otherwise, return 0 if the
+ * timer was scheduled, and ERROR_AGAIN if it wasn't.
+ *
+ * The function of a timer run in interrupt context can only be found
+ * running by itself, which means that such timers can always be released
+ * once cancelled from another context.
+ *
+ * This function may be called from interrupt context.
+ */
+int timer_cancel(struct timer *timer);
+
+/*
+ * Report a timer tick.
+ *
+ * Timers run in interrupt context are processed by this function.
+ */
 void timer_report_tick(void);
 
 #endif /* _TIMER_H */
@@ -28,13 +28,17 @@
 #include <stdio.h>
 
 #include <lib/cbuf.h>
+#include <lib/list.h>
 #include <lib/macros.h>
 
+#include "clock.h"
 #include "cpu.h"
 #include "error.h"
+#include "hrtimer.h"
 #include "io.h"
 #include "uart.h"
 #include "thread.h"
+#include "waitset.h"
 
 #define UART_BAUD_RATE          115200
 
@@ -44,52 +48,390 @@
 #define UART_IRQ                4
 
 #define UART_IER_DATA           0x1
+#define UART_IER_THRE           0x2
+
+#define UART_IIR_NONE           0x1
+#define UART_IIR_ID_MASK        0xe
+#define UART_IIR_ID_MODEM       0x0
+#define UART_IIR_ID_THRE        0x2
+#define UART_IIR_ID_DATA        0x4
+#define UART_IIR_ID_LINE        0x6
+#define UART_IIR_ID_TIMEOUT     0xc
+#define UART_IIR_FIFO_MASK      0xc0
+
+#define UART_FCR_ENABLE         0x1
+#define UART_FCR_CLEAR_RX       0x2
+#define UART_FCR_CLEAR_TX       0x4
+#define UART_FCR_TRIGGER_8      0x80
 
 #define UART_LCR_8BITS          0x3
 #define UART_LCR_STOP1          0
 #define UART_LCR_PARITY_NONE    0
 #define UART_LCR_DLAB           0x80
 
+#define UART_LSR_DATA_READY     0x01
+#define UART_LSR_THRE           0x20
+
 #define UART_COM1_PORT          0x3F8
 #define UART_REG_DAT            0
 #define UART_REG_DIVL           0
 #define UART_REG_IER            1
 #define UART_REG_DIVH           1
+#define UART_REG_IIR            2
+#define UART_REG_FCR            2
 #define UART_REG_LCR            3
+#define UART_REG_LSR            5
+#define UART_REG_MSR            6
 
-#define UART_BUFFER_SIZE        16
+/*
+ * Size of the receive buffer.
+ *
+ * This is enough for a few pasted lines, even when the reader is slow.
+ */
+#define UART_BUFFER_SIZE        1024
 
 #if !ISP2(UART_BUFFER_SIZE)
 #error "invalid buffer size"
 #endif
 
+/*
+ * Size of the transmit ring.
+ *
+ * At 115200 bauds, a full ring takes about 350ms to drain.
+ */
+#define UART_TX_BUFFER_SIZE     4096
+
+#if !ISP2(UART_TX_BUFFER_SIZE)
+#error "invalid transmit buffer size"
+#endif
+
+/*
+ * Size of the 16550 FIFOs.
+ *
+ * When the FIFOs are enabled, the transmitter holding register empty
+ * condition means that the whole transmit FIFO is empty.
+ */
+#define UART_FIFO_SIZE          16
+
+#ifdef UART_POLL
+
+/*
+ * Minimum number of bytes received in an interrupt to switch to polling.
+ *
+ * An interrupt reporting that the receive FIFO reached its trigger level
+ * means that input is arriving steadily.
+ */
+#define UART_POLL_THRESHOLD     8
+
+/*
+ * Polling period, in nanoseconds.
+ *
+ * At 115200 bauds, the receive FIFO fills in about 1.4ms.
+ */
+#define UART_POLL_PERIOD        500000
+
+#endif /* UART_POLL */
+
+/*
+ * Writer waiting for room in the transmit ring.
+ *
+ * Waiters are allocated on the stack of their thread, and are woken up
+ * by the interrupt handler once enough room is available.
+ */
+struct uart_tx_waiter {
+    struct list node;
+    struct thread *thread;
+    size_t size;
+};
+
 static uint8_t uart_buffer[UART_BUFFER_SIZE];
 static struct cbuf uart_cbuf;
 static struct thread *uart_waiter;
+static struct waitset_source *uart_source;
+
+static uint8_t uart_tx_buffer[UART_TX_BUFFER_SIZE];
+static struct cbuf uart_tx_cbuf;
+static struct list uart_tx_waiters = LIST_INITIALIZER(uart_tx_waiters);
+static uint8_t uart_ier;
+
+/*
+ * Number of bytes the transmitter accepts once ready, i.e. 1 if the
+ * device has no FIFO.
+ */
+static unsigned int uart_tx_fifo_size = 1;
+
+/*
+ * True if output is written synchronously, by polling the transmitter.
+ *
+ * This is the case until the module is set up, and after uart_sync()
+ * is called.
+ */
+static bool uart_tx_sync = true;
 
 static void
-uart_irq_handler(void *arg)
+uart_set_ier(uint8_t ier)
+{
+    if (ier != uart_ier) {
+        uart_ier = ier;
+        io_write(UART_COM1_PORT + UART_REG_IER, ier);
+    }
+}
+
+static bool
+uart_tx_ready(void)
+{
+    return io_read(UART_COM1_PORT + UART_REG_LSR) & UART_LSR_THRE;
+}
+
+static size_t
+uart_tx_free_size(void)
+{
+    return cbuf_capacity(&uart_tx_cbuf) - cbuf_size(&uart_tx_cbuf);
+}
+
+static void
+uart_tx_wakeup(void)
+{
+    struct uart_tx_waiter *waiter;
+    size_t free_size;
+
+    free_size = uart_tx_free_size();
+
+    list_for_each_entry(&uart_tx_waiters, waiter, node) {
+        if (waiter->size <= free_size) {
+            thread_wakeup(waiter->thread);
+        }
+    }
+}
+
+/*
+ * Move bytes from the transmit ring to the transmitter, enable the
+ * transmitter interrupt if bytes remain, and wake up the writers for
+ * which there is now enough room.
+ *
+ * Interrupts must be disabled when calling this function.
+ */
+static void
+uart_tx_fill(void)
 {
     uint8_t byte;
     int error;
 
+    if (uart_tx_ready()) {
+        for (unsigned int i = 0; i < uart_tx_fifo_size; i++) {
+            error = cbuf_popb(&uart_tx_cbuf, &byte);
+
+            if (error) {
+                break;
+            }
+
+            io_write(UART_COM1_PORT + UART_REG_DAT, byte);
+        }
+    }
+
+    if (cbuf_size(&uart_tx_cbuf) == 0) {
+        uart_set_ier(uart_ier & ~UART_IER_THRE);
+    } else {
+        uart_set_ier(uart_ier | UART_IER_THRE);
+    }
+
+    uart_tx_wakeup();
+}
+
+/*
+ * Wait for the transmitter and feed it, without relying on interrupts.
+ *
+ * Interrupts must be disabled when calling this function.
+ */
+static void
+uart_tx_poll(void)
+{
+    while (!uart_tx_ready());
+
+    uart_tx_fill();
+}
+
+/*
+ * Sleep until the transmit ring has room for the given size.
+ *
+ * Preemption and interrupts must be disabled when calling this function.
+ */
+static void
+uart_tx_wait(size_t size)
+{
+    struct uart_tx_waiter waiter;
+
+    waiter.thread = thread_self();
+    waiter.size = size;
+    list_insert_tail(&uart_tx_waiters, &waiter.node);
+
+    do {
+        thread_sleep();
+    } while (uart_tx_free_size() < size);
+
+    list_remove(&waiter.node);
+}
+
+static void
+uart_write_sync(const uint8_t *bytes, size_t size)
+{
+    while (cbuf_size(&uart_tx_cbuf) != 0) {
+        uart_tx_poll();
+    }
+
+    for (size_t i = 0; i < size; i++) {
+        while (!uart_tx_ready());
+        io_write(UART_COM1_PORT + UART_REG_DAT, bytes[i]);
+    }
+}
+
+static bool
+uart_rx_ready(void)
+{
+    return io_read(UART_COM1_PORT + UART_REG_LSR) & UART_LSR_DATA_READY;
+}
+
+/*
+ * Move all received bytes to the receive buffer, and return their number.
+ *
+ * Interrupts must be disabled when calling this function.
+ */
+static unsigned int
+uart_rx_drain(void)
+{
+    unsigned int nr_bytes, nr_dropped;
+    uint8_t byte;
+    int error;
+
+    nr_bytes = 0;
+    nr_dropped = 0;
+
+    while (uart_rx_ready()) {
+        byte = io_read(UART_COM1_PORT + UART_REG_DAT);
+        error = cbuf_pushb(&uart_cbuf, byte, false);
+
+        if (error) {
+            nr_dropped++;
+        }
+
+        nr_bytes++;
+    }
+
+    if (nr_dropped != 0) {
+        printf("uart: error: buffer full, %u bytes dropped\n", nr_dropped);
+    }
+
+    if (nr_bytes != nr_dropped) {
+        thread_wakeup(uart_waiter);
+
+        if (uart_source) {
+            waitset_source_notify(uart_source);
+        }
+    }
+
+    return nr_bytes;
+}
+
+#ifdef UART_POLL
+
+/*
+ * Under sustained input, the receive interrupt is disabled, and the
+ * receive FIFO is drained by a periodic timer instead, which batches
+ * more bytes per wakeup. The interrupt is enabled again as soon as a
+ * poll finds no data. The timer runs in interrupt context, which makes
+ * polling inaccurate without a local APIC.
+ */
+static struct hrtimer uart_poll_timer;
+
+static void
+uart_poll_schedule(void)
+{
+    hrtimer_schedule(&uart_poll_timer, clock_now_ns() + UART_POLL_PERIOD);
+}
+
+static void
+uart_poll_run(void *arg)
+{
     (void)arg;
 
-    byte = io_read(UART_COM1_PORT + UART_REG_DAT);
-    error = cbuf_pushb(&uart_cbuf, byte, false);
+    if (uart_rx_drain() == 0) {
+        uart_set_ier(uart_ier | UART_IER_DATA);
+    } else {
+        uart_poll_schedule();
+    }
+}
+
+static void
+uart_poll_init(void)
+{
+    hrtimer_init(&uart_poll_timer, uart_poll_run, NULL, HRTIMER_HARDIRQ);
+}
 
-    if (error) {
-        printf("uart: error: buffer full\n");
-        return;
+static void
+uart_poll_update(unsigned int nr_bytes)
+{
+    if (nr_bytes >= UART_POLL_THRESHOLD) {
+        uart_set_ier(uart_ier & ~UART_IER_DATA);
+        uart_poll_schedule();
     }
+}
 
-    thread_wakeup(uart_waiter);
+#else /* UART_POLL */
+
+#define uart_poll_init()
+#define uart_poll_update(nr_bytes) ((void)(nr_bytes))
+
+#endif /* UART_POLL */
+
+static void
+uart_rx_intr(void)
+{
+    unsigned int nr_bytes;
+
+    nr_bytes = uart_rx_drain();
+    uart_poll_update(nr_bytes);
+}
+
+static void
+uart_irq_handler(void *arg)
+{
+    uint8_t iir;
+
+    (void)arg;
+
+    for (;;) {
+        iir = io_read(UART_COM1_PORT + UART_REG_IIR);
+
+        if (iir & UART_IIR_NONE) {
+            break;
+        }
+
+        switch (iir & UART_IIR_ID_MASK) {
+        case UART_IIR_ID_DATA:
+        case UART_IIR_ID_TIMEOUT:
+            uart_rx_intr();
+            break;
+        case UART_IIR_ID_THRE:
+            uart_tx_fill();
+            break;
+        case UART_IIR_ID_LINE:
+            io_read(UART_COM1_PORT + UART_REG_LSR);
+            break;
+        case UART_IIR_ID_MODEM:
+            io_read(UART_COM1_PORT + UART_REG_MSR);
+            break;
+        }
+    }
 }
 
 void
 uart_setup(void)
 {
+    uint8_t iir;
+
     cbuf_init(&uart_cbuf, uart_buffer, sizeof(uart_buffer));
+    cbuf_init(&uart_tx_cbuf, uart_tx_buffer, sizeof(uart_tx_buffer));
+    uart_poll_init();
 
     io_write(UART_COM1_PORT + UART_REG_LCR, UART_LCR_DLAB);
     io_write(UART_COM1_PORT + UART_REG_DIVL, UART_DIVISOR);
@@ -97,16 +439,92 @@ uart_setup(void)
     io_write(UART_COM1_PORT + UART_REG_LCR, UART_LCR_8BITS | UART_LCR_STOP1
                                             | UART_LCR_PARITY_NONE);
 
+    /*
+     * Enable the FIFOs, and check that they're actually there, since
+     * the 8250 and 16450 don't have any.
+     */
+    io_write(UART_COM1_PORT + UART_REG_FCR, UART_FCR_ENABLE
+                                            | UART_FCR_CLEAR_RX
+                                            | UART_FCR_CLEAR_TX
+                                            | UART_FCR_TRIGGER_8);
+    iir = io_read(UART_COM1_PORT + UART_REG_IIR);
+
+    if ((iir & UART_IIR_FIFO_MASK) == UART_IIR_FIFO_MASK) {
+        uart_tx_fifo_size = UART_FIFO_SIZE;
+    }
+
     /* TODO Explain order */
     cpu_irq_register(UART_IRQ, uart_irq_handler, NULL);
-    io_write(UART_COM1_PORT + UART_REG_IER, UART_IER_DATA);
+    uart_set_ier(UART_IER_DATA);
+    uart_tx_sync = false;
 }
 
 void
 uart_write(uint8_t byte)
 {
-    /* TODO Check the output buffer */
-    io_write(UART_COM1_PORT + UART_REG_DAT, byte);
+    uart_write_buf(&byte, 1);
+}
+
+void
+uart_write_buf(const void *buf, size_t size)
+{
+    const uint8_t *bytes;
+    uint32_t eflags;
+    bool can_sleep;
+    size_t chunk;
+    int error;
+
+    bytes = buf;
+    can_sleep = thread_preempt_enabled() && cpu_intr_enabled();
+
+    thread_preempt_disable();
+    eflags = cpu_intr_save();
+
+    if (uart_tx_sync) {
+        uart_write_sync(bytes, size);
+        goto out;
+    }
+
+    while (size != 0) {
+        chunk = MIN(size, cbuf_capacity(&uart_tx_cbuf));
+
+        if (uart_tx_free_size() < chunk) {
+            if (can_sleep) {
+                uart_tx_wait(chunk);
+            } else {
+                uart_tx_poll();
+            }
+
+            continue;
+        }
+
+        error = cbuf_push(&uart_tx_cbuf, bytes, chunk, false);
+        assert(!error);
+        bytes += chunk;
+        size -= chunk;
+
+        uart_tx_fill();
+    }
+
+out:
+    cpu_intr_restore(eflags);
+    thread_preempt_enable();
+}
+
+void
+uart_sync(void)
+{
+    uint32_t eflags;
+
+    eflags = cpu_intr_save();
+
+    uart_tx_sync = true;
+
+    while (cbuf_size(&uart_tx_cbuf) != 0) {
+        uart_tx_poll();
+    }
+
+    cpu_intr_restore(eflags);
 }
 
 int
@@ -142,3 +560,31 @@ out:
 
     return error;
 }
+
+int
+uart_try_read(uint8_t *byte)
+{
+    uint32_t eflags;
+    int error;
+
+    eflags = cpu_intr_save();
+    error = cbuf_popb(&uart_cbuf, byte);
+    cpu_intr_restore(eflags);
+
+    return error;
+}
+
+void
+uart_set_source(struct waitset_source *source)
+{
+    uint32_t eflags;
+
+    eflags = cpu_intr_save();
+    uart_source = source;
+
+    if (source && (cbuf_size(&uart_cbuf) != 0)) {
+        waitset_source_notify(source);
+    }
+
+    cpu_intr_restore(eflags);
+}
@@ -19,15 +19,69 @@
  * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
  * SOFTWARE.
+ *
+ *
+ * 16550 UART driver.
+ *
+ * The FIFOs are enabled when available, and the receive FIFO raises an
+ * interrupt once it holds 8 bytes, or when input pauses. Each interrupt
+ * drains all received bytes.
+ *
+ * Receive polling
+ * ---------------
+ * When built with the UART_POLL macro defined, e.g. with
+ * $ make CPPFLAGS=-DUART_POLL
+ * an interrupt that finds the receive FIFO at its trigger level switches
+ * the driver to polling, i.e. the receive interrupt is disabled and a
+ * high resolution timer drains the FIFO periodically, until a poll finds
+ * no data. This reduces the interrupt rate under sustained input.
  */
 
 #ifndef _UART_H
 #define _UART_H
 
+#include <stddef.h>
 #include <stdint.h>
 
+#include "waitset.h"
+
 void uart_setup(void);
 void uart_write(uint8_t byte);
+
+/*
+ * Write a buffer.
+ *
+ * Output is queued in a transmit ring drained by the transmitter interrupt.
+ * When the ring is full, the calling thread sleeps if it can, i.e. if
+ * preemption and interrupts are enabled. Otherwise, the transmitter is
+ * polled until there is enough room.
+ */
+void uart_write_buf(const void *buf, size_t size);
+
+/*
+ * Flush the transmit ring and make all subsequent output synchronous.
+ *
+ * This function is meant to be called when the system is about to stop,
+ * e.g. on panic, so that output doesn't depend on interrupts.
+ */
+void uart_sync(void);
+
 int uart_read(uint8_t *byte);
 
+/*
+ * Read a byte without blocking.
+ *
+ * If no data are available, ERROR_AGAIN is returned.
+ */
+int uart_try_read(uint8_t *byte);
+
+/*
+ * Set the event source notified when data are received.
+ *
+ * This allows a thread to wait for input on a wait set along with other
+ * event sources, and then drain the input with uart_try_read(). Passing
+ * NULL unsets the source.
+ */
+void uart_set_source(struct waitset_source *source);
+
 #endif /* _UART_H */
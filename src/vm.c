@@ -0,0 +1,399 @@
+/*
+ * Copyright (c) 2017 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <lib/macros.h>
+
+#include "boot.h"
+#include "cpu.h"
+#include "idle.h"
+#include "page.h"
+#include "panic.h"
+#include "thread.h"
+#include "vm.h"
+
+/*
+ * Page table entry flags.
+ */
+#define VM_PTE_PRESENT      0x001
+#define VM_PTE_WRITE        0x002
+#define VM_PTE_PWT          0x008
+#define VM_PTE_PCD          0x010
+#define VM_PTE_LARGE        0x080
+#define VM_PTE_ADDR_MASK    0xfffff000
+
+#define VM_NR_PTES          1024
+#define VM_LARGE_PAGE_SHIFT 22
+#define VM_LARGE_PAGE_SIZE  (1 << VM_LARGE_PAGE_SHIFT)
+
+/*
+ * Memory mapped registers of the I/O and local APICs, at their default
+ * physical addresses.
+ */
+#define VM_MMIO_START 0xfec00000
+
+/*
+ * Virtual memory reserved for stacks, right below the MMIO page.
+ *
+ * Physical memory is identity mapped, and must end below this range.
+ */
+#define VM_STACK_AREA_SIZE  (64 << 20)
+#define VM_STACK_AREA_START (VM_MMIO_START - VM_STACK_AREA_SIZE)
+#define VM_NR_STACK_SLOTS   (VM_STACK_AREA_SIZE / VM_STACK_SLOT_SIZE)
+
+/*
+ * Number of zeroed pages kept for the page fault handler.
+ */
+#define VM_RESERVE_SIZE 32
+
+static uint32_t *vm_pdir;
+
+/*
+ * Page tables of the stack area.
+ *
+ * They're allocated as a single block, so that the page table entry of
+ * a page is found by indexing this array with its offset in the area.
+ */
+static uint32_t *vm_stack_ptes;
+
+/*
+ * Lowest valid address of the stack in each slot, or 0 if the slot is free.
+ *
+ * Every page of a slot below that address is a guard page.
+ */
+static uintptr_t vm_stack_bases[VM_NR_STACK_SLOTS];
+
+/*
+ * Reserve of zeroed pages for the page fault handler.
+ *
+ * Since the handler may interrupt code with preemption disabled, slots
+ * are only ever accessed with single word loads and stores, and a slot
+ * is only filled if it's empty. Threads disable preemption when filling
+ * slots, so that they don't compete for the same slot.
+ */
+static void *vm_reserve[VM_RESERVE_SIZE];
+
+static struct idle_work vm_reserve_work;
+
+static void
+vm_map_large(uintptr_t addr, uint32_t flags)
+{
+    assert(P2ALIGNED(addr, VM_LARGE_PAGE_SIZE));
+    vm_pdir[addr >> VM_LARGE_PAGE_SHIFT] = addr
+                                           | VM_PTE_PRESENT
+                                           | VM_PTE_LARGE
+                                           | flags;
+}
+
+static uint32_t *
+vm_stack_lookup_pte(uintptr_t addr)
+{
+    assert((addr >= VM_STACK_AREA_START)
+           && (addr < (VM_STACK_AREA_START + VM_STACK_AREA_SIZE)));
+    return &vm_stack_ptes[(addr - VM_STACK_AREA_START) >> PAGE_SHIFT];
+}
+
+static size_t
+vm_stack_get_slot(uintptr_t addr)
+{
+    return (addr - VM_STACK_AREA_START) / VM_STACK_SLOT_SIZE;
+}
+
+static uintptr_t
+vm_stack_slot_end(size_t slot)
+{
+    return VM_STACK_AREA_START + ((slot + 1) * VM_STACK_SLOT_SIZE);
+}
+
+/*
+ * Return true if the reserve is full.
+ */
+static bool
+vm_reserve_full(void)
+{
+    bool full;
+
+    full = true;
+    thread_preempt_disable();
+
+    for (size_t i = 0; i < ARRAY_SIZE(vm_reserve); i++) {
+        if (!vm_reserve[i]) {
+            full = false;
+            break;
+        }
+    }
+
+    thread_preempt_enable();
+    return full;
+}
+
+/*
+ * Add a zeroed page to the reserve.
+ *
+ * Return true if a page was added, false if the reserve is full or if
+ * there is no free page.
+ */
+static bool
+vm_reserve_fill(void)
+{
+    bool stored;
+    void *page;
+
+    if (vm_reserve_full()) {
+        return false;
+    }
+
+    page = page_alloc_zeroed(0);
+
+    if (!page) {
+        return false;
+    }
+
+    stored = false;
+    thread_preempt_disable();
+
+    for (size_t i = 0; i < ARRAY_SIZE(vm_reserve); i++) {
+        if (!vm_reserve[i]) {
+            vm_reserve[i] = page;
+            stored = true;
+            break;
+        }
+    }
+
+    thread_preempt_enable();
+
+    if (!stored) {
+        page_free(page);
+    }
+
+    return stored;
+}
+
+static void *
+vm_reserve_take(void)
+{
+    void *page;
+
+    assert(!cpu_intr_enabled());
+
+    for (size_t i = 0; i < ARRAY_SIZE(vm_reserve); i++) {
+        page = vm_reserve[i];
+
+        if (page) {
+            vm_reserve[i] = NULL;
+            return page;
+        }
+    }
+
+    return NULL;
+}
+
+static bool
+vm_reserve_work_run(void *arg)
+{
+    (void)arg;
+    return vm_reserve_fill();
+}
+
+static void
+vm_page_fault(uintptr_t addr, uint32_t error)
+{
+    uintptr_t base;
+    uint32_t *pte;
+    void *page;
+
+    if ((addr < VM_STACK_AREA_START)
+        || (addr >= (VM_STACK_AREA_START + VM_STACK_AREA_SIZE))) {
+        panic("vm: page fault at %#x, error: %#x",
+              (unsigned int)addr, (unsigned int)error);
+    }
+
+    base = vm_stack_bases[vm_stack_get_slot(addr)];
+
+    if ((base == 0) || (addr < base)) {
+        panic("vm: stack overflow at %#x, thread: %s",
+              (unsigned int)addr, thread_name(thread_self()));
+    }
+
+    pte = vm_stack_lookup_pte(addr);
+    assert(!(*pte & VM_PTE_PRESENT));
+
+    page = vm_reserve_take();
+
+    if (!page) {
+        panic("vm: unable to map stack page at %#x", (unsigned int)addr);
+    }
+
+    *pte = (uint32_t)page | VM_PTE_PRESENT | VM_PTE_WRITE;
+}
+
+void
+vm_setup(void)
+{
+    const struct boot_mem_region *regions;
+    const struct boot_module *modules;
+    unsigned int nr_regions, nr_modules;
+    uintptr_t end;
+
+    if (!cpu_has_pse()) {
+        panic("vm: large pages not supported");
+    }
+
+    vm_pdir = page_alloc_zeroed(0);
+    vm_stack_ptes = page_alloc_zeroed(page_order(VM_STACK_AREA_SIZE
+                                                 / PAGE_SIZE
+                                                 * sizeof(uint32_t)));
+
+    if (!vm_pdir || !vm_stack_ptes) {
+        panic("vm: unable to allocate page tables");
+    }
+
+    regions = boot_get_mem_regions(&nr_regions);
+    end = 0;
+
+    for (unsigned int i = 0; i < nr_regions; i++) {
+        if (regions[i].end > end) {
+            end = regions[i].end;
+        }
+    }
+
+    modules = boot_get_modules(&nr_modules);
+
+    for (unsigned int i = 0; i < nr_modules; i++) {
+        if (modules[i].end > end) {
+            end = modules[i].end;
+        }
+    }
+
+    if (end > VM_STACK_AREA_START) {
+        panic("vm: physical memory overlaps stack area");
+    }
+
+    for (uintptr_t addr = 0; addr < end; addr += VM_LARGE_PAGE_SIZE) {
+        vm_map_large(addr, VM_PTE_WRITE);
+    }
+
+    vm_map_large(VM_MMIO_START, VM_PTE_WRITE | VM_PTE_PCD | VM_PTE_PWT);
+
+    for (size_t i = 0; i < (VM_STACK_AREA_SIZE / VM_LARGE_PAGE_SIZE); i++) {
+        vm_pdir[(VM_STACK_AREA_START >> VM_LARGE_PAGE_SHIFT) + i]
+            = (uint32_t)&vm_stack_ptes[i * VM_NR_PTES]
+              | VM_PTE_PRESENT
+              | VM_PTE_WRITE;
+    }
+
+    cpu_page_fault_register(vm_page_fault);
+    cpu_enable_paging(vm_pdir);
+
+    while (vm_reserve_fill());
+
+    idle_work_init(&vm_reserve_work, vm_reserve_work_run, NULL);
+    idle_work_register(&vm_reserve_work);
+}
+
+void *
+vm_stack_alloc(size_t size)
+{
+    uintptr_t base, end;
+    size_t slot;
+    uint32_t *pte;
+    void *page;
+
+    if ((size == 0) || (size > VM_STACK_MAX_SIZE)) {
+        return NULL;
+    }
+
+    /*
+     * The top page is used as soon as the thread starts, map it right away.
+     */
+    page = page_alloc_zeroed(0);
+
+    if (!page) {
+        return NULL;
+    }
+
+    thread_preempt_disable();
+
+    for (slot = 0; slot < ARRAY_SIZE(vm_stack_bases); slot++) {
+        if (vm_stack_bases[slot] == 0) {
+            break;
+        }
+    }
+
+    if (slot == ARRAY_SIZE(vm_stack_bases)) {
+        thread_preempt_enable();
+        page_free(page);
+        return NULL;
+    }
+
+    end = vm_stack_slot_end(slot);
+    base = end - P2ROUND(size, PAGE_SIZE);
+    vm_stack_bases[slot] = base;
+
+    thread_preempt_enable();
+
+    pte = vm_stack_lookup_pte(end - PAGE_SIZE);
+    assert(*pte == 0);
+    *pte = (uint32_t)page | VM_PTE_PRESENT | VM_PTE_WRITE;
+
+    /*
+     * Thread creation is a good time to refill the reserve, since the
+     * new thread is likely to fault on its stack soon.
+     */
+    while (vm_reserve_fill());
+
+    return (void *)base;
+}
+
+void
+vm_stack_free(void *stack)
+{
+    uintptr_t base, end;
+    uint32_t *pte;
+    size_t slot;
+    void *page;
+
+    base = (uintptr_t)stack;
+    slot = vm_stack_get_slot(base);
+    assert(slot < ARRAY_SIZE(vm_stack_bases));
+    assert(vm_stack_bases[slot] == base);
+    end = vm_stack_slot_end(slot);
+
+    for (uintptr_t addr = base; addr < end; addr += PAGE_SIZE) {
+        pte = vm_stack_lookup_pte(addr);
+
+        if (*pte & VM_PTE_PRESENT) {
+            page = (void *)(*pte & VM_PTE_ADDR_MASK);
+            *pte = 0;
+            cpu_invlpg((void *)addr);
+            page_free(page);
+        }
+    }
+
+    thread_preempt_disable();
+    vm_stack_bases[slot] = 0;
+    thread_preempt_enable();
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2017 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ *
+ * Virtual memory.
+ *
+ * Paging is enabled with an identity map of physical memory, built with
+ * 4 MiB pages, so that the kernel image, the heap and the page pool keep
+ * their addresses while using very few TLB entries.
+ *
+ * Thread stacks are allocated in a separate range of virtual memory,
+ * divided in fixed-size slots. The lowest page of each slot is never
+ * mapped, and acts as a guard, so that a stack overflow causes a page
+ * fault instead of silently corrupting nearby memory. Only the top page
+ * of a stack is mapped on allocation. The other pages are mapped on
+ * demand, when first touched, so that threads only consume the memory
+ * they actually use.
+ *
+ * Page faults are handled by a separate task, which can't allocate pages
+ * directly, since it can't use the page allocator mutex. Instead, stack
+ * pages are taken from a reserve of zeroed pages, refilled when stacks
+ * are allocated, and by the idle thread. A fault that can't be serviced,
+ * including a stack overflow, is fatal.
+ */
+
+#ifndef _VM_H
+#define _VM_H
+
+#include <stddef.h>
+
+#include "page.h"
+
+/*
+ * Maximum size of a stack.
+ *
+ * A stack slot includes its guard page.
+ */
+#define VM_STACK_SLOT_SIZE  (128 * 1024)
+#define VM_STACK_MAX_SIZE   (VM_STACK_SLOT_SIZE - PAGE_SIZE)
+
+/*
+ * Initialize the vm module and enable paging.
+ *
+ * The page allocator must be initialized before calling this function,
+ * and stacks may be allocated once it returns.
+ */
+void vm_setup(void);
+
+/*
+ * Allocate a stack.
+ *
+ * Return the lowest address of the stack, or NULL if the size is larger
+ * than VM_STACK_MAX_SIZE or if there isn't enough memory. The size is
+ * rounded up to the page size. Stack pages are zeroed.
+ */
+void * vm_stack_alloc(size_t size);
+
+/*
+ * Release a stack.
+ *
+ * The address must have been returned by vm_stack_alloc().
+ */
+void vm_stack_free(void *stack);
+
+#endif /* _VM_H */
@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) 2017 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <lib/list.h>
+
+#include "cpu.h"
+#include "error.h"
+#include "thread.h"
+#include "timer.h"
+#include "waitset.h"
+
+/*
+ * Timeout function.
+ *
+ * The timer is run in interrupt context, so that it can be cancelled
+ * and released as soon as the wait completes.
+ */
+static void
+waitset_timeout_run(void *arg)
+{
+    struct waitset *waitset;
+
+    waitset = arg;
+    waitset->timed_out = true;
+    thread_wakeup(waitset->waiter);
+}
+
+void
+waitset_source_init(struct waitset_source *source)
+{
+    source->waitset = NULL;
+    source->ready = false;
+}
+
+static void
+waitset_queue_source(struct waitset *waitset, struct waitset_source *source)
+{
+    assert(!cpu_intr_enabled());
+    assert(source->ready);
+
+    list_insert_tail(&waitset->ready_sources, &source->node);
+    thread_wakeup(waitset->waiter);
+}
+
+void
+waitset_source_notify(struct waitset_source *source)
+{
+    uint32_t eflags;
+
+    eflags = cpu_intr_save();
+
+    if (!source->ready) {
+        source->ready = true;
+
+        if (source->waitset) {
+            waitset_queue_source(source->waitset, source);
+        }
+    }
+
+    cpu_intr_restore(eflags);
+}
+
+void
+waitset_init(struct waitset *waitset)
+{
+    list_init(&waitset->ready_sources);
+    waitset->waiter = NULL;
+    waitset->timed_out = false;
+}
+
+void
+waitset_add(struct waitset *waitset, struct waitset_source *source)
+{
+    uint32_t eflags;
+
+    eflags = cpu_intr_save();
+
+    assert(!source->waitset);
+    source->waitset = waitset;
+
+    if (source->ready) {
+        waitset_queue_source(waitset, source);
+    }
+
+    cpu_intr_restore(eflags);
+}
+
+void
+waitset_remove(struct waitset *waitset, struct waitset_source *source)
+{
+    uint32_t eflags;
+
+    eflags = cpu_intr_save();
+
+    assert(source->waitset == waitset);
+    source->waitset = NULL;
+
+    if (source->ready) {
+        list_remove(&source->node);
+    }
+
+    cpu_intr_restore(eflags);
+}
+
+/*
+ * Report ready sources.
+ *
+ * Interrupts must be disabled when calling this function.
+ */
+static size_t
+waitset_pop_sources(struct waitset *waitset, struct waitset_source **sources,
+                    size_t max_sources)
+{
+    struct waitset_source *source;
+    size_t i;
+
+    for (i = 0;
+         (i < max_sources) && !list_empty(&waitset->ready_sources);
+         i++) {
+        source = list_first_entry(&waitset->ready_sources,
+                                  struct waitset_source, node);
+        list_remove(&source->node);
+        source->ready = false;
+        sources[i] = source;
+    }
+
+    return i;
+}
+
+static int
+waitset_wait_common(struct waitset *waitset, struct waitset_source **sources,
+                    size_t *nr_sourcesp, bool timed, unsigned long ticks)
+{
+    struct timer timer;
+    uint32_t eflags;
+    size_t nr_sources;
+    int error;
+
+    assert(*nr_sourcesp != 0);
+
+    thread_preempt_disable();
+    eflags = cpu_intr_save();
+
+    if (waitset->waiter) {
+        cpu_intr_restore(eflags);
+        thread_preempt_enable();
+        return ERROR_BUSY;
+    }
+
+    waitset->waiter = thread_self();
+    waitset->timed_out = false;
+
+    if (timed) {
+        timer_init(&timer, waitset_timeout_run, waitset, TIMER_INTR);
+        timer_schedule(&timer, ticks);
+    }
+
+    while (list_empty(&waitset->ready_sources) && !waitset->timed_out) {
+        thread_sleep();
+    }
+
+    if (timed) {
+        error = timer_cancel(&timer);
+        assert(error != ERROR_BUSY);
+    }
+
+    nr_sources = waitset_pop_sources(waitset, sources, *nr_sourcesp);
+    error = (nr_sources == 0) ? ERROR_TIMEDOUT : 0;
+
+    waitset->waiter = NULL;
+
+    cpu_intr_restore(eflags);
+    thread_preempt_enable();
+
+    *nr_sourcesp = nr_sources;
+    return error;
+}
+
+int
+waitset_wait(struct waitset *waitset, struct waitset_source **sources,
+             size_t *nr_sourcesp)
+{
+    return waitset_wait_common(waitset, sources, nr_sourcesp, false, 0);
+}
+
+int
+waitset_timedwait(struct waitset *waitset, struct waitset_source **sources,
+                  size_t *nr_sourcesp, unsigned long ticks)
+{
+    return waitset_wait_common(waitset, sources, nr_sourcesp, true, ticks);
+}
@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2017 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ *
+ * Wait set module.
+ *
+ * A wait set allows a thread to wait on multiple event sources at once,
+ * much like the poll() and select() Unix system calls, or the
+ * WaitForMultipleObjects() Windows function. Event sources are added to
+ * a wait set, and notified by their producer when an event occurs, e.g.
+ * from an interrupt handler when data are received, from a timer function
+ * when it expires, or from another thread, the way a condition variable
+ * would be signalled. A thread waiting on the wait set is then awaken and
+ * obtains all the sources that became ready in a single call.
+ *
+ * Sources are edge-triggered, i.e. a source becomes ready once notified,
+ * and stops being ready once reported by a wait function. Notifying a
+ * source that is already ready has no additional effect. The consumer
+ * must therefore fully process the events of a source reported ready,
+ * e.g. read all the available data, before waiting again.
+ *
+ * Here is an example of a thread waiting for either input from the UART
+ * or a timer to expire :
+ *
+ * static struct waitset ws;
+ * static struct waitset_source uart_source;
+ * static struct waitset_source timer_source;
+ * static struct timer timer;
+ *
+ * static void
+ * timer_fn(void *arg)
+ * {
+ *     waitset_source_notify(arg);
+ * }
+ *
+ * void
+ * run(void)
+ * {
+ *     struct waitset_source *sources[2];
+ *     size_t nr_sources;
+ *
+ *     waitset_init(&ws);
+ *     waitset_source_init(&uart_source);
+ *     waitset_source_init(&timer_source);
+ *     waitset_add(&ws, &uart_source);
+ *     waitset_add(&ws, &timer_source);
+ *     uart_set_source(&uart_source);
+ *     timer_init(&timer, timer_fn, &timer_source);
+ *     timer_schedule(&timer, timer_now() + 10);
+ *
+ *     for (;;) {
+ *         nr_sources = ARRAY_SIZE(sources);
+ *         waitset_wait(&ws, sources, &nr_sources);
+ *
+ *         for (size_t i = 0; i < nr_sources; i++) {
+ *             ...
+ *         }
+ *     }
+ * }
+ */
+
+#ifndef _WAITSET_H
+#define _WAITSET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <lib/list.h>
+
+struct thread;
+
+/*
+ * Event source type.
+ *
+ * All members are private.
+ */
+struct waitset_source {
+    struct list node;
+    struct waitset *waitset;
+    bool ready;
+};
+
+/*
+ * Wait set type.
+ *
+ * All members are private.
+ */
+struct waitset {
+    struct list ready_sources;
+    struct thread *waiter;
+    bool timed_out;
+};
+
+/*
+ * Initialize an event source.
+ *
+ * The source is initially not ready, and not part of any wait set.
+ */
+void waitset_source_init(struct waitset_source *source);
+
+/*
+ * Notify an event source.
+ *
+ * The source becomes ready, and if it's part of a wait set, the thread
+ * waiting on that wait set, if any, is awaken.
+ *
+ * This function may be called from interrupt context.
+ */
+void waitset_source_notify(struct waitset_source *source);
+
+/*
+ * Initialize a wait set.
+ */
+void waitset_init(struct waitset *waitset);
+
+/*
+ * Add an event source to a wait set.
+ *
+ * A source may only be part of one wait set at a time. If the source is
+ * already ready, it's immediately reported by the next wait.
+ */
+void waitset_add(struct waitset *waitset, struct waitset_source *source);
+
+/*
+ * Remove an event source from a wait set.
+ *
+ * The ready state of the source is preserved.
+ */
+void waitset_remove(struct waitset *waitset, struct waitset_source *source);
+
+/*
+ * Wait for events on a wait set.
+ *
+ * The calling thread sleeps until at least one source of the given
+ * wait set is ready. On entry, the nr_sourcesp argument points to the
+ * size of the sources array, which must be at least 1. On exit, it's
+ * updated to the number of sources actually reported ready, which are
+ * stored in the sources array. If more sources are ready than the
+ * array can hold, the remaining sources are reported by the next wait.
+ *
+ * Only one thread may wait on a wait set at a time. If another thread
+ * is already waiting, ERROR_BUSY is returned.
+ */
+int waitset_wait(struct waitset *waitset, struct waitset_source **sources,
+                 size_t *nr_sourcesp);
+
+/*
+ * Wait for events on a wait set, with a deadline.
+ *
+ * This is the timed variant of waitset_wait(). The deadline is an
+ * absolute time in ticks, as returned by timer_now(). If the deadline
+ * is reached before any source is ready, ERROR_TIMEDOUT is returned,
+ * and the value pointed to by nr_sourcesp is set to 0.
+ */
+int waitset_timedwait(struct waitset *waitset, struct waitset_source **sources,
+                      size_t *nr_sourcesp, unsigned long ticks);
+
+#endif /* _WAITSET_H */
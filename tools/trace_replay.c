@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2017 Richard Braun.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ *
+ * Host build of the allocation trace replay.
+ *
+ * This program replays a trace through the host C library allocator,
+ * using the same code as the bench_trace shell command, so that results
+ * can be compared with those of the kernel allocator. Build it with
+ * $ make trace_replay
+ * and run it with
+ * $ ./trace_replay src/bench.trace
+ *
+ * The trace, the parsed operations and the block table are mapped with
+ * mmap(2), so that they don't disturb the heap.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include <lib/trace.h>
+
+static struct trace_stats trace_replay_stats;
+
+/*
+ * Use the time stamp counter when available, so that latencies are in
+ * the same units as in the kernel. Fall back to nanoseconds otherwise.
+ */
+static uint64_t
+trace_replay_clock(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+#endif
+}
+
+static const struct trace_allocator trace_replay_allocator = {
+    .alloc = malloc,
+    .realloc = realloc,
+    .free = free,
+    .clock = trace_replay_clock,
+};
+
+static void *
+trace_replay_map(size_t size)
+{
+    void *ptr;
+
+    ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return (ptr == MAP_FAILED) ? NULL : ptr;
+}
+
+int
+main(int argc, char **argv)
+{
+    struct trace_block *blocks;
+    struct trace_info info;
+    struct trace_op *ops;
+    struct stat st;
+    const char *text;
+    int fd, error;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <trace>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    fd = open(argv[1], O_RDONLY);
+
+    if ((fd < 0) || (fstat(fd, &st) != 0) || (st.st_size == 0)) {
+        fprintf(stderr, "trace_replay: error: unable to open %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (text == MAP_FAILED) {
+        fprintf(stderr, "trace_replay: error: unable to map %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    error = trace_parse(text, st.st_size, NULL, &info);
+
+    if (error) {
+        fprintf(stderr, "trace_replay: error: invalid trace at line %lu\n",
+                info.line);
+        return EXIT_FAILURE;
+    }
+
+    if (info.nr_ops == 0) {
+        fprintf(stderr, "trace_replay: error: empty trace\n");
+        return EXIT_FAILURE;
+    }
+
+    if ((info.nr_ops > (SIZE_MAX / sizeof(*ops)))
+        || (info.nr_blocks > (SIZE_MAX / sizeof(*blocks)))) {
+        fprintf(stderr, "trace_replay: error: trace too large\n");
+        return EXIT_FAILURE;
+    }
+
+    ops = trace_replay_map(info.nr_ops * sizeof(*ops));
+    blocks = trace_replay_map(info.nr_blocks * sizeof(*blocks));
+
+    if (!ops || !blocks) {
+        fprintf(stderr, "trace_replay: error: unable to allocate memory\n");
+        return EXIT_FAILURE;
+    }
+
+    trace_parse(text, st.st_size, ops, &info);
+    trace_replay(ops, info.nr_ops, blocks, info.nr_blocks,
+                 &trace_replay_allocator, &trace_replay_stats);
+    trace_stats_print(&trace_replay_stats, "trace_replay");
+
+#ifdef __GLIBC__
+    {
+        struct mallinfo2 mi;
+
+        mi = mallinfo2();
+        printf("trace_replay: final heap footprint: %zu bytes, "
+               "free: %zu bytes\n", mi.arena + mi.hblkhd, mi.fordblks);
+    }
+#endif
+
+    trace_release(blocks, info.nr_blocks, &trace_replay_allocator);
+    close(fd);
+    return EXIT_SUCCESS;
+}